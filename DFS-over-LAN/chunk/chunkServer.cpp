@@ -1,13 +1,19 @@
 #include "chunkServer.h"
 #include "encodingUtils.h"
 
+#include <QDateTime>
 #include <QDebug>
+#include <QFileInfo>
 #include <QRandomGenerator>
+#include <QStorageInfo>
 
-static constexpr int CHUNK_SIZE = 8 * 1024;
+// the largest reply to a RETRIEVE without a sequence number, which is sent
+// as one datagram
+static constexpr int MAX_SINGLE_DATAGRAM = 60 * 1024;
 
-ChunkServer::ChunkServer(int serverId, const QHostAddress& localIp, QObject* parent)
-    : QObject(parent), serverId(serverId), localIp(localIp) {
+ChunkServer::ChunkServer(int serverId, const QHostAddress& localIp,
+                         const QHostAddress& masterIp, quint16 masterPort, QObject* parent)
+    : QObject(parent), serverId(serverId), localIp(localIp), masterIp(masterIp), masterPort(masterPort) {
     listenPort = BASE_CHUNK_PORT + serverId;
     storageDir = QString("./CHUNK-%1").arg(serverId);
     QDir dir(storageDir);
@@ -15,7 +21,39 @@ ChunkServer::ChunkServer(int serverId, const QHostAddress& localIp, QObject* par
     if (!dir.exists())
         dir.mkpath(".");
 
-    udpSocket = new QUdpSocket(this);}
+    udpSocket = new QUdpSocket(this);
+
+    clock.start();
+    sweepTimer = new QTimer(this);
+    sweepTimer->setInterval(SWEEP_INTERVAL_MS);
+    connect(sweepTimer, &QTimer::timeout, this, &ChunkServer::onSweepTimer);
+
+    nextReplicationSeq = QRandomGenerator::global()->generate() | 1;
+    replicationTimer = new QTimer(this);
+    replicationTimer->setInterval(REPLICATION_RETRY_MS / 2);
+    connect(replicationTimer, &QTimer::timeout, this, &ChunkServer::onReplicationTimer);
+
+    masterSocket = new QTcpSocket(this);
+    connect(masterSocket, &QTcpSocket::connected, this, &ChunkServer::onMasterConnected);
+    connect(masterSocket, &QTcpSocket::disconnected, this, &ChunkServer::onMasterDisconnected);
+    connect(masterSocket, &QTcpSocket::errorOccurred, this, &ChunkServer::onMasterDisconnected);
+    connect(masterSocket, &QTcpSocket::readyRead, this, &ChunkServer::onMasterReadyRead);
+
+    heartbeatTimer = new QTimer(this);
+    heartbeatTimer->setInterval(HEARTBEAT_INTERVAL_MS);
+    connect(heartbeatTimer, &QTimer::timeout, this, &ChunkServer::sendHeartbeat);
+
+    inventoryTimer = new QTimer(this);
+    inventoryTimer->setInterval(INVENTORY_INTERVAL_MS);
+    connect(inventoryTimer, &QTimer::timeout, this, &ChunkServer::reportInventory);
+
+    reconnectTimer = new QTimer(this);
+    reconnectTimer->setSingleShot(true);
+    reconnectTimer->setInterval(RECONNECT_INTERVAL_MS);
+    connect(reconnectTimer, &QTimer::timeout, this, [this]() {
+        masterSocket->connectToHost(this->masterIp, this->masterPort);
+    });
+}
 
 void ChunkServer::start() {
     if (!udpSocket->bind(QHostAddress::AnyIPv4, listenPort)) {
@@ -23,7 +61,81 @@ void ChunkServer::start() {
         return;
     }
     connect(udpSocket, &QUdpSocket::readyRead, this, &ChunkServer::onReadyRead);
+    sweepTimer->start();
     qInfo() << "ChunkServer" << serverId << "listening on UDP port" << listenPort;
+
+    masterSocket->connectToHost(masterIp, masterPort);
+}
+
+void ChunkServer::onMasterConnected() {
+    QString reg = QString("REGISTER_CHUNK_SERVER %1 %2 %3\n").arg(serverId).arg(localIp.toString()).arg(listenPort);
+    masterSocket->write(reg.toUtf8());
+    lastHeartbeat = clock.elapsed();
+    storesSinceHeartbeat = 0;
+    retrievesSinceHeartbeat = 0;
+    heartbeatTimer->start();
+    inventoryTimer->start();
+    qInfo() << "ChunkServer" << serverId << "registered with master" << masterIp.toString() << ":" << masterPort;
+    reportInventory();
+}
+
+// tell a (possibly restarted) master which chunks this server holds; sent
+// again every INVENTORY_INTERVAL_MS, and chunks the master has no file for
+// come back in DELETE_CHUNKS. Each is "<chunkId>:<length>", so the master can
+// tell a leftover of an earlier file with the same ID from the current one.
+void ChunkServer::reportInventory() {
+    const QFileInfoList files = QDir(storageDir).entryInfoList({"*.bin"}, QDir::Files);
+    QString prefix = QString("REGISTER_CHUNK_REPLICAS %1 %2").arg(localIp.toString()).arg(listenPort);
+    for (int i = 0; i < files.size(); i += INVENTORY_BATCH) {
+        QString line = prefix;
+        for (int j = i; j < qMin(i + INVENTORY_BATCH, int(files.size())); ++j)
+            line += " " + files[j].fileName().chopped(4) + ":" + QString::number(files[j].size());
+        masterSocket->write((line + "\n").toUtf8());
+    }
+    qInfo() << "ChunkServer" << serverId << "reported" << files.size() << "chunks to master";
+}
+
+void ChunkServer::onMasterDisconnected() {
+    heartbeatTimer->stop();
+    inventoryTimer->stop();
+    if (!reconnectTimer->isActive())
+        reconnectTimer->start();
+}
+
+void ChunkServer::onMasterReadyRead() {
+    while (masterSocket->canReadLine()) {
+        QByteArray line = masterSocket->readLine().trimmed();
+        QList<QByteArray> parts = line.split(' ');
+        // REPLICATE <chunkId> <ip> <port> and DELETE_CHUNK <chunkId> come from the rebalancer,
+        // DELETE_CHUNKS <chunkId>... from the garbage collector
+        if (parts[0] == "REPLICATE" && parts.size() == 4)
+            replicateChunk(QString::fromUtf8(parts[1]), QHostAddress(QString::fromUtf8(parts[2])), parts[3].toUShort());
+        else if (parts[0] == "DELETE_CHUNK" && parts.size() == 2)
+            deleteChunk(QString::fromUtf8(parts[1]));
+        else if (parts[0] == "DELETE_CHUNKS" && parts.size() >= 2)
+            deleteChunks(parts.mid(1));
+        else if (line.startsWith("ERROR"))
+            qWarning() << "ChunkServer" << serverId << "master replied:" << line;
+    }
+}
+
+// HEARTBEAT <serverId> <ip> <port> <capacity> <free> <queueDepth> <storesPerSec> <retrievesPerSec>
+void ChunkServer::sendHeartbeat() {
+    qint64 now = clock.elapsed();
+    double seconds = qMax<qint64>(1, now - lastHeartbeat) / 1000.0;
+    QStorageInfo storage(storageDir);
+
+    QString hb = QString("HEARTBEAT %1 %2 %3 %4 %5 %6 %7 %8\n")
+                     .arg(serverId).arg(localIp.toString()).arg(listenPort)
+                     .arg(storage.bytesTotal()).arg(storage.bytesAvailable())
+                     .arg(pendingStores.size())
+                     .arg(storesSinceHeartbeat / seconds, 0, 'f', 2)
+                     .arg(retrievesSinceHeartbeat / seconds, 0, 'f', 2);
+    masterSocket->write(hb.toUtf8());
+
+    lastHeartbeat = now;
+    storesSinceHeartbeat = 0;
+    retrievesSinceHeartbeat = 0;
 }
 
 void ChunkServer::onReadyRead() {
@@ -44,17 +156,58 @@ void ChunkServer::onReadyRead() {
         QByteArray payload = dg.mid(nl + 1);
         QStringList parts = header.split(' ', Qt::SkipEmptyParts);
 
-        if (parts[0] == "STORE" && parts.size() == 3) {
+        // STORE <chunkId> <totalLen> <seq> <offset> <frameLen> [<chain> [<origin>]] carries
+        // one frame of a chunk; chain lists the replicas after this one as ip:port,...
+        // ("-" for none) and origin is the client when a replica relays the frame
+        if (parts[0] == "STORE" && parts.size() >= 6 && parts.size() <= 8) {
+            int len = parts[5].toInt();
+            if (payload.size() < len) {
+                qWarning() << "ChunkServer" << serverId << "STORE frame too short:" << parts[1];
+                continue;
+            }
+            // the chunk size is the file's, so anything the master could allocate is fine
+            int total = parts[2].toInt();
+            if (total <= 0 || total > MAX_CHUNK_SIZE) {
+                qWarning() << "ChunkServer" << serverId << "STORE chunk size out of range:" << parts[1] << total;
+                continue;
+            }
+            QString chain = parts.size() >= 7 && parts[6] != "-" ? parts[6] : QString();
+            QHostAddress origin = sender;
+            quint16 originPort = senderPort;
+            if (parts.size() == 8 && !parseHostPort(parts[7], origin, originPort)) {
+                qWarning() << "ChunkServer" << serverId << "bad STORE origin:" << parts[7];
+                continue;
+            }
+            processStoreFrame(parts[1], total, parts[3].toUInt(), parts[4].toInt(),
+                              payload.left(len), chain, origin, originPort, sender, senderPort);
+        }
+        // the trailing sequence number is optional; 0 means the sender does not retransmit
+        else if (parts[0] == "STORE" && (parts.size() == 3 || parts.size() == 4)) {
             QString cid = parts[1];
             int len = parts[2].toInt();
+            quint32 seq = parts.size() == 4 ? parts[3].toUInt() : 0;
             if (payload.size() < len) {
                 qWarning() << "ChunkServer" << serverId << "STORE payload too short:" << cid;
                 continue;
             }
-            processStore(cid, payload.left(len), sender, senderPort);
+            processStore(cid, payload.left(len), seq, sender, senderPort);
         }
-        else if (parts[0] == "RETRIEVE" && parts.size() == 2) {
-            processRetrieve(parts[1], sender, senderPort);
+        // RETRIEVE <chunkId> [<seq> [<frame,frame,...>]]
+        // NACK <chunkId> <seq> <frame,frame,...> <origin> from the next replica in a chain
+        else if (parts[0] == "NACK" && parts.size() == 5) {
+            QHostAddress origin;
+            quint16 originPort = 0;
+            if (parseHostPort(parts[4], origin, originPort))
+                processNack(parts[1], parts[2].toUInt(), decodeFrameList(parts[3]), origin, originPort);
+        }
+        // ACK <chunkId> <ip> <port> <corrupted> <seq> from the target of a REPLICATE copy
+        else if (parts[0] == "ACK" && parts.size() == 6) {
+            processReplicaAck(parts[1], parts[4] == "1", parts[5].toUInt());
+        }
+        else if (parts[0] == "RETRIEVE" && parts.size() >= 2 && parts.size() <= 4) {
+            quint32 seq = parts.size() >= 3 ? parts[2].toUInt() : 0;
+            QList<int> frames = parts.size() == 4 ? decodeFrameList(parts[3]) : QList<int>();
+            processRetrieve(parts[1], seq, frames, sender, senderPort);
         }
         else {
             qWarning() << "ChunkServer" << serverId << "unknown command:" << header;
@@ -62,8 +215,177 @@ void ChunkServer::onReadyRead() {
     }
 }
 
-void ChunkServer::processStore(const QString& chunkId, const QByteArray& encodedData,
+QString ChunkServer::requestKey(const QHostAddress& sender, quint16 senderPort, quint32 seq) {
+    return QString("%1:%2/%3").arg(sender.toString()).arg(senderPort).arg(seq);
+}
+
+bool ChunkServer::parseHostPort(const QString& text, QHostAddress& ip, quint16& port) {
+    int colon = text.lastIndexOf(':');
+    if (colon <= 0)
+        return false;
+    bool ok = false;
+    ip = QHostAddress(text.left(colon));
+    port = text.mid(colon + 1).toUShort(&ok);
+    return ok && !ip.isNull();
+}
+
+// Frames are relayed to the next replica as they arrive, so a chained upload
+// is pipelined instead of store-and-forward. Only the tail ACKs, straight to
+// the origin; a replica missing frames NACKs whoever sent them.
+void ChunkServer::processStoreFrame(const QString& chunkId, int totalLength, quint32 seq, int offset,
+                                    const QByteArray& frame, const QString& chain,
+                                    QHostAddress origin, quint16 originPort,
+                                    QHostAddress sender, quint16 senderPort) {
+    QString key = requestKey(origin, originPort, seq);
+    auto acked = recentAcks.constFind(key);
+    if (acked != recentAcks.constEnd()) {
+        udpSocket->writeDatagram(acked.value(), origin, originPort);
+        return;
+    }
+
+    ChainForward* forward = nullptr;
+    if (!chain.isEmpty()) {
+        forward = chainFor(key, chunkId, totalLength, chain, origin, originPort);
+        if (!forward) {
+            qWarning() << "ChunkServer" << serverId << "bad STORE chain for" << chunkId << ":" << chain;
+            return;
+        }
+        // already stored here: a retransmission probe, pass it down the chain
+        if (forward->stored) {
+            forwardFrame(*forward, seq, offset, frame);
+            return;
+        }
+    }
+
+    auto it = pendingStores.find(key);
+    if (it == pendingStores.end()) {
+        PendingStore pending;
+        pending.chunkId = chunkId;
+        pending.frames = FrameAssembly(totalLength);
+        it = pendingStores.insert(key, pending);
+    }
+    it->lastActivity = clock.elapsed();
+
+    bool duplicate = false;
+    if (it->chunkId != chunkId || !it->frames.addFrame(offset, frame, &duplicate)) {
+        qWarning() << "ChunkServer" << serverId << "bad STORE frame for" << chunkId << "at" << offset;
+        return;
+    }
+    // duplicates too: downstream replicas NACK on probes just like this one
+    if (forward)
+        forwardFrame(*forward, seq, offset, frame);
+
+    if (it->frames.isComplete()) {
+        QByteArray data = it->frames.data();
+        pendingStores.erase(it);
+        bool corrupted = storeChunk(chunkId, data);
+        if (forward)
+            forward->stored = true;
+        else
+            ackStore(chunkId, corrupted, seq, key, origin, originPort);
+        return;
+    }
+
+    // the sender finished (last frame) or is probing (duplicate): ask for the gaps only
+    if (duplicate || offset + frame.size() == totalLength) {
+        QString nack = QString("NACK %1 %2 %3 %4:%5\n")
+                           .arg(chunkId).arg(seq).arg(encodeFrameList(it->frames.missingFrames()))
+                           .arg(origin.toString()).arg(originPort);
+        udpSocket->writeDatagram(nack.toUtf8(), sender, senderPort);
+    }
+}
+
+ChunkServer::ChainForward* ChunkServer::chainFor(const QString& key, const QString& chunkId, int totalLength,
+                                                 const QString& chain, QHostAddress origin, quint16 originPort) {
+    auto it = forwards.find(key);
+    if (it != forwards.end())
+        return &it.value();
+
+    ChainForward forward;
+    QStringList hops = chain.split(',', Qt::SkipEmptyParts);
+    if (hops.isEmpty() || !parseHostPort(hops.takeFirst(), forward.nextIp, forward.nextPort))
+        return nullptr;
+    forward.chunkId = chunkId;
+    forward.totalLength = totalLength;
+    forward.rest = hops.isEmpty() ? QString("-") : hops.join(',');
+    forward.originIp = origin;
+    forward.originPort = originPort;
+
+    if (forwardOrder.size() >= FORWARD_CAPACITY)
+        forwards.remove(forwardOrder.dequeue());
+    forwardOrder.enqueue(key);
+    return &forwards.insert(key, forward).value();
+}
+
+void ChunkServer::forwardFrame(const ChainForward& forward, quint32 seq, int offset, const QByteArray& frame) {
+    QString header = QString("STORE %1 %2 %3 %4 %5 %6 %7:%8\n")
+                         .arg(forward.chunkId).arg(forward.totalLength).arg(seq).arg(offset).arg(frame.size())
+                         .arg(forward.rest).arg(forward.originIp.toString()).arg(forward.originPort);
+    udpSocket->writeDatagram(header.toUtf8() + frame, forward.nextIp, forward.nextPort);
+}
+
+// the next replica is missing frames: resend the ones this server has
+void ChunkServer::processNack(const QString& chunkId, quint32 seq, const QList<int>& frames,
+                              QHostAddress origin, quint16 originPort) {
+    QString key = requestKey(origin, originPort, seq);
+    auto fw = forwards.constFind(key);
+    if (fw == forwards.constEnd() || fw->chunkId != chunkId)
+        return;
+
+    QByteArray data;
+    auto pending = pendingStores.constFind(key);
+    if (fw->stored) {
+        QFile f(storageDir + "/" + chunkId + ".bin");
+        if (!f.open(QIODevice::ReadOnly))
+            return;
+        data = f.readAll();
+    }
+    else if (pending != pendingStores.constEnd()) {
+        data = pending->frames.data();
+    }
+
+    for (int frame : frames) {
+        // frames this server lacks too are relayed once they arrive
+        if (!fw->stored && (pending == pendingStores.constEnd() || !pending->frames.hasFrame(frame)))
+            continue;
+        int offset = frame * FRAME_PAYLOAD_SIZE;
+        if (offset >= data.size())
+            continue;
+        forwardFrame(fw.value(), seq, offset, data.mid(offset, FRAME_PAYLOAD_SIZE));
+    }
+}
+
+void ChunkServer::onSweepTimer() {
+    qint64 now = clock.elapsed();
+    for (auto it = pendingStores.begin(); it != pendingStores.end();) {
+        if (now - it->lastActivity > PENDING_STORE_TIMEOUT_MS) {
+            qWarning() << "ChunkServer" << serverId << "dropping incomplete STORE" << it->chunkId;
+            it = pendingStores.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+void ChunkServer::processStore(const QString& chunkId, const QByteArray& encodedData, quint32 seq,
                                QHostAddress sender, quint16 senderPort) {
+    QString key = requestKey(sender, senderPort, seq);
+    if (seq != 0) {
+        auto it = recentAcks.constFind(key);
+        if (it != recentAcks.constEnd()) {
+            udpSocket->writeDatagram(it.value(), sender, senderPort);
+            qInfo() << "ChunkServer" << serverId << "re-acked duplicate STORE" << chunkId;
+            return;
+        }
+    }
+
+    bool corrupted = storeChunk(chunkId, encodedData);
+    ackStore(chunkId, corrupted, seq, key, sender, senderPort);
+}
+
+// writes a complete chunk; returns whether it arrived corrupted
+bool ChunkServer::storeChunk(const QString& chunkId, const QByteArray& encodedData) {
     // QByteArray noisyData = addNoise(encodedData, NOISE_RATE);
     QByteArray noisyData = encodedData;
     bool corrupted = false;
@@ -85,15 +407,32 @@ void ChunkServer::processStore(const QString& chunkId, const QByteArray& encoded
         qWarning() << "ChunkServer" << serverId << "failed to write chunk" << chunkId;
     }
 
-    QString ack = QString("ACK %1 %2 %3 %4\n")
-                      .arg(chunkId).arg(localIp.toString())
-                      .arg(listenPort).arg(corrupted ? 1 : 0);
-    udpSocket->writeDatagram(ack.toUtf8(), sender, senderPort);
-
+    ++storesSinceHeartbeat;
     qInfo() << "ChunkServer" << serverId << "stored chunk" << chunkId << (corrupted ? "(corrupted)" : "");
+    return corrupted;
 }
 
-void ChunkServer::processRetrieve(const QString& chunkId, QHostAddress sender, quint16 senderPort) {
+void ChunkServer::ackStore(const QString& chunkId, bool corrupted, quint32 seq, const QString& key,
+                           QHostAddress receiver, quint16 receiverPort) {
+    QByteArray ack = QString("ACK %1 %2 %3 %4 %5\n")
+                         .arg(chunkId).arg(localIp.toString())
+                         .arg(listenPort).arg(corrupted ? 1 : 0).arg(seq)
+                         .toUtf8();
+    udpSocket->writeDatagram(ack, receiver, receiverPort);
+    if (seq != 0)
+        rememberAck(key, ack);
+}
+
+void ChunkServer::rememberAck(const QString& key, const QByteArray& ack) {
+    if (recentAckOrder.size() >= RECENT_ACK_CAPACITY)
+        recentAcks.remove(recentAckOrder.dequeue());
+    recentAcks.insert(key, ack);
+    recentAckOrder.enqueue(key);
+}
+
+// RETRIEVE is idempotent, so a retransmitted request is simply served again
+void ChunkServer::processRetrieve(const QString& chunkId, quint32 seq, const QList<int>& frames,
+                                  QHostAddress sender, quint16 senderPort) {
     QString filePath = storageDir + "/" + chunkId + ".bin";
     QFile f(filePath);
     if (!f.open(QIODevice::ReadOnly)) {
@@ -102,15 +441,149 @@ void ChunkServer::processRetrieve(const QString& chunkId, QHostAddress sender, q
     }
     QByteArray decodedData = f.readAll();
     f.close();
+    ++retrievesSinceHeartbeat;
 
     // QByteArray encodedData = encodeChunk(decodedData);
     QByteArray encodedData = decodedData;
 
 
-    QString header = QString("DATA %1 0 %2\n").arg(chunkId).arg(encodedData.size());
-    QByteArray dg = header.toUtf8() + encodedData;
-    udpSocket->writeDatagram(dg, sender, senderPort);
+    // requests without a sequence number get the whole chunk in one datagram,
+    // which only works for chunks that fit in one
+    if (seq == 0) {
+        if (encodedData.size() > MAX_SINGLE_DATAGRAM) {
+            qWarning() << "ChunkServer" << serverId << "chunk" << chunkId << "too large for an unsequenced RETRIEVE";
+            return;
+        }
+        QString header = QString("DATA %1 0 %2 0\n").arg(chunkId).arg(encodedData.size());
+        udpSocket->writeDatagram(header.toUtf8() + encodedData, sender, senderPort);
+        qInfo() << "ChunkServer" << serverId << "served chunk" << chunkId;
+        return;
+    }
+
+    // DATA <chunkId> <corrupt> <totalLen> <seq> <offset> <frameLen>, either every
+    // frame or only the ones a selective RETRIEVE asked for
+    int total = int(encodedData.size());
+    int count = frameCount(total);
+    QList<int> toSend = frames;
+    if (toSend.isEmpty()) {
+        for (int i = 0; i < count; ++i)
+            toSend.append(i);
+    }
+    for (int frame : toSend) {
+        if (frame >= count)
+            continue;
+        int offset = frame * FRAME_PAYLOAD_SIZE;
+        QByteArray part = encodedData.mid(offset, FRAME_PAYLOAD_SIZE);
+        QString header = QString("DATA %1 0 %2 %3 %4 %5\n").arg(chunkId).arg(total).arg(seq).arg(offset).arg(part.size());
+        udpSocket->writeDatagram(header.toUtf8() + part, sender, senderPort);
+    }
 
     qInfo() << "ChunkServer" << serverId << "served chunk" << chunkId;
 }
 
+
+// Sends a stored chunk to another chunk server with the framed STORE a client
+// would use; the result goes back to the master as
+// "REPLICATED <chunkId> <ip> <port> <ok>" once the target ACKs or gives up.
+void ChunkServer::replicateChunk(const QString& chunkId, const QHostAddress& targetIp, quint16 targetPort) {
+    QFile f(storageDir + "/" + chunkId + ".bin");
+    QByteArray data;
+    if (f.open(QIODevice::ReadOnly))
+        data = f.readAll();
+    quint32 seq = nextReplicationSeq++;
+    if (nextReplicationSeq == 0)
+        nextReplicationSeq = 1; // 0 means "not retransmitted" to a chunk server
+    replications.insert(seq, Replication{chunkId, targetIp, targetPort, int(data.size()), clock.elapsed(), 0});
+
+    QString target = QString("%1:%2").arg(targetIp.toString()).arg(targetPort);
+    ChainForward* forward = nullptr;
+    if (!data.isEmpty() && data.size() <= MAX_CHUNK_SIZE)
+        forward = chainFor(requestKey(localIp, listenPort, seq), chunkId, data.size(), target, localIp, listenPort);
+    if (!forward) {
+        qWarning() << "ChunkServer" << serverId << "cannot replicate chunk" << chunkId << "to" << target;
+        finishReplication(seq, false);
+        return;
+    }
+    forward->stored = true;
+    for (int offset = 0; offset < data.size(); offset += FRAME_PAYLOAD_SIZE)
+        forwardFrame(*forward, seq, offset, data.mid(offset, FRAME_PAYLOAD_SIZE));
+    if (!replicationTimer->isActive())
+        replicationTimer->start();
+}
+
+void ChunkServer::processReplicaAck(const QString& chunkId, bool corrupted, quint32 seq) {
+    auto it = replications.constFind(seq);
+    if (it == replications.constEnd() || it->chunkId != chunkId)
+        return;
+    finishReplication(seq, !corrupted);
+}
+
+void ChunkServer::finishReplication(quint32 seq, bool ok) {
+    Replication replication = replications.take(seq);
+    forwards.remove(requestKey(localIp, listenPort, seq));
+    QString report = QString("REPLICATED %1 %2 %3 %4\n")
+                         .arg(replication.chunkId).arg(replication.targetIp.toString())
+                         .arg(replication.targetPort).arg(ok ? 1 : 0);
+    if (masterSocket->state() == QAbstractSocket::ConnectedState)
+        masterSocket->write(report.toUtf8());
+    qInfo() << "ChunkServer" << serverId << (ok ? "replicated chunk" : "failed to replicate chunk")
+            << replication.chunkId << "to" << replication.targetIp.toString() << replication.targetPort;
+}
+
+// copies the target has not ACKed yet get their last frame again; the target
+// answers with the ACK, or a NACK listing the frames it is missing
+void ChunkServer::onReplicationTimer() {
+    qint64 now = clock.elapsed();
+    QList<quint32> failed;
+    for (auto it = replications.begin(); it != replications.end(); ++it) {
+        if (now - it->lastSent < REPLICATION_RETRY_MS)
+            continue;
+        auto forward = forwards.constFind(requestKey(localIp, listenPort, it.key()));
+        QFile f(storageDir + "/" + it->chunkId + ".bin");
+        int last = (frameCount(it->totalLength) - 1) * FRAME_PAYLOAD_SIZE;
+        if (it->retries >= MAX_REPLICATION_RETRIES || forward == forwards.constEnd()
+            || !f.open(QIODevice::ReadOnly) || !f.seek(last)) {
+            failed.append(it.key());
+            continue;
+        }
+        ++it->retries;
+        it->lastSent = now;
+        forwardFrame(forward.value(), it.key(), last, f.read(FRAME_PAYLOAD_SIZE));
+    }
+    for (quint32 seq : failed)
+        finishReplication(seq, false);
+    if (replications.isEmpty())
+        replicationTimer->stop();
+}
+
+// the rebalancer moved this replica elsewhere
+void ChunkServer::deleteChunk(const QString& chunkId) {
+    if (QFile::remove(storageDir + "/" + chunkId + ".bin"))
+        qInfo() << "ChunkServer" << serverId << "deleted chunk" << chunkId;
+    else
+        qWarning() << "ChunkServer" << serverId << "cannot delete chunk" << chunkId;
+}
+
+// chunks of deleted or replaced files, and orphans from the inventory
+void ChunkServer::deleteChunks(const QList<QByteArray>& chunkIds) {
+    QDateTime now = QDateTime::currentDateTimeUtc();
+    int deleted = 0;
+    int kept = 0;
+    qint64 bytes = 0;
+    for (const QByteArray& chunkId : chunkIds) {
+        QFileInfo info(storageDir + "/" + QString::fromUtf8(chunkId) + ".bin");
+        if (!info.exists())
+            continue;
+        if (info.lastModified().toUTC().msecsTo(now) < RECENT_WRITE_MS) {
+            ++kept;
+            continue;
+        }
+        qint64 size = info.size();
+        if (QFile::remove(info.filePath())) {
+            ++deleted;
+            bytes += size;
+        }
+    }
+    qInfo() << "ChunkServer" << serverId << "reclaimed" << deleted << "chunks," << bytes << "bytes; kept"
+            << kept << "written in the last" << RECENT_WRITE_MS / 1000 << "s";
+}
@@ -4,25 +4,81 @@
 #include <QObject>
 #include <QUdpSocket>
 #include <QDir>
+#include <QElapsedTimer>
 #include <QFile>
 #include <QByteArray>
+#include <QHash>
 #include <QHostAddress>
+#include <QQueue>
+#include <QTcpSocket>
+#include <QTimer>
+
+#include "chunkFrames.h"
 
 static constexpr quint16 BASE_CHUNK_PORT = 5000;
 
 class ChunkServer : public QObject {
     Q_OBJECT
 public:
-    explicit ChunkServer(int serverId, const QHostAddress& localIp, QObject* parent = nullptr);
+    explicit ChunkServer(int serverId, const QHostAddress& localIp,
+                         const QHostAddress& masterIp, quint16 masterPort, QObject* parent = nullptr);
     void start();
 
 private slots:
     void onReadyRead();
+    void onSweepTimer();
+
+    void onMasterConnected();
+    void onMasterDisconnected();
+    void onMasterReadyRead();
+    void sendHeartbeat();
+    void reportInventory();
+    void onReplicationTimer();
 
 private:
-    void processStore(const QString& chunkId, const QByteArray& encodedData,
+    // where a chained STORE goes after this server
+    struct ChainForward {
+        QString chunkId;
+        int totalLength = 0;
+        QHostAddress nextIp;
+        quint16 nextPort = 0;
+        QString rest; // hops after next, "-" if next is the tail
+        QHostAddress originIp;
+        quint16 originPort = 0;
+        bool stored = false;
+    };
+
+    void processStoreFrame(const QString& chunkId, int totalLength, quint32 seq, int offset,
+                           const QByteArray& frame, const QString& chain,
+                           QHostAddress origin, quint16 originPort,
+                           QHostAddress sender, quint16 senderPort);
+    void processStore(const QString& chunkId, const QByteArray& encodedData, quint32 seq,
                       QHostAddress sender, quint16 senderPort);
-    void processRetrieve(const QString& chunkId, QHostAddress sender, quint16 senderPort);
+    void processNack(const QString& chunkId, quint32 seq, const QList<int>& frames,
+                     QHostAddress origin, quint16 originPort);
+    bool storeChunk(const QString& chunkId, const QByteArray& encodedData);
+    void ackStore(const QString& chunkId, bool corrupted, quint32 seq, const QString& key,
+                  QHostAddress receiver, quint16 receiverPort);
+    ChainForward* chainFor(const QString& key, const QString& chunkId, int totalLength, const QString& chain,
+                           QHostAddress origin, quint16 originPort);
+    void forwardFrame(const ChainForward& forward, quint32 seq, int offset, const QByteArray& frame);
+    static bool parseHostPort(const QString& text, QHostAddress& ip, quint16& port);
+    void processRetrieve(const QString& chunkId, quint32 seq, const QList<int>& frames,
+                         QHostAddress sender, quint16 senderPort);
+    void rememberAck(const QString& key, const QByteArray& ack);
+    void replicateChunk(const QString& chunkId, const QHostAddress& targetIp, quint16 targetPort);
+    void processReplicaAck(const QString& chunkId, bool corrupted, quint32 seq);
+    void finishReplication(quint32 seq, bool ok);
+    void deleteChunk(const QString& chunkId);
+    void deleteChunks(const QList<QByteArray>& chunkIds);
+    static QString requestKey(const QHostAddress& sender, quint16 senderPort, quint32 seq);
+
+    // a fragmented STORE still missing frames
+    struct PendingStore {
+        QString chunkId;
+        FrameAssembly frames;
+        qint64 lastActivity = 0;
+    };
     
     QByteArray addNoise(const QByteArray& data, double noiseRate);
 
@@ -31,7 +87,62 @@ private:
     QHostAddress localIp;
     QUdpSocket* udpSocket;
     QString storageDir;
-    
+
+    // ACKs already sent, keyed by "ip:port/seq", so a retransmitted STORE is
+    // answered again without rewriting the chunk
+    QHash<QString, QByteArray> recentAcks;
+    QQueue<QString> recentAckOrder;
+    static constexpr int RECENT_ACK_CAPACITY = 4096;
+
+    QHash<QString, PendingStore> pendingStores; // "ip:port/seq" -> partial chunk
+
+    // chained STOREs this server relays, keyed like recentAcks by the
+    // client that started the chain
+    QHash<QString, ChainForward> forwards;
+    QQueue<QString> forwardOrder;
+    static constexpr int FORWARD_CAPACITY = 4096;
+
+    // copies to other chunk servers that the master asked for; they go out as
+    // a one-hop chain with this server as the origin, so processNack serves
+    // the target's NACKs from the stored chunk
+    struct Replication {
+        QString chunkId;
+        QHostAddress targetIp;
+        quint16 targetPort = 0;
+        int totalLength = 0;
+        qint64 lastSent = 0;
+        int retries = 0;
+    };
+    QHash<quint32, Replication> replications; // seq -> copy awaiting the target's ACK
+    quint32 nextReplicationSeq;
+    QTimer* replicationTimer;
+    static constexpr int REPLICATION_RETRY_MS = 500;
+    static constexpr int MAX_REPLICATION_RETRIES = 10;
+
+    QElapsedTimer clock;
+    QTimer* sweepTimer;
+    static constexpr int PENDING_STORE_TIMEOUT_MS = 30000;
+    static constexpr int SWEEP_INTERVAL_MS = 5000;
+
+    // registration and load reports to the master over its TCP line protocol
+    QHostAddress masterIp;
+    quint16 masterPort;
+    QTcpSocket* masterSocket;
+    QTimer* heartbeatTimer;
+    QTimer* inventoryTimer;
+    QTimer* reconnectTimer;
+    qint64 lastHeartbeat = 0;
+    int storesSinceHeartbeat = 0;
+    int retrievesSinceHeartbeat = 0;
+    static constexpr int HEARTBEAT_INTERVAL_MS = 1000;
+    static constexpr int RECONNECT_INTERVAL_MS = 2000;
+    static constexpr int INVENTORY_BATCH = 1000; // chunk IDs per REGISTER_CHUNK_REPLICAS
+    // the inventory is resent this often so the master finds orphaned chunks
+    static constexpr int INVENTORY_INTERVAL_MS = 10 * 60 * 1000;
+    // DELETE_CHUNKS keeps chunks written this recently: the file may have
+    // been created again since the master decided to collect them
+    static constexpr qint64 RECENT_WRITE_MS = 60000;
+
     static constexpr double NOISE_RATE = 0.01;
 };
 
@@ -1,4 +1,7 @@
+#include <QCommandLineOption>
+#include <QCommandLineParser>
 #include <QCoreApplication>
+#include <QDebug>
 #include <QHostAddress>
 
 #include "chunkServer.h"
@@ -8,10 +11,35 @@ int main(int argc, char* argv[]) {
     QCoreApplication::setApplicationName("dfs-chunk");
     QCoreApplication::setApplicationVersion("1.0");
 
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Distributed File System Chunk Servers");
+    parser.addHelpOption();
+    parser.addVersionOption();
+
+    QCommandLineOption masterHostOption(QStringList() << "m" << "master",
+        "Address of the master server (default: 127.0.0.1).",
+        "host", "127.0.0.1");
+    QCommandLineOption masterPortOption(QStringList() << "p" << "master-port",
+        "Port of the master server (default: 4000).",
+        "port", "4000");
+
+    parser.addOption(masterHostOption);
+    parser.addOption(masterPortOption);
+
+    parser.process(app);
+
+    QHostAddress masterIp(parser.value(masterHostOption));
+    bool ok;
+    quint16 masterPort = parser.value(masterPortOption).toUShort(&ok);
+    if (masterIp.isNull() || !ok) {
+        qCritical() << "Invalid master address provided.";
+        return 1;
+    }
+
     QHostAddress localIp = QHostAddress::LocalHost;
     const int numChunks = 15;
     for (int i = 0; i < numChunks; ++i) {
-        ChunkServer* srv = new ChunkServer(i, localIp, &app);
+        ChunkServer* srv = new ChunkServer(i, localIp, masterIp, masterPort, &app);
         srv->start();
     }
 
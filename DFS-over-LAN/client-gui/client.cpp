@@ -7,6 +7,7 @@
 #include <QFileInfo>
 #include <QRandomGenerator>
 #include <QTextStream>
+#include <algorithm>
 
 Client::Client(const QHostAddress& serverAddress, quint16 serverPort, QObject* parent)
     : QObject(parent), m_masterIp(serverAddress), m_masterPort(serverPort) {
@@ -20,6 +21,13 @@ Client::Client(const QHostAddress& serverAddress, quint16 serverPort, QObject* p
     m_udp = new QUdpSocket(this);
     connect(m_udp, &QUdpSocket::readyRead, this, &Client::onUdpReadyRead);
     m_udp->bind(QHostAddress::AnyIPv4, 0);
+    // a full download window of DATA datagrams can arrive back to back
+    m_udp->setSocketOption(QAbstractSocket::ReceiveBufferSizeSocketOption, UDP_BUFFER_SIZE);
+
+    m_clock.start();
+    m_retransmitTimer = new QTimer(this);
+    m_retransmitTimer->setInterval(RETRANSMIT_TICK_MS);
+    connect(m_retransmitTimer, &QTimer::timeout, this, &Client::onRetransmitTimer);
 }
 
 Client::~Client() {
@@ -30,6 +38,7 @@ Client::~Client() {
 void Client::sendCommand(const QString& command, const QString& params) {
     QString pkt_params = params;
     if (command == "ALLOCATE_CHUNKS") {
+        // <fileId> [replication [chunkSize]]
         QStringList parts = params.split(' ', Qt::SkipEmptyParts);
         if (parts.size() >= 1) {
             m_fileId = parts[0];
@@ -44,41 +53,202 @@ void Client::sendCommand(const QString& command, const QString& params) {
             }
 
             m_fileSize = m_file.size();
-            m_numChunks = int((m_fileSize + CHUNK_SIZE - 1) / CHUNK_SIZE);
-            m_currentChunk = 0;
+            m_nextChunk = 0;
+            m_ackedChunks = 0;
+            m_uploadInFlight.clear();
             m_uploadChunks.clear();
+            m_uploadTotal = 0;
 
-            pkt_params += " " + QString::number(m_fileSize);
+            pkt_params = m_fileId + " " + QString::number(m_fileSize);
+            for (int i = 1; i < qMin(int(parts.size()), 3); ++i)
+                pkt_params += " " + parts[i];
         } else {
             emit errorOccurred("Invalid parameters for ALLOCATE_CHUNKS");
             return;
         }
+    } else if (command == "LOCATE") {
+        // <chunkId> [replicas]: answered from the ring, no master round trip
+        QStringList parts = params.split(' ', Qt::SkipEmptyParts);
+        if (parts.isEmpty()) {
+            emit errorOccurred("Invalid parameters for LOCATE");
+            return;
+        }
+        QVector<ChunkLocation> locations = expectedLocations(parts[0], parts.size() >= 2 ? parts[1].toInt() : 1);
+        if (locations.isEmpty()) {
+            emit errorOccurred("No consistent-hash ring from the master to locate " + parts[0]);
+            return;
+        }
+        QString reply = "LOCATION " + parts[0];
+        for (const ChunkLocation& location : locations)
+            reply += QString(" %1 %2").arg(location.ip.toString()).arg(location.port);
+        emit responseReceived(reply);
+        return;
     } else if (command == "LOOKUP_FILE") {
-        m_downloadId = params.trimmed();
-        m_downloadCurrent = 0;
-        m_downloadChunksInfo.clear();
+        if (m_downloadActive && m_rangeRead) {
+            emit errorOccurred("A range read of " + m_downloadId + " is still running");
+            return;
+        }
+        resetDownload(params.trimmed());
 
         m_outFile.setFileName(m_downloadId + ".download");
         if (!m_outFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
             emit errorOccurred("Cannot open output: " + m_outFile.fileName());
             return;
         }
+        m_downloadActive = true;
+
+        // leased by an earlier lookup or prefetched by LOOKUP_FILES: no round trip to the master
+        FileLookup lookup;
+        if (cachedMetadata(m_downloadId, lookup)) {
+            m_downloadChunksInfo = lookup.chunks;
+            m_downloadChunkSize = lookup.chunkSize;
+            startDownload(lookup.size);
+            return;
+        }
     }
 
-    QByteArray pkt = (command + " " + pkt_params + "\n").toUtf8();
-    if (m_tcp->state() == QAbstractSocket::ConnectedState)
-        m_tcp->write(pkt);
-    else
+    writeRequest(command, pkt_params);
+}
+
+void Client::readRange(const QString& fileId, qint64 offset, qint64 length) {
+    if (offset < 0 || length < 0 || length > MAX_RANGE_BYTES) {
+        emit errorOccurred("Invalid range for " + fileId);
+        return;
+    }
+    if (m_downloadActive) {
+        emit errorOccurred("Download of " + m_downloadId + " is still running");
+        return;
+    }
+    resetDownload(fileId);
+    m_downloadActive = true;
+    m_rangeRead = true;
+    m_rangeOffset = offset;
+    m_rangeLength = length;
+
+    FileLookup lookup;
+    if (cachedMetadata(fileId, lookup)) {
+        // the master's LOOKUP_RANGE clipping, on the cached chunk list
+        int chunks = lookup.chunks.size();
+        qint64 chunkSize = lookup.chunkSize;
+        int first = int(qMin<qint64>(offset / chunkSize, chunks));
+        qint64 fileEnd = lookup.size > 0 ? lookup.size : chunks * chunkSize;
+        qint64 stop = length > 0 ? qMin(offset + length, fileEnd) : offset;
+        int end = qMax(first, int(qMin<qint64>((stop + chunkSize - 1) / chunkSize, chunks)));
+        m_downloadChunksInfo = lookup.chunks.mid(first, end - first);
+        m_downloadFirstChunk = first;
+        m_downloadChunkSize = lookup.chunkSize;
+        startDownload(lookup.size);
+        return;
+    }
+    writeRequest("LOOKUP_RANGE", QString("%1 %2 %3").arg(fileId).arg(offset).arg(length));
+}
+
+QVector<ChunkLocation> Client::expectedLocations(const QString& chunkId, int count) const {
+    QVector<ChunkLocation> locations;
+    if (!m_ringPlacement)
+        return locations;
+    for (int member : m_ring.locate(chunkId.toUtf8(), count))
+        locations.append({QHostAddress(m_ring.members()[member].ipv4), m_ring.members()[member].port});
+    return locations;
+}
+
+void Client::resetDownload(const QString& fileId) {
+    m_downloadId = fileId;
+    m_downloadSize = 0;
+    m_downloadEnd = 0;
+    m_downloadNext = 0;
+    m_downloadReceived = 0;
+    m_downloadChunks = 0;
+    m_downloadInFlight.clear();
+    m_downloadChunksInfo.clear();
+    m_downloadFirstChunk = 0;
+    m_downloadChunkSize = DEFAULT_CHUNK_SIZE;
+    m_rangeRead = false;
+    m_rangeBuffer.clear();
+}
+
+bool Client::expectsMetadata(bool range, const QString& fileId) const {
+    return m_downloadActive && m_rangeRead == range && m_downloadChunks == 0 && m_downloadChunksInfo.isEmpty()
+        && fileId == m_downloadId;
+}
+
+void Client::writeRequest(const QString& command, const QString& params) {
+    if (m_tcp->state() != QAbstractSocket::ConnectedState) {
         emit errorOccurred("Not connected to master server");
+        return;
+    }
+    if (m_negotiating) {
+        m_queuedRequests.append({command, params});
+        return;
+    }
+    if (!m_binary) {
+        m_tcp->write((command + " " + params + "\n").toUtf8());
+        return;
+    }
+
+    QByteArray body;
+    QDataStream out(&body, QIODevice::WriteOnly);
+    QStringList parts = params.split(' ', Qt::SkipEmptyParts);
+    if (command == "LOOKUP_RANGE" && parts.size() >= 3) {
+        out << parts[0].toUtf8() << qint64(parts[1].toLongLong()) << qint64(parts[2].toLongLong());
+        m_tcp->write(MasterProtocol::encodeFrame(MasterProtocol::OP_LOOKUP_RANGE, body));
+    }
+    else if (command == "LOOKUP_FILES" && parts.size() >= 1) {
+        out << quint32(parts.size());
+        for (const QString& fileId : parts)
+            out << fileId.toUtf8();
+        m_tcp->write(MasterProtocol::encodeFrame(MasterProtocol::OP_LOOKUP_BATCH, body));
+    }
+    else if (command == "ALLOCATE_CHUNKS" && parts.size() >= 2) {
+        out << parts[0].toUtf8() << qint64(parts[1].toLongLong());
+        if (parts.size() >= 3)
+            out << quint8(parts[2].toUInt());
+        if (parts.size() >= 4)
+            out << quint32(parts[3].toUInt());
+        m_tcp->write(MasterProtocol::encodeFrame(MasterProtocol::OP_ALLOCATE, body));
+    }
+    else if (command == "LOOKUP_FILE" && parts.size() >= 1) {
+        out << parts[0].toUtf8();
+        m_tcp->write(MasterProtocol::encodeFrame(MasterProtocol::OP_LOOKUP, body));
+    }
+    else {
+        m_tcp->write(MasterProtocol::encodeFrame(MasterProtocol::OP_TEXT, (command + " " + params).toUtf8()));
+    }
+}
+
+void Client::setUploadWindow(int window) {
+    m_uploadWindow = qMax(1, window);
+}
+
+void Client::setDownloadWindow(int window) {
+    m_downloadWindow = qMax(1, window);
+}
+
+void Client::setBinaryProtocol(bool enabled) {
+    m_preferBinary = enabled;
 }
 
 void Client::onConnected() {
     m_connected = true;
+    m_binary = false;
+    m_tcpBuffer.clear();
+    if (m_preferBinary) {
+        m_negotiating = true;
+        m_tcp->write("HELLO BIN " + QByteArray::number(MasterProtocol::VERSION) + "\n");
+    }
+    writeRequest("RING", QString());
     emit connectionStateChanged(true);
 }
 
 void Client::onDisconnected() {
     m_connected = false;
+    m_negotiating = false;
+    m_binary = false;
+    m_queuedRequests.clear();
+    // leases can no longer be revoked, so stop trusting them
+    m_pendingLeases.clear();
+    for (auto it = m_metadataCache.begin(); it != m_metadataCache.end();)
+        it = it->leaseExpires ? m_metadataCache.erase(it) : std::next(it);
     emit connectionStateChanged(false);
 }
 
@@ -89,36 +259,365 @@ void Client::onError(QAbstractSocket::SocketError socketError) {
 }
 
 void Client::onReadyRead() {
-    while (m_tcp->canReadLine()) {
-        QString pkt = m_tcp->readLine().trimmed();
-        emit responseReceived(pkt);
-
-        auto parts = pkt.split(' ', Qt::SkipEmptyParts);
-        if (parts.size() >= 3 && parts[0] == "OK" && parts[1] == "Allocated") {
-            int NumberOfChunks = parts[2].toInt();
-            int idx = 3;
-            getChunkInfos(pkt, m_uploadChunks, idx, NumberOfChunks);
-            uploadFileToChunk();
-        } 
-        else if (parts.size() >= 4 && parts[0] == "FILE_METADATA") {
-            int NumberOfChunks = (parts.size() - 2) / 3;
-            int idx = 2;
-            m_downloadChunks = NumberOfChunks;
-            getChunkInfos(pkt, m_downloadChunksInfo, idx, NumberOfChunks);
-            downloadFileFromChunk();
+    while (true) {
+        if (m_binary) {
+            m_tcpBuffer += m_tcp->readAll();
+            quint8 opcode;
+            QByteArray body;
+            bool malformed = false;
+            while (MasterProtocol::takeFrame(m_tcpBuffer, opcode, body, malformed))
+                handleFrame(opcode, body);
+            if (malformed) {
+                emit errorOccurred("Malformed frame from master server");
+                m_tcp->abort();
+            }
+            return;
         }
+
+        if (!m_tcp->canReadLine())
+            return;
+        handleResponse(m_tcp->readLine().trimmed());
     }
 }
 
-void Client::getChunkInfos(const QString& pkt, QVector<ChunkServerInfo>& infos, int idx, int numChunks) {
+void Client::handleResponse(const QString& pkt) {
+    emit responseReceived(pkt);
+
     auto parts = pkt.split(' ', Qt::SkipEmptyParts);
-    for (int i = 0; i < numChunks && idx + 2 < parts.size(); ++i) {
-        // the + 2 is to ensure there are enough parts cause each part should consist of name, ip and port
-        // im sorry for this shitty code but i hate this course and i don't have time to do it properly
-        QString cid = parts[idx++];
-        QHostAddress ip(parts[idx++]);
-        quint16 port = parts[idx++].toUShort();
-        infos.append({cid, ip, port});
+    if (m_negotiating && !parts.isEmpty()) {
+        // anything but OK HELLO BIN means the master only speaks text
+        m_binary = parts.size() >= 3 && parts[0] == "OK" && parts[1] == "HELLO" && parts[2] == "BIN";
+        m_negotiating = false;
+        auto queued = m_queuedRequests;
+        m_queuedRequests.clear();
+        for (const auto& request : queued)
+            writeRequest(request.first, request.second);
+        return;
+    }
+
+    if (parts.size() >= 4 && parts[0] == "OK" && parts[1] == "Allocated") {
+        m_uploadChunkSize = qBound(MIN_CHUNK_SIZE, parts[3].toInt(), MAX_CHUNK_SIZE);
+        int idx = 4;
+        getChunkInfos(pkt, m_uploadChunks, idx);
+        m_uploadTotal = m_uploadChunks.size();
+        uploadFileToChunk();
+    }
+    else if (parts.size() >= 7 && parts[0] == "METADATA_PAGE") {
+        QVector<ChunkServerInfo> infos;
+        getChunkInfos(pkt, infos, 7);
+        handleMetadataPage(quint8(parts[1].toUInt()), parts[4], parts[5].toLongLong(), qBound(MIN_CHUNK_SIZE, parts[6].toInt(), MAX_CHUNK_SIZE), parts[2].toInt(), parts[3].toInt(), infos);
+    }
+    else if (parts.size() >= 4 && parts[0] == "FILE_METADATA") {
+        if (!expectsMetadata(false, parts[1]))
+            return;
+        int idx = 4;
+        getChunkInfos(pkt, m_downloadChunksInfo, idx);
+        m_downloadChunkSize = qBound(MIN_CHUNK_SIZE, parts[3].toInt(), MAX_CHUNK_SIZE);
+        FileLookup lookup;
+        lookup.size = parts[2].toLongLong();
+        lookup.chunkSize = m_downloadChunkSize;
+        lookup.chunks = m_downloadChunksInfo;
+        cacheMetadata(parts[1], lookup, false);
+        startDownload(lookup.size);
+    }
+    else if (parts.size() >= 5 && parts[0] == "RANGE_METADATA") {
+        if (!expectsMetadata(true, parts[1]))
+            return;
+        getChunkInfos(pkt, m_downloadChunksInfo, 5);
+        m_downloadChunkSize = qBound(MIN_CHUNK_SIZE, parts[3].toInt(), MAX_CHUNK_SIZE);
+        m_downloadFirstChunk = parts[4].toInt();
+        startDownload(parts[2].toLongLong());
+    }
+    else if (parts.size() >= 2 && parts[0] == "FILES_METADATA") {
+        m_batchRemaining = parts[1].toInt() + 1;
+        m_batchFound.clear();
+        m_batchMissing.clear();
+        batchEntryDone();
+    }
+    else if (parts.size() >= 4 && parts[0] == "ENTRY" && m_batchRemaining > 0) {
+        FileLookup lookup;
+        lookup.size = parts[2].toLongLong();
+        lookup.chunkSize = qBound(MIN_CHUNK_SIZE, parts[3].toInt(), MAX_CHUNK_SIZE);
+        getChunkInfos(pkt, lookup.chunks, 4);
+        cacheMetadata(parts[1], lookup, true);
+        m_batchFound.append(parts[1]);
+        batchEntryDone();
+    }
+    else if (parts.size() >= 2 && parts[0] == "MISSING" && m_batchRemaining > 0) {
+        m_batchMissing.append(parts[1]);
+        batchEntryDone();
+    }
+    else if (parts.size() >= 3 && parts[0] == "LEASE") {
+        // applies to the metadata of this file that follows
+        m_pendingLeases.insert(parts[1], m_clock.elapsed() + parts[2].toLongLong());
+    }
+    else if ((pkt == "ERROR File not found" || pkt == "ERROR Invalid range") && expectsMetadata(m_rangeRead, m_downloadId)) {
+        // the master refused the running download's lookup
+        m_downloadActive = false;
+        m_rangeRead = false;
+        m_outFile.close();
+    }
+    else if (parts.size() >= 2 && parts[0] == "INVALIDATE") {
+        m_metadataCache.remove(parts[1]);
+        m_pendingLeases.remove(parts[1]);
+    }
+    else if (parts.size() >= 4 && parts[0] == "RING") {
+        // RING <policy> <vnodes> <count> <ip> <port>...
+        QVector<HashRing::Member> members;
+        for (int i = 4; i + 1 < parts.size(); i += 2)
+            members.append({QHostAddress(parts[i]).toIPv4Address(), parts[i + 1].toUShort()});
+        m_ring = HashRing(parts[2].toInt());
+        m_ring.setMembers(members);
+        m_ringPlacement = parts[1] == "consistent-hash";
+    }
+}
+
+// Keeps metadata that came with a lease, and LOOKUP_FILES results even
+// without one; anything else only serves the download it was fetched for.
+void Client::cacheMetadata(const QString& fileId, FileLookup lookup, bool prefetched) {
+    lookup.leaseExpires = m_pendingLeases.take(fileId);
+    if (lookup.leaseExpires == 0 && !prefetched)
+        return;
+    if (m_metadataCache.size() >= MAX_CACHED_FILES && !m_metadataCache.contains(fileId)) {
+        qint64 now = m_clock.elapsed();
+        for (auto it = m_metadataCache.begin(); it != m_metadataCache.end();)
+            it = it->leaseExpires && it->leaseExpires <= now ? m_metadataCache.erase(it) : std::next(it);
+        if (m_metadataCache.size() >= MAX_CACHED_FILES)
+            m_metadataCache.erase(m_metadataCache.begin());
+    }
+    m_metadataCache.insert(fileId, lookup);
+}
+
+bool Client::cachedMetadata(const QString& fileId, FileLookup& lookup) {
+    auto it = m_metadataCache.find(fileId);
+    if (it == m_metadataCache.end())
+        return false;
+    bool expired = it->leaseExpires && it->leaseExpires <= m_clock.elapsed();
+    if (!expired)
+        lookup = *it;
+    // unleased entries are good for a single download
+    if (expired || !it->leaseExpires)
+        m_metadataCache.erase(it);
+    return !expired;
+}
+
+void Client::batchEntryDone() {
+    if (--m_batchRemaining == 0)
+        emit lookupFinished(m_batchFound, m_batchMissing);
+}
+
+void Client::handleFrame(quint8 opcode, const QByteArray& body) {
+    if (opcode == MasterProtocol::OP_TEXT)
+        handleResponse(QString::fromUtf8(body).trimmed());
+    else if (opcode == MasterProtocol::OP_METADATA)
+        handleMetadataFrame(body);
+    else if (opcode == MasterProtocol::OP_METADATA_BATCH)
+        handleMetadataBatch(body);
+    else if (opcode == MasterProtocol::OP_METADATA_PAGE) {
+        QDataStream in(body);
+        quint32 first = 0;
+        quint32 count = 0;
+        in >> first >> count;
+        quint8 kind = 0;
+        QString fileId;
+        qint64 size = 0;
+        int chunkSize = 0;
+        QVector<ChunkServerInfo> infos;
+        if (in.status() != QDataStream::Ok || !decodeMetadata(body.mid(8), kind, fileId, size, chunkSize, infos))
+            emit errorOccurred("Malformed metadata from master server");
+        else
+            handleMetadataPage(kind, fileId, size, chunkSize, int(first), int(count), infos);
+    }
+    else
+        emit errorOccurred("Unknown frame from master server: " + QString::number(opcode));
+}
+
+// parses an OP_METADATA body; false if it is malformed, a chunk has no
+// location, the chunk size is out of bounds or the chunks are not
+// consecutive from firstChunk
+bool Client::decodeMetadata(const QByteArray& body, quint8& kind, QString& fileId, qint64& size, int& chunkSize,
+                            QVector<ChunkServerInfo>& infos, int* firstChunk) {
+    QDataStream in(body);
+    QByteArray name;
+    quint32 chunkBytes = 0;
+    quint32 count = 0;
+    in >> kind >> name >> size >> chunkBytes >> count;
+    fileId = QString::fromUtf8(name);
+    chunkSize = int(chunkBytes);
+
+    QString prefix = fileId + "_chunk_";
+    infos.clear();
+    if (in.status() != QDataStream::Ok || count > quint32(body.size()) || chunkBytes < MIN_CHUNK_SIZE || chunkBytes > MAX_CHUNK_SIZE)
+        return false;
+    infos.reserve(int(count));
+    quint32 first = 0;
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i) {
+        quint32 index = 0;
+        quint8 numLocations = 0;
+        in >> index >> numLocations;
+        if (i == 0)
+            first = index;
+        if (index != first + i)
+            return false;
+        ChunkServerInfo info;
+        info.chunkId = prefix + QString::number(index);
+        for (int j = 0; j < numLocations; ++j) {
+            quint32 ipv4 = 0;
+            quint16 port = 0;
+            in >> ipv4 >> port;
+            info.replicas.append({QHostAddress(ipv4), port});
+        }
+        infos.append(info);
+    }
+    if (firstChunk)
+        *firstChunk = int(first);
+    bool missing = std::any_of(infos.cbegin(), infos.cend(), [](const ChunkServerInfo& info) { return info.replicas.isEmpty(); });
+    if (in.status() != QDataStream::Ok || missing) {
+        infos.clear();
+        return false;
+    }
+    return true;
+}
+
+void Client::handleMetadataFrame(const QByteArray& body) {
+    quint8 kind = 0;
+    QString fileId;
+    qint64 size = 0;
+    int chunkSize = 0;
+    QVector<ChunkServerInfo> infos;
+    int first = 0;
+    if (!decodeMetadata(body, kind, fileId, size, chunkSize, infos, &first)) {
+        emit errorOccurred("Malformed metadata from master server");
+        return;
+    }
+
+    bool allocated = kind == MasterProtocol::KIND_ALLOCATED;
+    if (!allocated && !expectsMetadata(kind == MasterProtocol::KIND_RANGE, fileId))
+        return;
+    (allocated ? m_uploadChunks : m_downloadChunksInfo) = infos;
+    (allocated ? m_uploadChunkSize : m_downloadChunkSize) = chunkSize;
+    if (kind == MasterProtocol::KIND_LOOKUP) {
+        FileLookup lookup;
+        lookup.size = size;
+        lookup.chunkSize = chunkSize;
+        lookup.chunks = infos;
+        cacheMetadata(fileId, lookup, false);
+    }
+    if (allocated)
+        m_uploadTotal = infos.size();
+    if (kind == MasterProtocol::KIND_RANGE)
+        m_downloadFirstChunk = first;
+    emit responseReceived(QString("%1 %2 (%3 chunks)")
+                              .arg(allocated ? "OK Allocated" : kind == MasterProtocol::KIND_RANGE ? "RANGE_METADATA" : "FILE_METADATA")
+                              .arg(fileId)
+                              .arg(infos.size()));
+    if (allocated)
+        uploadFileToChunk();
+    else
+        startDownload(size);
+}
+
+void Client::handleMetadataBatch(const QByteArray& body) {
+    QDataStream in(body);
+    quint32 count = 0;
+    in >> count;
+    QStringList found;
+    QStringList missing;
+    for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i) {
+        quint8 present = 0;
+        QByteArray entry;
+        in >> present >> entry;
+        if (!present) {
+            missing.append(QString::fromUtf8(entry));
+            continue;
+        }
+        quint8 kind = 0;
+        QString fileId;
+        FileLookup lookup;
+        if (!decodeMetadata(entry, kind, fileId, lookup.size, lookup.chunkSize, lookup.chunks)) {
+            emit errorOccurred("Malformed metadata from master server");
+            return;
+        }
+        cacheMetadata(fileId, lookup, true);
+        found.append(fileId);
+    }
+    if (in.status() != QDataStream::Ok) {
+        emit errorOccurred("Malformed metadata from master server");
+        return;
+    }
+    emit responseReceived(QString("FILES_METADATA %1 found, %2 missing").arg(found.size()).arg(missing.size()));
+    emit lookupFinished(found, missing);
+}
+
+// One page of a large metadata response: first and count describe the whole
+// response. Transfers start on the first page and every later page feeds the
+// already running upload/download windows.
+void Client::handleMetadataPage(quint8 kind, const QString& fileId, qint64 size, int chunkSize, int first, int count, const QVector<ChunkServerInfo>& infos) {
+    if (kind == MasterProtocol::KIND_ALLOCATED) {
+        if (m_uploadChunks.isEmpty())
+            emit responseReceived(QString("OK Allocated %1 (streaming)").arg(count));
+        m_uploadChunks += infos;
+        m_uploadChunkSize = chunkSize;
+        m_uploadTotal = count;
+        uploadFileToChunk();
+        return;
+    }
+
+    bool firstPage = expectsMetadata(kind == MasterProtocol::KIND_RANGE, fileId);
+    // later pages belong to the running download only
+    if (!firstPage && (!m_downloadActive || fileId != m_downloadId || m_downloadChunksInfo.size() + infos.size() > m_downloadChunks))
+        return;
+    m_downloadChunksInfo += infos;
+    // a whole file's chunk list is complete with its last page
+    if (kind == MasterProtocol::KIND_LOOKUP && m_downloadChunksInfo.size() == count) {
+        FileLookup lookup;
+        lookup.size = size;
+        lookup.chunkSize = chunkSize;
+        lookup.chunks = m_downloadChunksInfo;
+        cacheMetadata(m_downloadId, lookup, false);
+    }
+    if (firstPage) {
+        emit responseReceived(QString("FILE_METADATA %1 (%2 chunks, streaming)").arg(m_downloadId).arg(count));
+        if (kind == MasterProtocol::KIND_RANGE)
+            m_downloadFirstChunk = first;
+        m_downloadChunkSize = chunkSize;
+        startDownload(size, count);
+        return;
+    }
+    downloadFileFromChunk();
+}
+
+void Client::startDownload(qint64 fileSize, int totalChunks) {
+    m_downloadSize = fileSize;
+    m_downloadChunks = totalChunks >= 0 ? totalChunks : m_downloadChunksInfo.size();
+    if (m_rangeRead) {
+        // whole chunks around the requested range
+        qint64 bytes = qint64(m_downloadChunks) * m_downloadChunkSize;
+        if (bytes > MAX_RANGE_BYTES + 2 * qint64(m_downloadChunkSize)) {
+            abortDownload("range spans " + QString::number(m_downloadChunks) + " chunks");
+            return;
+        }
+        m_rangeBuffer = QByteArray(bytes, '\0');
+    }
+    // chunks land out of order, so reserve the whole file up front
+    else if (!m_outFile.resize(m_downloadSize > 0 ? m_downloadSize : qint64(m_downloadChunks) * m_downloadChunkSize))
+        emit errorOccurred("Cannot preallocate output: " + m_outFile.fileName());
+    downloadFileFromChunk();
+}
+
+// <chunkId> <ip> <port> [<ip> <port>...] per chunk, one pair per replica
+void Client::getChunkInfos(const QString& pkt, QVector<ChunkServerInfo>& infos, int idx) {
+    auto parts = pkt.split(' ', Qt::SkipEmptyParts);
+    while (idx < parts.size()) {
+        ChunkServerInfo info;
+        info.chunkId = parts[idx++];
+        while (idx + 1 < parts.size() && !QHostAddress(parts[idx]).isNull()) {
+            QHostAddress ip(parts[idx++]);
+            quint16 port = parts[idx++].toUShort();
+            info.replicas.append({ip, port});
+        }
+        if (!info.replicas.isEmpty())
+            infos.append(info);
     }
 }
 
@@ -126,45 +625,221 @@ void Client::uploadFileToChunk() {
     if (m_uploadChunks.isEmpty())
         return;
 
-    if (m_currentChunk >= m_uploadChunks.size()) {
+    if (m_ackedChunks >= m_uploadTotal) {
         m_file.close();
         emit uploadFinished(m_fileId);
         return;
     }
 
-    auto& info = m_uploadChunks[m_currentChunk];
-    m_file.seek(qint64(m_currentChunk) * CHUNK_SIZE);
-    QByteArray data = m_file.read(CHUNK_SIZE);
+    // keep up to m_uploadWindow STOREs in flight; each goes to the first
+    // replica, which relays it down the chain, and the last replica ACKs.
+    // Large chunks shrink the window so the bytes in flight stay bounded.
+    int window = qMin(m_uploadWindow, qMax(1, UDP_BUFFER_SIZE / m_uploadChunkSize));
+    while (m_uploadInFlight.size() < window && m_nextChunk < m_uploadChunks.size())
+        sendStore(m_nextChunk++);
+}
+
+void Client::sendStore(int index) {
+    PendingChunk pending;
+    pending.index = index;
+    pending.seq = m_nextSeq++;
+    transmitStore(m_uploadInFlight.insert(m_uploadChunks[index].chunkId, pending).value());
+}
+
+// sends the given frames of a chunk, or all of them when frames is empty;
+// the other replicas follow as the chain field, so each byte leaves the
+// client once whatever the replication factor
+void Client::transmitStore(PendingChunk& pending, const QList<int>& frames) {
+    auto& info = m_uploadChunks[pending.index];
+    m_file.seek(qint64(pending.index) * m_uploadChunkSize);
+    QByteArray data = m_file.read(m_uploadChunkSize);
     // QByteArray encodedData = encodeChunk(data);
     QByteArray encodedData = data;
 
+    int total = int(encodedData.size());
+    int count = frameCount(total);
+    QList<int> toSend = frames;
+    if (toSend.isEmpty()) {
+        for (int i = 0; i < count; ++i)
+            toSend.append(i);
+    }
 
-    QString header = QString("STORE %1 %2\n").arg(info.chunkId).arg(encodedData.size());
-    QByteArray pkt = header.toUtf8() + encodedData;
+    QString chain;
+    for (int r = 1; r < info.replicas.size(); ++r) {
+        const ChunkLocation& loc = info.replicas[r];
+        chain += (r > 1 ? "," : " ") + loc.ip.toString() + ":" + QString::number(loc.port);
+    }
 
-    // hole-punch ping to open NAT
-    // m_udp->writeDatagram(QByteArray(), QHostAddress("ADDRESS"), info.port);
-    m_udp->writeDatagram(pkt, info.ip, info.port);
+    const ChunkLocation& head = info.replicas.first();
+    for (int frame : toSend) {
+        if (frame >= count)
+            continue;
+        int offset = frame * FRAME_PAYLOAD_SIZE;
+        QByteArray part = encodedData.mid(offset, FRAME_PAYLOAD_SIZE);
+        QString header = QString("STORE %1 %2 %3 %4 %5%6\n").arg(info.chunkId).arg(total).arg(pending.seq).arg(offset).arg(part.size()).arg(chain);
+        QByteArray pkt = header.toUtf8() + part;
+
+        // hole-punch ping to open NAT
+        // m_udp->writeDatagram(QByteArray(), QHostAddress("ADDRESS"), head.port);
+        m_udp->writeDatagram(pkt, head.ip, head.port);
+    }
+    // the RTO for the head covers the whole chain
+    armRetransmit(pending, head);
+    emit logReceived(QString("Sent %1 → %2:%3").arg(info.chunkId).arg(head.ip.toString()).arg(head.port));
 
     // TODO: noise
     // double noiseRate = 0.001; // Define or pass as parameter
     // QByteArray noisyPkt = addNoise(pkt, noiseRate);
     // m_udp->writeDatagram(noisyPkt, info.ip, info.port);
-
-    emit logReceived(QString("Sent %1 → %2:%3").arg(info.chunkId).arg(info.ip.toString()).arg(info.port));
 }
 
 void Client::downloadFileFromChunk() {
-    if (m_downloadChunksInfo.isEmpty() || m_downloadCurrent >= m_downloadChunks)
+    if (m_downloadReceived >= m_downloadChunks) {
+        finishDownload();
         return;
+    }
+
+    int window = qMin(m_downloadWindow, qMax(1, UDP_BUFFER_SIZE / m_downloadChunkSize));
+    while (m_downloadInFlight.size() < window && m_downloadNext < m_downloadChunksInfo.size())
+        sendRetrieve(m_downloadNext++);
+}
 
-    auto& info = m_downloadChunksInfo[m_downloadCurrent];
-    QString header = QString("RETRIEVE %1\n").arg(info.chunkId);
+void Client::sendRetrieve(int index) {
+    PendingChunk pending;
+    pending.index = index;
+    pending.seq = m_nextSeq++;
+    // the master lists the nearest replica first; the others are fallbacks
+    m_downloadChunksInfo[index].current = 0;
+    transmitRetrieve(m_downloadInFlight.insert(m_downloadChunksInfo[index].chunkId, pending).value());
+}
+
+void Client::transmitRetrieve(PendingChunk& pending) {
+    auto& info = m_downloadChunksInfo[pending.index];
+    QString header = QString("RETRIEVE %1 %2").arg(info.chunkId).arg(pending.seq);
+    // some frames already arrived: re-request only the gaps
+    if (!pending.frames.isEmpty())
+        header += " " + encodeFrameList(pending.frames.missingFrames());
+    header += "\n";
 
+    const ChunkLocation& loc = info.location();
     // hole-punch ping to open NAT
-    // m_udp->writeDatagram(QByteArray(), QHostAddress("ADDRESS"), info.port);
-    m_udp->writeDatagram(header.toUtf8(), info.ip, info.port);
-    emit logReceived(QString("Requested %1 → %2:%3").arg(info.chunkId).arg(info.ip.toString()).arg(info.port));
+    // m_udp->writeDatagram(QByteArray(), QHostAddress("ADDRESS"), loc.port);
+    m_udp->writeDatagram(header.toUtf8(), loc.ip, loc.port);
+    armRetransmit(pending, loc);
+    emit logReceived(QString("Requested %1 → %2:%3").arg(info.chunkId).arg(loc.ip.toString()).arg(loc.port));
+}
+
+void Client::finishDownload() {
+    m_downloadActive = false;
+    if (m_rangeRead) {
+        m_rangeRead = false;
+        qint64 start = m_rangeOffset - qint64(m_downloadFirstChunk) * m_downloadChunkSize;
+        qint64 available = qMax<qint64>(0, qMin<qint64>(m_downloadEnd, m_rangeBuffer.size()) - start);
+        QByteArray data = start < m_rangeBuffer.size() ? m_rangeBuffer.mid(start, qMin(m_rangeLength, available)) : QByteArray();
+        m_rangeBuffer.clear();
+        emit rangeReadFinished(m_downloadId, m_rangeOffset, data);
+        return;
+    }
+    if (!m_outFile.isOpen())
+        return;
+    // metadata from before sizes were recorded: trim the preallocated tail
+    if (m_downloadSize <= 0)
+        m_outFile.resize(m_downloadEnd);
+    m_outFile.close();
+    QFileInfo fi(m_outFile.fileName());
+    emit downloadFinished(m_downloadId, fi.absoluteFilePath(), fi.size());
+}
+
+void Client::armRetransmit(PendingChunk& pending, const ChunkLocation& location) {
+    pending.sentAt = m_clock.elapsed();
+    pending.deadline = pending.sentAt + rttFor(location).rto();
+    if (!m_retransmitTimer->isActive())
+        m_retransmitTimer->start();
+}
+
+void Client::sampleRtt(const PendingChunk& pending, const ChunkLocation& location) {
+    // Karn's algorithm: a reply to a retransmitted request is ambiguous
+    if (!pending.retransmitted)
+        rttFor(location).addSample(m_clock.elapsed() - pending.sentAt);
+}
+
+RttEstimator& Client::rttFor(const ChunkLocation& location) {
+    return m_rtt[location.ip.toString() + ":" + QString::number(location.port)];
+}
+
+
+void Client::onRetransmitTimer() {
+    if (m_uploadInFlight.isEmpty() && m_downloadInFlight.isEmpty()) {
+        m_retransmitTimer->stop();
+        return;
+    }
+
+    qint64 now = m_clock.elapsed();
+    QString failed;
+    for (auto it = m_uploadInFlight.begin(); it != m_uploadInFlight.end(); ++it) {
+        if (it->deadline > now)
+            continue;
+        if (it->retries >= MAX_RETRIES) {
+            failed = it.key();
+            break;
+        }
+        ++it->retries;
+        it->retransmitted = true;
+        rttFor(m_uploadChunks[it->index].replicas.first()).backoff();
+        // resend only the last frame as a probe; the chunk server answers
+        // with an ACK or a NACK listing the frames it is missing
+        QList<int> probe{frameCount(int(qMin<qint64>(m_uploadChunkSize, m_fileSize - qint64(it->index) * m_uploadChunkSize))) - 1};
+        transmitStore(it.value(), probe);
+    }
+    if (!failed.isEmpty())
+        abortUpload(QString("STORE %1 timed out after %2 retries").arg(failed).arg(MAX_RETRIES));
+
+    failed.clear();
+    for (auto it = m_downloadInFlight.begin(); it != m_downloadInFlight.end(); ++it) {
+        if (it->deadline > now)
+            continue;
+        if (it->retries >= MAX_RETRIES) {
+            failed = it.key();
+            break;
+        }
+        ++it->retries;
+        it->retransmitted = true;
+        ChunkServerInfo& info = m_downloadChunksInfo[it->index];
+        rttFor(info.location()).backoff();
+        // every listed replica has had its turn: the chunk may have moved
+        // since the metadata was read, so also try its owners on the ring
+        if (it->retries == info.replicas.size()) {
+            for (const ChunkLocation& owner : expectedLocations(info.chunkId, info.replicas.size())) {
+                bool listed = std::any_of(info.replicas.cbegin(), info.replicas.cend(), [&owner](const ChunkLocation& replica) {
+                    return replica.ip == owner.ip && replica.port == owner.port;
+                });
+                if (!listed)
+                    info.replicas.append(owner);
+            }
+        }
+        // the replica may be down: try the next one
+        info.current = (info.current + 1) % info.replicas.size();
+        transmitRetrieve(it.value());
+    }
+    if (!failed.isEmpty())
+        abortDownload(QString("RETRIEVE %1 timed out after %2 retries").arg(failed).arg(MAX_RETRIES));
+}
+
+void Client::abortUpload(const QString& reason) {
+    m_uploadInFlight.clear();
+    m_uploadChunks.clear();
+    m_file.close();
+    emit errorOccurred("Upload of " + m_fileId + " failed: " + reason);
+}
+
+void Client::abortDownload(const QString& reason) {
+    m_downloadInFlight.clear();
+    m_downloadChunksInfo.clear();
+    m_downloadActive = false;
+    m_rangeRead = false;
+    m_rangeBuffer.clear();
+    m_outFile.close();
+    emit errorOccurred("Download of " + m_downloadId + " failed: " + reason);
 }
 
 void Client::onUdpReadyRead() {
@@ -189,33 +864,81 @@ void Client::onUdpReadyRead() {
             QString nip = parts[2];
             quint16 npt = parts[3].toUShort();
             bool corrupt = (parts.size() > 4 && parts[4] == "1");
+            auto it = m_uploadInFlight.find(cid);
+            if (it == m_uploadInFlight.end())
+                continue; // duplicate ACK of a retransmitted STORE
+            if (parts.size() > 5 && parts[5].toUInt() != it->seq)
+                continue; // stale ACK from an earlier upload of this chunk
+            sampleRtt(it.value(), m_uploadChunks[it->index].replicas.first());
+            m_uploadInFlight.erase(it);
             emit chunkAckReceived(cid, nip, npt, corrupt);
-            emit uploadProgress(m_currentChunk + 1, m_uploadChunks.size());
-            ++m_currentChunk;
+            ++m_ackedChunks;
+            emit uploadProgress(m_ackedChunks, m_uploadTotal);
             uploadFileToChunk();
         } 
+        else if (parts[0] == "NACK" && parts.size() >= 4) {
+            auto it = m_uploadInFlight.find(parts[1]);
+            if (it == m_uploadInFlight.end() || parts[2].toUInt() != it->seq)
+                continue;
+            it->retransmitted = true;
+            transmitStore(it.value(), decodeFrameList(parts[3]));
+        }
         else if (parts[0] == "DATA" && parts.size() >= 4) {
             QString cid = parts[1];
             bool corrupt = (parts[2] == "1");
-            int len = parts[3].toInt();
-            QByteArray encodedData = payload.left(len);
+            bool lengthOk = false;
+            int len = parts[3].toInt(&lengthOk);
+            // chunks are written at index * m_downloadChunkSize, so a longer
+            // one would overwrite the next; only the last may be shorter
+            if (!lengthOk || len <= 0 || len > m_downloadChunkSize)
+                continue;
+            QByteArray encodedData;
+            // DATA <chunkId> <corrupt> <totalLen> <seq> <offset> <frameLen> is one frame
+            if (parts.size() >= 7) {
+                auto it = m_downloadInFlight.find(cid);
+                if (it == m_downloadInFlight.end() || parts[4].toUInt() != it->seq)
+                    continue;
+                int frameLen = parts[6].toInt();
+                if (it->frames.isEmpty())
+                    it->frames = FrameAssembly(len);
+                else if (it->frames.totalLength() != len)
+                    continue;
+                if (!it->frames.addFrame(parts[5].toInt(), payload.left(frameLen)) || !it->frames.isComplete())
+                    continue;
+                encodedData = it->frames.data();
+            }
+            else {
+                encodedData = payload.left(len);
+            }
             bool decodeCorrupted = false;
             // QByteArray data = decodeChunk(encodedData, decodeCorrupted);
             QByteArray data = encodedData;
 
             if (decodeCorrupted)
                 corrupt = true;
-            m_outFile.write(data);
-            emit chunkDataReceived(cid, data, corrupt);
-            emit downloadProgress(m_downloadCurrent + 1, m_downloadChunks);
-            ++m_downloadCurrent;
-            if (m_downloadCurrent < m_downloadChunks)
-                downloadFileFromChunk();
+
+            auto it = m_downloadInFlight.find(cid);
+            if (it == m_downloadInFlight.end())
+                continue; // duplicate DATA of a retransmitted RETRIEVE
+            if (parts.size() > 4 && parts[4].toUInt() != it->seq)
+                continue;
+            sampleRtt(it.value(), m_downloadChunksInfo[it->index].location());
+            qint64 offset = qint64(it->index) * m_downloadChunkSize;
+            m_downloadInFlight.erase(it);
+
+            if (m_rangeRead) {
+                m_rangeBuffer.replace(offset, qMin<qint64>(data.size(), m_rangeBuffer.size() - offset), data);
+            }
             else {
-                m_outFile.close();
-                QFileInfo fi(m_outFile.fileName());
-                emit downloadFinished(m_downloadId, fi.absoluteFilePath(), fi.size());
+                offset += qint64(m_downloadFirstChunk) * m_downloadChunkSize;
+                m_outFile.seek(offset);
+                m_outFile.write(data);
             }
+            m_downloadEnd = qMax(m_downloadEnd, offset + data.size());
+            emit chunkDataReceived(cid, data, corrupt);
+            ++m_downloadReceived;
+            emit downloadProgress(m_downloadReceived, m_downloadChunks);
+            downloadFileFromChunk();
         }
     }
 }
@@ -1,17 +1,58 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include <QElapsedTimer>
 #include <QFile>
+#include <QHash>
 #include <QHostAddress>
+#include <QList>
 #include <QObject>
+#include <QPair>
+#include <QStringList>
 #include <QTcpSocket>
+#include <QTimer>
 #include <QUdpSocket>
 #include <QVector>
 
+#include "chunkFrames.h"
+#include "hashRing.h"
+#include "masterProtocol.h"
+#include "rttEstimator.h"
+
+struct ChunkLocation {
+    QHostAddress ip;
+    quint16 port = 0;
+};
+
 struct ChunkServerInfo {
     QString chunkId;
-    QHostAddress ip;
-    quint16 port;
+    QVector<ChunkLocation> replicas; // never empty
+    int current = 0;                 // replica RETRIEVEs go to
+
+    const ChunkLocation& location() const { return replicas[current]; }
+};
+
+// Cached metadata of one file. With a lease from the master it is reused
+// until leaseExpires unless the master sends INVALIDATE first; without one
+// (a LOOKUP_FILES result from a master that grants none) it serves a single
+// download.
+struct FileLookup {
+    qint64 size = 0;
+    int chunkSize = DEFAULT_CHUNK_SIZE;
+    QVector<ChunkServerInfo> chunks;
+    qint64 leaseExpires = 0; // ms on Client::m_clock, 0 if not leased
+};
+
+// a STORE or RETRIEVE awaiting its ACK/DATA; seq stays the same across
+// retransmissions so the chunk server can recognise duplicates
+struct PendingChunk {
+    int index = 0;
+    quint32 seq = 0;
+    qint64 sentAt = 0;   // ms on Client::m_clock
+    qint64 deadline = 0;
+    int retries = 0;
+    bool retransmitted = false; // RTT samples are ambiguous after a resend
+    FrameAssembly frames;       // DATA frames received so far (downloads only)
 };
 
 class Client : public QObject {
@@ -21,6 +62,16 @@ public:
     ~Client();
 
     Q_INVOKABLE void sendCommand(const QString& command, const QString& params);
+    Q_INVOKABLE void setUploadWindow(int window);
+    Q_INVOKABLE void setDownloadWindow(int window);
+    // use the binary master protocol on the next connection (default on)
+    Q_INVOKABLE void setBinaryProtocol(bool enabled);
+    // fetches only the chunks covering [offset, offset + length) of a file,
+    // at most MAX_RANGE_BYTES; refused while another download is running
+    Q_INVOKABLE void readRange(const QString& fileId, qint64 offset, qint64 length);
+    // where the master's consistent-hash placement puts a chunk, from the
+    // ring it sent on connect; empty under any other placement policy
+    QVector<ChunkLocation> expectedLocations(const QString& chunkId, int count) const;
 
 signals:
     void responseReceived(const QString& response);
@@ -35,6 +86,9 @@ signals:
     void downloadProgress(int current, int total);
     void chunkDataReceived(const QString& chunkId, QByteArray data, bool corrupted);
     void downloadFinished(const QString& fileId, const QString& filePath, qint64 fileSize);
+    // a LOOKUP_FILES batch was answered; found files download without asking the master again
+    void lookupFinished(const QStringList& found, const QStringList& missing);
+    void rangeReadFinished(const QString& fileId, qint64 offset, const QByteArray& data);
 
 private slots:
     void onConnected();
@@ -43,13 +97,41 @@ private slots:
     void onError(QAbstractSocket::SocketError);
 
     void onUdpReadyRead();
+    void onRetransmitTimer();
 
 private:
+    void writeRequest(const QString& command, const QString& params);
+    void handleResponse(const QString& pkt);
+    void handleFrame(quint8 opcode, const QByteArray& body);
+    void handleMetadataFrame(const QByteArray& body);
+    void handleMetadataBatch(const QByteArray& body);
+    void handleMetadataPage(quint8 kind, const QString& fileId, qint64 size, int chunkSize, int first, int count, const QVector<ChunkServerInfo>& infos);
+    void batchEntryDone();
+    void cacheMetadata(const QString& fileId, FileLookup lookup, bool prefetched);
+    bool cachedMetadata(const QString& fileId, FileLookup& lookup);
+    static bool decodeMetadata(const QByteArray& body, quint8& kind, QString& fileId, qint64& size, int& chunkSize,
+                               QVector<ChunkServerInfo>& infos, int* firstChunk = nullptr);
+    void resetDownload(const QString& fileId);
+    // metadata for fileId answers the running download's lookup
+    bool expectsMetadata(bool range, const QString& fileId) const;
+    void startDownload(qint64 fileSize, int totalChunks = -1);
+
     void uploadFileToChunk();
+    void sendStore(int index);
+    void transmitStore(PendingChunk& pending, const QList<int>& frames = QList<int>());
     void downloadFileFromChunk();
+    void sendRetrieve(int index);
+    void transmitRetrieve(PendingChunk& pending);
+    void finishDownload();
+
+    void armRetransmit(PendingChunk& pending, const ChunkLocation& location);
+    void sampleRtt(const PendingChunk& pending, const ChunkLocation& location);
+    RttEstimator& rttFor(const ChunkLocation& location);
+    void abortUpload(const QString& reason);
+    void abortDownload(const QString& reason);
 
     static QString parentDirectory();
-    void getChunkInfos(const QString& pkt, QVector<ChunkServerInfo>& infos, int idx, int numChunks);
+    void getChunkInfos(const QString& pkt, QVector<ChunkServerInfo>& infos, int idx);
 
     QTcpSocket* m_tcp;
     QUdpSocket* m_udp;
@@ -57,21 +139,64 @@ private:
     quint16 m_masterPort;
     bool m_connected = false;
 
+    bool m_preferBinary = true;
+    bool m_negotiating = false; // HELLO sent, reply pending
+    bool m_binary = false;
+    QByteArray m_tcpBuffer;     // partial binary frame from the master
+    QList<QPair<QString, QString>> m_queuedRequests; // held back while negotiating
+
     QFile m_file;
     QString m_fileId;
     qint64 m_fileSize = 0;
-    int m_numChunks = 0;
-    int m_currentChunk = 0;
-    QVector<ChunkServerInfo> m_uploadChunks;
+    int m_nextChunk = 0;  // next chunk index to send
+    int m_ackedChunks = 0;
+    int m_uploadChunkSize = DEFAULT_CHUNK_SIZE; // as allocated by the master
+    int m_uploadWindow = DEFAULT_UPLOAD_WINDOW;
+    QHash<QString, PendingChunk> m_uploadInFlight; // chunkId -> STORE awaiting ACK
+    QVector<ChunkServerInfo> m_uploadChunks; // may still be arriving in pages
+    int m_uploadTotal = 0;                   // chunks in the allocation
 
     QFile m_outFile;
+    bool m_downloadActive = false; // from the lookup until finishDownload() or abortDownload()
     QString m_downloadId;
-    int m_downloadChunks = 0;
-    int m_downloadCurrent = 0;
+    qint64 m_downloadSize = 0;
+    qint64 m_downloadEnd = 0; // end offset of the furthest chunk written
+    int m_downloadChunks = 0; // chunks in the response; m_downloadChunksInfo may still be filling
+    int m_downloadNext = 0;   // next chunk index to request
+    int m_downloadReceived = 0;
+    int m_downloadWindow = DEFAULT_DOWNLOAD_WINDOW;
+    QHash<QString, PendingChunk> m_downloadInFlight; // chunkId -> RETRIEVE awaiting DATA
     QVector<ChunkServerInfo> m_downloadChunksInfo;
+    int m_downloadFirstChunk = 0; // file chunk index of m_downloadChunksInfo[0]
+    int m_downloadChunkSize = DEFAULT_CHUNK_SIZE;
+
+    // a readRange() in progress collects into memory instead of m_outFile
+    bool m_rangeRead = false;
+    qint64 m_rangeOffset = 0;
+    qint64 m_rangeLength = 0;
+    QByteArray m_rangeBuffer;
+
+    QHash<QString, FileLookup> m_metadataCache; // fileId -> leased or prefetched metadata
+    QHash<QString, qint64> m_pendingLeases;     // fileId -> expiry of a lease whose metadata is on its way
+    HashRing m_ring;                            // chunk server membership as of the last RING
+    bool m_ringPlacement = false;               // the master places chunks by m_ring
+    int m_batchRemaining = 0;                // text protocol entries still expected
+    QStringList m_batchFound;
+    QStringList m_batchMissing;
+
+    QElapsedTimer m_clock;
+    QTimer* m_retransmitTimer;
+    QHash<QString, RttEstimator> m_rtt; // "ip:port" -> estimator for that chunk server
+    quint32 m_nextSeq = 1;
 
-    static constexpr int CHUNK_SIZE = 8 * 1024;
     static constexpr int CHUNK_SERVER_BASE_PORT = 5000;
+    static constexpr int DEFAULT_UPLOAD_WINDOW = 16;
+    static constexpr int DEFAULT_DOWNLOAD_WINDOW = 32;
+    static constexpr int UDP_BUFFER_SIZE = 4 * 1024 * 1024;
+    static constexpr int RETRANSMIT_TICK_MS = 10;
+    static constexpr int MAX_RETRIES = 8;
+    static constexpr int MAX_CACHED_FILES = 4096;
+    static constexpr qint64 MAX_RANGE_BYTES = 64 * 1024 * 1024; // held in memory by readRange()
 
 };
 
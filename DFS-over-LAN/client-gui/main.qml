@@ -26,7 +26,7 @@ Window {
 
             ComboBox {
                 id: commandCombo
-                model: ["LOOKUP_FILE", "ALLOCATE_CHUNKS", "REGISTER_CHUNK_REPLICA"]
+                model: ["LOOKUP_FILE", "LOOKUP_FILES", "LIST", "LIST_RECURSIVE", "MKDIR", "DELETE_FILE", "ALLOCATE_CHUNKS", "REGISTER_CHUNK_REPLICA", "RING", "LOCATE"]
                 Layout.preferredWidth: 200
             }
 
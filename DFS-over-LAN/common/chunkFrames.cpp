@@ -0,0 +1,56 @@
+#include "chunkFrames.h"
+
+#include <QStringList>
+#include <cstring>
+
+FrameAssembly::FrameAssembly(int totalLength)
+    : m_data(totalLength, '\0'), m_received(frameCount(totalLength)) {}
+
+bool FrameAssembly::addFrame(int offset, const QByteArray& data, bool* duplicate) {
+    if (duplicate)
+        *duplicate = false;
+    if (offset < 0 || offset % FRAME_PAYLOAD_SIZE != 0 || offset + data.size() > m_data.size())
+        return false;
+
+    int frame = offset / FRAME_PAYLOAD_SIZE;
+    int expected = qMin(FRAME_PAYLOAD_SIZE, int(m_data.size()) - offset);
+    if (data.size() != expected)
+        return false;
+
+    if (m_received.testBit(frame)) {
+        if (duplicate)
+            *duplicate = true;
+        return true;
+    }
+    memcpy(m_data.data() + offset, data.constData(), data.size());
+    m_received.setBit(frame);
+    ++m_receivedCount;
+    return true;
+}
+
+QList<int> FrameAssembly::missingFrames(int limit) const {
+    QList<int> missing;
+    for (int i = 0; i < m_received.size() && missing.size() < limit; ++i) {
+        if (!m_received.testBit(i))
+            missing.append(i);
+    }
+    return missing;
+}
+
+QString encodeFrameList(const QList<int>& frames) {
+    QStringList parts;
+    for (int f : frames)
+        parts.append(QString::number(f));
+    return parts.join(',');
+}
+
+QList<int> decodeFrameList(const QString& text) {
+    QList<int> frames;
+    for (const QString& part : text.split(',', Qt::SkipEmptyParts)) {
+        bool ok = false;
+        int f = part.toInt(&ok);
+        if (ok && f >= 0)
+            frames.append(f);
+    }
+    return frames;
+}
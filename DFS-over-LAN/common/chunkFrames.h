@@ -0,0 +1,51 @@
+#ifndef CHUNKFRAMES_H
+#define CHUNKFRAMES_H
+
+#include <QBitArray>
+#include <QByteArray>
+#include <QList>
+#include <QString>
+
+// payload bytes per STORE/DATA datagram; leaves room for the text header
+// inside a 1500-byte Ethernet MTU so chunks never rely on IP fragmentation
+static constexpr int FRAME_PAYLOAD_SIZE = 1200;
+// cap on frame indices listed in one NACK or selective RETRIEVE
+static constexpr int MAX_FRAME_LIST = 200;
+
+// Chunk size is a per-file attribute chosen at allocation; these are the
+// bounds every component accepts, and the master may narrow them further.
+// DEFAULT_CHUNK_SIZE was the fixed size before and is assumed for files
+// recorded without one.
+static constexpr int DEFAULT_CHUNK_SIZE = 8 * 1024;
+static constexpr int MIN_CHUNK_SIZE = 1024;
+static constexpr int MAX_CHUNK_SIZE = 4 * 1024 * 1024;
+
+inline int frameCount(int totalLength) {
+    return qMax(1, (totalLength + FRAME_PAYLOAD_SIZE - 1) / FRAME_PAYLOAD_SIZE);
+}
+
+// Reassembles one chunk from frames that may arrive out of order or twice.
+class FrameAssembly {
+public:
+    FrameAssembly() = default;
+    explicit FrameAssembly(int totalLength);
+
+    // returns false if the frame does not fit this chunk
+    bool addFrame(int offset, const QByteArray& data, bool* duplicate = nullptr);
+    bool isEmpty() const { return m_receivedCount == 0; }
+    bool isComplete() const { return m_receivedCount == m_received.size(); }
+    bool hasFrame(int frame) const { return frame >= 0 && frame < m_received.size() && m_received.testBit(frame); }
+    QList<int> missingFrames(int limit = MAX_FRAME_LIST) const;
+    int totalLength() const { return int(m_data.size()); }
+    const QByteArray& data() const { return m_data; }
+
+private:
+    QByteArray m_data;
+    QBitArray m_received;
+    int m_receivedCount = 0;
+};
+
+QString encodeFrameList(const QList<int>& frames);
+QList<int> decodeFrameList(const QString& text);
+
+#endif // CHUNKFRAMES_H
@@ -0,0 +1,58 @@
+#include "hashRing.h"
+
+#include <QtEndian>
+#include <algorithm>
+
+HashRing::HashRing(int vnodes) : m_vnodes(qMax(1, vnodes)) {}
+
+void HashRing::setMembers(const QVector<Member>& members) {
+    m_members = members;
+    m_points.clear();
+    m_points.reserve(members.size() * m_vnodes);
+    for (int i = 0; i < members.size(); ++i) {
+        // point v of a member hashes "<ipv4><port><v>", all big endian
+        char key[10];
+        qToBigEndian<quint32>(members[i].ipv4, key);
+        qToBigEndian<quint16>(members[i].port, key + 4);
+        for (int v = 0; v < m_vnodes; ++v) {
+            qToBigEndian<quint32>(quint32(v), key + 6);
+            m_points.append({hash(QByteArray::fromRawData(key, sizeof(key))), i});
+        }
+    }
+    // ties are broken by member so every process orders the ring the same way
+    std::sort(m_points.begin(), m_points.end(), [](const Point& a, const Point& b) {
+        return a.hash != b.hash ? a.hash < b.hash : a.member < b.member;
+    });
+}
+
+QVector<int> HashRing::locate(const QByteArray& key, int count) const {
+    QVector<int> owners;
+    if (m_points.isEmpty())
+        return owners;
+    count = qMin(count, int(m_members.size()));
+    quint32 h = hash(key);
+    auto start = std::lower_bound(m_points.cbegin(), m_points.cend(), h,
+                                  [](const Point& p, quint32 value) { return p.hash < value; });
+    int first = int(start - m_points.cbegin());
+    for (int i = 0; i < m_points.size() && owners.size() < count; ++i) {
+        int member = m_points[(first + i) % m_points.size()].member;
+        if (!owners.contains(member))
+            owners.append(member);
+    }
+    return owners;
+}
+
+// 32-bit FNV-1a with the MurmurHash3 finaliser to spread nearby keys
+quint32 HashRing::hash(const QByteArray& data) {
+    quint32 h = 2166136261u;
+    for (char c : data) {
+        h ^= quint8(c);
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
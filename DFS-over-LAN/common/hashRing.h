@@ -0,0 +1,49 @@
+#ifndef HASHRING_H
+#define HASHRING_H
+
+#include <QByteArray>
+#include <QVector>
+#include <QtGlobal>
+
+// Consistent-hash ring of chunk servers. Each member owns VNODES points on
+// a 32-bit ring and a key belongs to the members found walking clockwise
+// from its hash, so adding or removing one of N members moves only about
+// 1/N of the keys. The master and clients build the same ring from the
+// same member list, which lets either side work out where a chunk lives.
+class HashRing {
+public:
+    struct Member {
+        quint32 ipv4 = 0;
+        quint16 port = 0;
+
+        bool operator==(const Member& other) const { return ipv4 == other.ipv4 && port == other.port; }
+        bool operator!=(const Member& other) const { return !(*this == other); }
+    };
+
+    static constexpr int DEFAULT_VNODES = 64;
+
+    explicit HashRing(int vnodes = DEFAULT_VNODES);
+
+    void setMembers(const QVector<Member>& members);
+    const QVector<Member>& members() const { return m_members; }
+    int vnodes() const { return m_vnodes; }
+    bool isEmpty() const { return m_members.isEmpty(); }
+
+    // indices into members() of up to count distinct owners of key, in ring order
+    QVector<int> locate(const QByteArray& key, int count) const;
+
+    // stable across processes and platforms, unlike qHash
+    static quint32 hash(const QByteArray& data);
+
+private:
+    struct Point {
+        quint32 hash;
+        int member;
+    };
+
+    int m_vnodes;
+    QVector<Member> m_members;
+    QVector<Point> m_points; // sorted by hash
+};
+
+#endif // HASHRING_H
@@ -0,0 +1,32 @@
+#include "masterProtocol.h"
+
+#include <QtEndian>
+
+namespace MasterProtocol {
+
+QByteArray encodeFrame(quint8 opcode, const QByteArray& body) {
+    QByteArray frame(5, '\0');
+    qToBigEndian<quint32>(quint32(body.size() + 1), frame.data());
+    frame[4] = char(opcode);
+    frame.append(body);
+    return frame;
+}
+
+bool takeFrame(QByteArray& buffer, quint8& opcode, QByteArray& body, bool& malformed) {
+    malformed = false;
+    if (buffer.size() < 4)
+        return false;
+    quint32 length = qFromBigEndian<quint32>(buffer.constData());
+    if (length == 0 || length > MAX_FRAME_SIZE) {
+        malformed = true;
+        return false;
+    }
+    if (quint64(buffer.size()) < 4 + quint64(length))
+        return false;
+    opcode = quint8(buffer.at(4));
+    body = buffer.mid(5, int(length) - 1);
+    buffer.remove(0, 4 + int(length));
+    return true;
+}
+
+} // namespace MasterProtocol
@@ -0,0 +1,47 @@
+#ifndef MASTERPROTOCOL_H
+#define MASTERPROTOCOL_H
+
+#include <QByteArray>
+
+// Binary framing for the master TCP protocol. A connection starts in the
+// text protocol and switches after "HELLO BIN <version>" is answered with
+// "OK HELLO BIN <version>". From then on every message in both directions is
+//
+//   u32 length | u8 opcode | body      (big endian, length = 1 + body size)
+//
+// Bodies are written with QDataStream; strings are UTF-8 QByteArrays.
+namespace MasterProtocol {
+
+// 2: metadata carries the file's chunk size
+static constexpr int VERSION = 2;
+static constexpr quint32 MAX_FRAME_SIZE = 256 * 1024 * 1024;
+
+enum Opcode : quint8 {
+    OP_TEXT = 1,     // one text-protocol line, for commands without a binary form
+    OP_ALLOCATE = 2, // fileId, i64 size [, u8 replication factor [, u32 chunk size, 0 to let the master pick]]
+    OP_LOOKUP = 3,   // fileId
+    OP_METADATA = 4, // u8 kind, fileId, i64 size, u32 chunk size, u32 chunk count, chunk records
+    OP_LOOKUP_BATCH = 5,   // u32 count, fileIds
+    OP_METADATA_BATCH = 6, // u32 count, { u8 found, OP_METADATA body if found else fileId }
+    OP_LOOKUP_RANGE = 7,   // fileId, i64 offset, i64 length
+    OP_METADATA_PAGE = 8,  // u32 first chunk of the response, u32 chunks in the response, OP_METADATA body of this page
+};
+
+enum MetadataKind : quint8 {
+    KIND_ALLOCATED = 0,
+    KIND_LOOKUP = 1,
+    KIND_RANGE = 2, // only the chunks covering a LOOKUP_RANGE, in index order
+};
+
+// A chunk record is
+//   u32 chunk index | u8 location count | { u32 IPv4 | u16 port } * count
+// and the chunk ID is <fileId>_chunk_<index>.
+
+QByteArray encodeFrame(quint8 opcode, const QByteArray& body);
+// removes one complete frame from the front of buffer; returns false if
+// buffer does not hold a whole frame yet, setting malformed on bad lengths
+bool takeFrame(QByteArray& buffer, quint8& opcode, QByteArray& body, bool& malformed);
+
+} // namespace MasterProtocol
+
+#endif // MASTERPROTOCOL_H
@@ -0,0 +1,23 @@
+#include "rttEstimator.h"
+
+#include <QtMath>
+
+void RttEstimator::addSample(qint64 rttMs) {
+    double r = double(rttMs);
+    if (!m_hasSample) {
+        m_srtt = r;
+        m_rttvar = r / 2;
+        m_hasSample = true;
+    }
+    else {
+        m_rttvar = 0.75 * m_rttvar + 0.25 * qAbs(m_srtt - r);
+        m_srtt = 0.875 * m_srtt + 0.125 * r;
+    }
+    // 1 ms is the clock granularity G
+    qint64 rto = qCeil(m_srtt + qMax(1.0, 4 * m_rttvar));
+    m_rto = qBound(MIN_RTO_MS, rto, MAX_RTO_MS);
+}
+
+void RttEstimator::backoff() {
+    m_rto = qMin(m_rto * 2, MAX_RTO_MS);
+}
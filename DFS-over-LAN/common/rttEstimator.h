@@ -0,0 +1,25 @@
+#ifndef RTTESTIMATOR_H
+#define RTTESTIMATOR_H
+
+#include <QtGlobal>
+
+// Retransmission timeout estimator (RFC 6298): smoothed RTT plus four times
+// the RTT variance, clamped to [MIN_RTO_MS, MAX_RTO_MS].
+class RttEstimator {
+public:
+    void addSample(qint64 rttMs);
+    void backoff();
+    qint64 rto() const { return m_rto; }
+
+    static constexpr qint64 INITIAL_RTO_MS = 200;
+    static constexpr qint64 MIN_RTO_MS = 20;
+    static constexpr qint64 MAX_RTO_MS = 2000;
+
+private:
+    double m_srtt = 0;
+    double m_rttvar = 0;
+    bool m_hasSample = false;
+    qint64 m_rto = INITIAL_RTO_MS;
+};
+
+#endif // RTTESTIMATOR_H
@@ -0,0 +1,114 @@
+#include "chunkservermonitor.h"
+
+#include <QDebug>
+
+ChunkServerMonitor::ChunkServerMonitor(QObject* parent) : QObject(parent) {
+    m_clock.start();
+    m_checkTimer = new QTimer(this);
+    m_checkTimer->setInterval(CHECK_INTERVAL_MS);
+    connect(m_checkTimer, &QTimer::timeout, this, &ChunkServerMonitor::checkLiveness);
+    m_checkTimer->start();
+}
+
+bool ChunkServerMonitor::touch(ChunkServerStatus& status, int serverId, quint16 server) {
+    status.serverId = serverId;
+    status.server = server;
+    status.lastHeartbeat = m_clock.elapsed();
+    if (status.alive)
+        return false;
+    status.alive = true;
+    return true;
+}
+
+bool ChunkServerMonitor::registerServer(int serverId, const QString& ip, quint16 port) {
+    quint16 server = ServerTable::instance().intern(ip, port);
+    if (server == ServerTable::NO_SERVER)
+        return false;
+    bool cameUp;
+    {
+        QWriteLocker locker(&m_lock);
+        cameUp = touch(m_servers[serverId], serverId, server);
+    }
+    if (cameUp) {
+        qInfo() << "Chunk server" << serverId << "up at" << ip << ":" << port;
+        emit serverUp(serverId);
+    }
+    return true;
+}
+
+bool ChunkServerMonitor::heartbeat(const ChunkServerStatus& report, const QString& ip, quint16 port) {
+    quint16 server = ServerTable::instance().intern(ip, port);
+    if (server == ServerTable::NO_SERVER)
+        return false;
+    bool cameUp;
+    {
+        QWriteLocker locker(&m_lock);
+        ChunkServerStatus& status = m_servers[report.serverId];
+        cameUp = touch(status, report.serverId, server);
+        status.capacityBytes = report.capacityBytes;
+        status.freeBytes = report.freeBytes;
+        status.queueDepth = report.queueDepth;
+        status.storeRate = report.storeRate;
+        status.retrieveRate = report.retrieveRate;
+        m_assigned.remove(report.serverId);
+    }
+    if (cameUp) {
+        qInfo() << "Chunk server" << report.serverId << "up at" << ip << ":" << port;
+        emit serverUp(report.serverId);
+    }
+    return true;
+}
+
+bool ChunkServerMonitor::status(int serverId, ChunkServerStatus* out) const {
+    QReadLocker locker(&m_lock);
+    auto it = m_servers.constFind(serverId);
+    if (it == m_servers.constEnd())
+        return false;
+    if (out)
+        *out = it.value();
+    return true;
+}
+
+bool ChunkServerMonitor::isAlive(int serverId) const {
+    QReadLocker locker(&m_lock);
+    auto it = m_servers.constFind(serverId);
+    return it != m_servers.constEnd() && it->alive;
+}
+
+QList<ChunkServerStatus> ChunkServerMonitor::servers() const {
+    QReadLocker locker(&m_lock);
+    return m_servers.values();
+}
+
+double ChunkServerMonitor::load(int serverId) const {
+    QReadLocker locker(&m_lock);
+    double load = m_assigned.value(serverId);
+    auto it = m_servers.constFind(serverId);
+    if (it != m_servers.constEnd())
+        load += it->queueDepth + it->storeRate;
+    return load;
+}
+
+void ChunkServerMonitor::noteAssigned(int serverId) {
+    QWriteLocker locker(&m_lock);
+    ++m_assigned[serverId];
+}
+
+void ChunkServerMonitor::checkLiveness() {
+    QList<int> down;
+    {
+        QWriteLocker locker(&m_lock);
+        qint64 now = m_clock.elapsed();
+        for (auto it = m_servers.begin(); it != m_servers.end(); ++it) {
+            ChunkServerStatus& status = it.value();
+            if (status.alive && now - status.lastHeartbeat > HEARTBEAT_TIMEOUT_MS) {
+                status.alive = false;
+                qWarning() << "Chunk server" << status.serverId << "missed heartbeats for"
+                           << now - status.lastHeartbeat << "ms, marking down";
+                down.append(status.serverId);
+            }
+        }
+    }
+    for (int serverId : down)
+        emit serverDown(serverId);
+}
@@ -0,0 +1,71 @@
+#ifndef CHUNKSERVERMONITOR_H
+#define CHUNKSERVERMONITOR_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QReadWriteLock>
+#include <QTimer>
+
+#include "metadata.h"
+
+// last load report of one chunk server
+struct ChunkServerStatus {
+    int serverId = -1;
+    quint16 server = ServerTable::NO_SERVER; // index into ServerTable
+    qint64 capacityBytes = 0;
+    qint64 freeBytes = 0;
+    int queueDepth = 0;     // partially received STOREs
+    double storeRate = 0;   // chunks stored per second
+    double retrieveRate = 0; // chunks served per second
+    qint64 lastHeartbeat = 0;
+    bool alive = false;
+};
+
+// Tracks chunk servers from their REGISTER_CHUNK_SERVER and HEARTBEAT lines
+// and marks them down once heartbeats stop arriving. Safe to use from any
+// master worker thread; signals are emitted without the lock held.
+class ChunkServerMonitor : public QObject {
+    Q_OBJECT
+public:
+    explicit ChunkServerMonitor(QObject* parent = nullptr);
+
+    // both fail when the address does not fit in the ServerTable
+    bool registerServer(int serverId, const QString& ip, quint16 port);
+    bool heartbeat(const ChunkServerStatus& report, const QString& ip, quint16 port);
+
+    // copies the status into *out; false for a server that never registered
+    bool status(int serverId, ChunkServerStatus* out) const;
+    // false for servers that never registered: a master knows of no chunk
+    // server until it says hello
+    bool isAlive(int serverId) const;
+    QList<ChunkServerStatus> servers() const;
+
+    // placement load estimate: reported queue depth and store rate plus
+    // chunks placed on the server since its last heartbeat
+    double load(int serverId) const;
+    void noteAssigned(int serverId);
+
+signals:
+    void serverDown(int serverId);
+    void serverUp(int serverId);
+
+private slots:
+    void checkLiveness();
+
+private:
+    // returns true if the server was not alive before
+    bool touch(ChunkServerStatus& status, int serverId, quint16 server);
+
+    mutable QReadWriteLock m_lock;
+    QHash<int, ChunkServerStatus> m_servers;
+    QHash<int, int> m_assigned; // chunks placed since the last heartbeat
+    QElapsedTimer m_clock;
+    QTimer* m_checkTimer;
+
+    static constexpr int CHECK_INTERVAL_MS = 1000;
+    static constexpr int HEARTBEAT_TIMEOUT_MS = 5000;
+};
+
+#endif // CHUNKSERVERMONITOR_H
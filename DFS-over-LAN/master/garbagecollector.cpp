@@ -0,0 +1,117 @@
+#include "garbagecollector.h"
+
+#include <QDebug>
+
+GarbageCollector::GarbageCollector(MetadataStore& store, ChunkServerMonitor* monitor, QObject* parent)
+    : QObject(parent), m_store(store), m_monitor(monitor) {
+    m_clock.start();
+    m_timer = new QTimer(this);
+    m_timer->setInterval(TICK_MS);
+    connect(m_timer, &QTimer::timeout, this, &GarbageCollector::tick);
+}
+
+void GarbageCollector::collect(const FileMetadata& removed, const FileMetadata& replacement) {
+    int queued = 0;
+    for (int chunk = 0; chunk < removed.chunkCount(); ++chunk) {
+        for (int r = 0; r < removed.locationCount(chunk); ++r) {
+            quint16 server = removed.location(chunk, r);
+            bool kept = false;
+            if (chunk < replacement.chunkCount()) {
+                for (int k = 0; k < replacement.locationCount(chunk) && !kept; ++k)
+                    kept = replacement.location(chunk, k) == server;
+            }
+            if (kept)
+                continue;
+            m_pending[server].insert(removed.chunkId(chunk));
+            ++queued;
+        }
+    }
+    if (queued == 0)
+        return;
+    qDebug() << "Queued" << queued << "replicas of" << removed.fileName << "for deletion";
+    m_timer->start();
+}
+
+void GarbageCollector::collectOrphans(quint16 server, const QStringList& chunkIds) {
+    // a master without a single file has more likely lost its metadata than
+    // found every chunk to be garbage
+    if (chunkIds.isEmpty() || server == ServerTable::NO_SERVER || m_store.size() == 0)
+        return;
+    if (m_clock.elapsed() < ORPHAN_GRACE_MS) {
+        qDebug() << "Ignoring" << chunkIds.size() << "orphaned chunks reported during startup";
+        return;
+    }
+    QSet<QString>& pending = m_pending[server];
+    for (const QString& chunkId : chunkIds)
+        pending.insert(chunkId);
+    const ChunkServerInfo& info = ServerTable::instance().at(server);
+    qInfo() << "Found" << chunkIds.size() << "orphaned chunks on" << info.ip << ":" << info.port;
+    m_timer->start();
+}
+
+bool GarbageCollector::referenced(quint16 server, const QString& chunkId) const {
+    QString fileId;
+    int chunk = 0;
+    FileMetadata metadata;
+    if (!MetadataStore::splitChunkId(chunkId, fileId, chunk) || !m_store.lookup(fileId, metadata)
+        || chunk >= metadata.chunkCount())
+        return false;
+    for (int r = 0; r < metadata.locationCount(chunk); ++r) {
+        if (metadata.location(chunk, r) == server)
+            return true;
+    }
+    return false;
+}
+
+// chunks of servers that are down wait for them to come back, for up to
+// ABANDON_MS; after that the server's inventory reports them again
+void GarbageCollector::tick() {
+    qint64 now = m_clock.elapsed();
+    const QList<ChunkServerStatus> servers = m_monitor->servers();
+    QSet<quint16> alive;
+    for (const ChunkServerStatus& status : servers) {
+        if (status.alive)
+            alive.insert(status.server);
+    }
+    for (auto it = m_pending.begin(); it != m_pending.end();) {
+        if (alive.contains(it.key())) {
+            m_awaySince.remove(it.key());
+            ++it;
+            continue;
+        }
+        qint64 since = m_awaySince.value(it.key(), -1);
+        if (since < 0)
+            m_awaySince.insert(it.key(), now);
+        if (since < 0 || now - since < ABANDON_MS) {
+            ++it;
+            continue;
+        }
+        const ChunkServerInfo& info = ServerTable::instance().at(it.key());
+        qInfo() << "Dropped" << it->size() << "pending deletions for" << info.ip << ":" << info.port
+                << ", away for over" << ABANDON_MS / 60000 << "minutes";
+        m_awaySince.remove(it.key());
+        it = m_pending.erase(it);
+    }
+
+    for (const ChunkServerStatus& status : servers) {
+        if (!status.alive || status.server == ServerTable::NO_SERVER)
+            continue;
+        auto pending = m_pending.find(status.server);
+        if (pending == m_pending.end())
+            continue;
+        QStringList batch;
+        for (auto it = pending->begin(); it != pending->end() && batch.size() < BATCH_CHUNKS;) {
+            if (!referenced(status.server, *it))
+                batch.append(*it);
+            it = pending->erase(it);
+        }
+        if (pending->isEmpty())
+            m_pending.erase(pending);
+        if (!batch.isEmpty())
+            emit deleteChunks(status.serverId, batch);
+    }
+    if (m_pending.isEmpty()) {
+        m_awaySince.clear();
+        m_timer->stop();
+    }
+}
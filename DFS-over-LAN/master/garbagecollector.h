@@ -0,0 +1,63 @@
+#ifndef GARBAGECOLLECTOR_H
+#define GARBAGECOLLECTOR_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QTimer>
+
+#include "chunkservermonitor.h"
+#include "metadatastore.h"
+
+// Reclaims chunk replicas that no file refers to any more: those of deleted
+// files, those a re-allocation of a file ID no longer lists, and orphans a
+// chunk server's inventory holds but the master has no record of. Each is
+// queued under its server, and every tick up to BATCH_CHUNKS per live server
+// go out as one DELETE_CHUNKS line.
+//
+// Right before a batch is sent each chunk is checked against the metadata
+// again, so a replica the file was created anew with is kept. Nothing is
+// acknowledged: a batch lost with the connection leaves orphans that the
+// server's next inventory reports again. Orphans are only trusted from
+// ORPHAN_GRACE_MS after startup on, and a server that stays away for
+// ABANDON_MS loses its queue to that same inventory. Lives on the master's
+// main thread; calls from workers are posted to it.
+class GarbageCollector : public QObject {
+    Q_OBJECT
+public:
+    GarbageCollector(MetadataStore& store, ChunkServerMonitor* monitor, QObject* parent = nullptr);
+
+    // every replica of removed that replacement does not list for the same chunk
+    void collect(const FileMetadata& removed, const FileMetadata& replacement = FileMetadata());
+    // chunks in server's inventory that belong to no file; ignored during
+    // the startup grace period
+    void collectOrphans(quint16 server, const QStringList& chunkIds);
+
+signals:
+    void deleteChunks(int serverId, const QStringList& chunkIds);
+
+private slots:
+    void tick();
+
+private:
+    bool referenced(quint16 server, const QString& chunkId) const;
+
+    MetadataStore& m_store;
+    ChunkServerMonitor* m_monitor;
+    QTimer* m_timer;
+    QElapsedTimer m_clock;
+    QHash<quint16, QSet<QString>> m_pending; // server -> chunk IDs to delete there
+    QHash<quint16, qint64> m_awaySince; // server with a queue -> when it was first seen down
+
+    static constexpr int TICK_MS = 1000;
+    static constexpr int BATCH_CHUNKS = 512; // per server and tick
+    // longer than the chunk servers' inventory interval, so every server has
+    // reported once and anything a restarted master is missing shows first
+    static constexpr qint64 ORPHAN_GRACE_MS = 15 * 60 * 1000;
+    static constexpr qint64 ABANDON_MS = 60 * 60 * 1000;
+};
+
+#endif // GARBAGECOLLECTOR_H
@@ -0,0 +1,64 @@
+#include "leasetable.h"
+
+#include <algorithm>
+
+LeaseTable::LeaseTable(int durationMs) : m_durationMs(durationMs) {
+    m_clock.start();
+}
+
+void LeaseTable::grant(const QString& fileId, QObject* holder, QObject* context) {
+    qint64 expires = m_clock.elapsed() + m_durationMs + GRACE_MS;
+    Shard& shard = shardFor(fileId);
+    QMutexLocker locker(&shard.lock);
+    QList<Lease>& leases = shard.leases[fileId];
+    for (Lease& lease : leases) {
+        if (lease.holder == holder) {
+            lease.expires = expires;
+            return;
+        }
+    }
+    leases.append(Lease{holder, context, expires});
+}
+
+void LeaseTable::release(const QString& fileId, QObject* holder) {
+    Shard& shard = shardFor(fileId);
+    QMutexLocker locker(&shard.lock);
+    auto it = shard.leases.find(fileId);
+    if (it == shard.leases.end())
+        return;
+    it->erase(std::remove_if(it->begin(), it->end(), [holder](const Lease& lease) {
+        return !lease.holder || lease.holder == holder;
+    }), it->end());
+    if (it->isEmpty())
+        shard.leases.erase(it);
+}
+
+QList<LeaseTable::Lease> LeaseTable::revoke(const QString& fileId) {
+    qint64 now = m_clock.elapsed();
+    QList<Lease> live;
+    Shard& shard = shardFor(fileId);
+    QMutexLocker locker(&shard.lock);
+    const QList<Lease> leases = shard.leases.take(fileId);
+    for (const Lease& lease : leases) {
+        if (lease.holder && lease.expires > now)
+            live.append(lease);
+    }
+    return live;
+}
+
+void LeaseTable::expire() {
+    qint64 now = m_clock.elapsed();
+    for (Shard& shard : m_shards) {
+        QMutexLocker locker(&shard.lock);
+        for (auto it = shard.leases.begin(); it != shard.leases.end();) {
+            auto dead = std::remove_if(it->begin(), it->end(), [now](const Lease& lease) {
+                return !lease.holder || lease.expires <= now;
+            });
+            it->erase(dead, it->end());
+            if (it->isEmpty())
+                it = shard.leases.erase(it);
+            else
+                ++it;
+        }
+    }
+}
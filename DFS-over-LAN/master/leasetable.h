@@ -0,0 +1,57 @@
+#ifndef LEASETABLE_H
+#define LEASETABLE_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QPointer>
+#include <QString>
+#include <array>
+
+// Read leases on file metadata handed out with lookups. While its lease
+// runs a client may serve the file's metadata from its own cache; when the
+// chunk list changes the master revokes the outstanding leases and tells the
+// holders to drop their copy. Split into shards by file ID like
+// MetadataStore, so lookups on different files rarely contend.
+class LeaseTable {
+public:
+    // holder is the connection, context the object its messages are posted to
+    struct Lease {
+        QPointer<QObject> holder;
+        QObject* context = nullptr;
+        qint64 expires = 0;
+    };
+
+    explicit LeaseTable(int durationMs);
+
+    int durationMs() const { return m_durationMs; }
+    // grants or renews holder's lease on fileId
+    void grant(const QString& fileId, QObject* holder, QObject* context);
+    // drops holder's lease on fileId, e.g. once the file turns out not to exist
+    void release(const QString& fileId, QObject* holder);
+    // removes and returns the leases on fileId that may still be in use
+    QList<Lease> revoke(const QString& fileId);
+    // forgets leases that ran out or whose holder disconnected
+    void expire();
+
+private:
+    static constexpr int SHARD_COUNT = 16;
+    // the client starts its lease when the reply arrives, so the master
+    // keeps honouring it a little longer than it granted
+    static constexpr int GRACE_MS = 2000;
+
+    struct Shard {
+        QMutex lock;
+        QHash<QString, QList<Lease>> leases;
+    };
+
+    Shard& shardFor(const QString& fileId) { return m_shards[qHash(fileId) % SHARD_COUNT]; }
+
+    const int m_durationMs;
+    QElapsedTimer m_clock;
+    std::array<Shard, SHARD_COUNT> m_shards;
+};
+
+#endif // LEASETABLE_H
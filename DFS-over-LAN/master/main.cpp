@@ -2,6 +2,7 @@
 #include <QCommandLineParser>
 #include <QCoreApplication>
 #include <QDebug>
+#include <QThread>
 
 #include "MasterServer.h"
 
@@ -19,7 +20,42 @@ int main(int argc, char* argv[]) {
         "Port on which the master server will listen (default: 4000).",
         "port", "4000");
 
+    QCommandLineOption placementOption(QStringList() << "placement",
+        "Chunk placement policy: " + PlacementPolicy::names().join(", ") + " (default: round-robin).",
+        "policy", "round-robin");
+
+    QCommandLineOption threadsOption(QStringList() << "t" << "threads",
+        "Worker threads serving client connections (default: one per core).",
+        "count", QString::number(QThread::idealThreadCount()));
+
+    QCommandLineOption minChunkOption(QStringList() << "min-chunk-size",
+        QString("Smallest chunk size a file may be allocated with, in bytes (default: %1).").arg(MIN_CHUNK_SIZE),
+        "bytes", QString::number(MIN_CHUNK_SIZE));
+
+    QCommandLineOption maxChunkOption(QStringList() << "max-chunk-size",
+        QString("Largest chunk size a file may be allocated with, in bytes (default: %1).").arg(MAX_CHUNK_SIZE),
+        "bytes", QString::number(MAX_CHUNK_SIZE));
+
+    QCommandLineOption topologyOption(QStringList() << "topology",
+        "File assigning chunk servers and client subnets to failure domains (default: the built-in server tree).",
+        "file");
+
+    QCommandLineOption rebalanceOption(QStringList() << "rebalance-bandwidth",
+        "Bytes per second the master may spend moving chunks to even out disk use, 0 to disable (default: 1048576).",
+        "bytes", "1048576");
+
+    QCommandLineOption repairOption(QStringList() << "repair-bandwidth",
+        "Bytes per second the master may spend re-replicating chunks of lost chunk servers, 0 to disable (default: 8388608).",
+        "bytes", "8388608");
+
     parser.addOption(portOption);
+    parser.addOption(placementOption);
+    parser.addOption(threadsOption);
+    parser.addOption(minChunkOption);
+    parser.addOption(maxChunkOption);
+    parser.addOption(topologyOption);
+    parser.addOption(rebalanceOption);
+    parser.addOption(repairOption);
 
     parser.process(app);
 
@@ -30,7 +66,41 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
+    int threads = parser.value(threadsOption).toInt(&ok);
+    if (!ok || threads < 1) {
+        qCritical() << "Invalid worker thread count provided.";
+        return 1;
+    }
+
     MasterServer server;
+    server.startWorkers(threads);
+    if (!server.setChunkSizeRange(parser.value(minChunkOption).toInt(), parser.value(maxChunkOption).toInt())) {
+        qCritical() << "Chunk size range must lie within" << MIN_CHUNK_SIZE << "and" << MAX_CHUNK_SIZE << "bytes";
+        return 1;
+    }
+    if (parser.isSet(topologyOption) && !server.loadTopology(parser.value(topologyOption))) {
+        qCritical() << "Invalid topology file" << parser.value(topologyOption);
+        return 1;
+    }
+    qint64 rebalanceBandwidth = parser.value(rebalanceOption).toLongLong(&ok);
+    if (!ok || rebalanceBandwidth < 0) {
+        qCritical() << "Invalid rebalance bandwidth provided.";
+        return 1;
+    }
+    server.setRebalanceBandwidth(rebalanceBandwidth);
+    qint64 repairBandwidth = parser.value(repairOption).toLongLong(&ok);
+    if (!ok || repairBandwidth < 0) {
+        qCritical() << "Invalid repair bandwidth provided.";
+        return 1;
+    }
+    server.setRepairBandwidth(repairBandwidth);
+    if (!server.setPlacementPolicy(parser.value(placementOption))) {
+        qCritical() << "Unknown placement policy" << parser.value(placementOption);
+        return 1;
+    }
+    if (parser.isSet(topologyOption) && parser.value(placementOption) == "consistent-hash")
+        qWarning() << "consistent-hash places replicas on the ring's owners whatever the topology;"
+                   << "it only orders reads and repairs";
     if (!server.startListening(QHostAddress::Any, port)) {
         qCritical() << "Failed to start master server on port" << port;
         return 1;
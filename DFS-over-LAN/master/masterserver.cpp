@@ -1,9 +1,13 @@
 #include "masterserver.h"
 
-#include <QFile>
-#include <QJsonDocument>
-#include <QRandomGenerator>
+#include <QDataStream>
+#include <QPointer>
 #include <QCoreApplication>
+#include <QSharedPointer>
+#include <QTimer>
+#include <algorithm>
+#include <climits>
+#include <tuple>
 
 MasterServer* MasterServer::s_instance = nullptr;
 
@@ -12,59 +16,58 @@ MasterServer::MasterServer(QObject* parent) : QTcpServer(parent) {
     buildBinaryTree();
     computeDFS(0);
     dfsComputed = true;
+    m_topology.setTree(chunkServerTree, CHUNK_SERVER_BASE_PORT);
     qDebug() << "Master server DFS order:" << dfsOrder;
 
-    connect(this, &QTcpServer::newConnection, this, &MasterServer::onNewConnection);
-
     signal(SIGINT, &MasterServer::handleSigInt);
 
-    QFile logFile("master_log.json");
-    if (logFile.open(QIODevice::ReadOnly)) {
-        QByteArray data = logFile.readAll();
-        QJsonDocument doc = QJsonDocument::fromJson(data);
-        if (doc.isObject()) {
-            QJsonObject root = doc.object();
-            for (auto it = root.begin(); it != root.end(); ++it) {
-                if (it.value().isObject()) {
-                    FileMetadata meta = FileMetadata::fromJson(it.value().toObject());
-                    fileMetadata[it.key()] = meta;
-                }
-            }
-            qDebug() << "Loaded" << fileMetadata.size() << "file metadata from log";
-        }
-        else {
-            qWarning() << "Invalid JSON in log file";
-        }
-    }
-    else {
-        qDebug() << "No log file found, starting with empty metadata";
-    }
-}
+    m_journal = new MetadataJournal(fileMetadata, this);
+    m_journal->recover();
 
-MasterServer::~MasterServer() {
-    saveLog();
+    m_monitor = new ChunkServerMonitor(this);
+
+    m_rebalancer = new Rebalancer(fileMetadata, m_journal, m_monitor, m_topology, this);
+    connect(m_rebalancer, &Rebalancer::replicate, this, [this](int serverId, const QString& chunkId, quint16 target) {
+        const ChunkServerInfo& to = ServerTable::instance().at(target);
+        sendToServer(serverId, "REPLICATE " + chunkId.toUtf8() + " " + to.ip.toUtf8() + " " + QByteArray::number(to.port));
+    });
+    connect(m_rebalancer, &Rebalancer::removeReplica, this, [this](int serverId, const QString& chunkId) {
+        sendToServer(serverId, "DELETE_CHUNK " + chunkId.toUtf8());
+    });
+    connect(m_rebalancer, &Rebalancer::locationsChanged, this, &MasterServer::invalidateLeases);
+    connect(m_monitor, &ChunkServerMonitor::serverDown, m_rebalancer, &Rebalancer::serverDown);
+    connect(m_monitor, &ChunkServerMonitor::serverUp, m_rebalancer, &Rebalancer::serverUp);
+    connect(m_monitor, &ChunkServerMonitor::serverDown, this, &MasterServer::broadcastRing);
+    connect(m_monitor, &ChunkServerMonitor::serverUp, this, &MasterServer::broadcastRing);
+
+    m_collector = new GarbageCollector(fileMetadata, m_monitor, this);
+    connect(m_collector, &GarbageCollector::deleteChunks, this, [this](int serverId, const QStringList& chunkIds) {
+        sendToServer(serverId, "DELETE_CHUNKS " + chunkIds.join(' ').toUtf8());
+    });
+
+    QTimer* leaseSweep = new QTimer(this);
+    connect(leaseSweep, &QTimer::timeout, this, [this]() { m_leases.expire(); });
+    leaseSweep->start(LEASE_MS);
+    m_placement = PlacementPolicy::create("round-robin");
 }
 
-void MasterServer::saveLog() {
-    QJsonObject root;
-    for (auto it = fileMetadata.begin(); it != fileMetadata.end(); ++it) {
-        root[it.key()] = it.value().toJson();
-    }
-    QJsonDocument doc(root);
-    QFile logFile("master_log.json");
-    if (logFile.open(QIODevice::WriteOnly)) {
-        logFile.write(doc.toJson());
-        qDebug() << "Saved file metadata to log";
-    }
-    else {
-        qWarning() << "Could not open log file for writing";
+MasterServer::~MasterServer() {
+    close();
+    for (int i = 0; i < m_threads.size(); ++i) {
+        // connections are children of the worker and go with it
+        QObject* worker = m_workers[i];
+        QMetaObject::invokeMethod(worker, [worker]() { delete worker; }, Qt::BlockingQueuedConnection);
+        m_threads[i]->quit();
+        m_threads[i]->wait();
     }
+    // every acknowledged mutation is already in the WAL; only the tail needs flushing
+    m_journal->sync();
 }
 
 void MasterServer::handleSigInt(int sig) {
     Q_UNUSED(sig);
     if (s_instance)
-        qDebug() << "Received SIGINT, saving log and exiting...";
+        qDebug() << "Received SIGINT, flushing journal and exiting...";
     QCoreApplication::quit();
 }
 
@@ -88,6 +91,8 @@ void MasterServer::computeDFS(int node) {
 }
 
 bool MasterServer::startListening(const QHostAddress& address, quint16 port) {
+    if (m_workers.isEmpty())
+        startWorkers(QThread::idealThreadCount());
     if (!listen(address, port)) {
         qCritical() << "Failed to start server:" << errorString();
         return false;
@@ -96,149 +101,934 @@ bool MasterServer::startListening(const QHostAddress& address, quint16 port) {
     return true;
 }
 
-void MasterServer::onNewConnection() {
-    while (hasPendingConnections()) {
-        QTcpSocket* client = nextPendingConnection();
-        m_clients.insert(client);
-        connect(client, &QTcpSocket::readyRead, this, &MasterServer::onReadyRead);
-        connect(client, &QTcpSocket::disconnected, this, &MasterServer::onDisconnected);
-        qDebug() << "New client connected:" << client->peerAddress().toString();
+// One event loop per thread, each owning the connections handed to it. The
+// state they share (metadata shards, journal, monitor) locks internally.
+void MasterServer::startWorkers(int count) {
+    count = qMax(1, count);
+    for (int i = 0; i < count; ++i) {
+        QThread* thread = new QThread(this);
+        thread->setObjectName(QString("master-worker-%1").arg(i));
+        QObject* worker = new QObject;
+        worker->moveToThread(thread);
+        m_threads.append(thread);
+        m_workers.append(worker);
+        thread->start();
     }
+    qInfo() << "Master serving clients on" << count << "worker threads";
 }
 
-void MasterServer::onReadyRead() {
-    QTcpSocket* client = qobject_cast<QTcpSocket*>(sender());
-    if (!client)
-        return;
+bool MasterServer::setPlacementPolicy(const QString& name) {
+    std::unique_ptr<PlacementPolicy> policy = PlacementPolicy::create(name);
+    if (!policy)
+        return false;
+    m_placement = std::move(policy);
+    qInfo() << "Chunk placement policy:" << m_placement->name();
+    return true;
+}
+
+bool MasterServer::loadTopology(const QString& path) {
+    return m_topology.load(path);
+}
 
-    while (client->canReadLine()) {
+void MasterServer::setRebalanceBandwidth(qint64 bytesPerSecond) {
+    m_rebalancer->setBandwidth(bytesPerSecond);
+    if (bytesPerSecond > 0)
+        qInfo() << "Rebalancing chunks at up to" << bytesPerSecond << "bytes/s";
+}
+
+void MasterServer::setRepairBandwidth(qint64 bytesPerSecond) {
+    m_rebalancer->setRepairBandwidth(bytesPerSecond);
+    if (bytesPerSecond > 0)
+        qInfo() << "Re-replicating lost chunks at up to" << bytesPerSecond << "bytes/s";
+}
+
+// Posts a line to a chunk server's connection on its worker thread; false if
+// the server has no connection to the master.
+bool MasterServer::sendToServer(int serverId, const QByteArray& line) {
+    QMutexLocker locker(&m_serverLinksLock);
+    auto it = m_serverLinks.constFind(serverId);
+    if (it == m_serverLinks.constEnd() || !it->worker)
+        return false;
+    QPointer<ClientConnection> connection = it->connection;
+    QMetaObject::invokeMethod(it->worker, [this, connection, line]() {
+        if (connection)
+            sendText(connection, line);
+    });
+    return true;
+}
+
+// Runs on the accepting thread: hand the descriptor to the next worker, which
+// creates the socket there so all of its I/O and request handling stays on it.
+void MasterServer::incomingConnection(qintptr socketDescriptor) {
+    QObject* worker = m_workers[m_nextWorker++ % m_workers.size()];
+    QMetaObject::invokeMethod(worker, [this, worker, socketDescriptor]() {
+        ClientConnection* client = new ClientConnection(worker);
+        if (!client->setSocketDescriptor(socketDescriptor)) {
+            qWarning() << "Could not adopt client socket:" << client->errorString();
+            delete client;
+            return;
+        }
+        connect(client, &QTcpSocket::readyRead, client, [this, client]() { onReadyRead(client); });
+        connect(client, &QTcpSocket::disconnected, client, [this, client]() { onDisconnected(client); });
+        connect(client, &QTcpSocket::bytesWritten, client, [this, client]() { pumpMetadata(client); });
+        qDebug() << "New client connected:" << client->peerAddress().toString()
+                 << "on" << QThread::currentThread()->objectName();
+    });
+}
+
+void MasterServer::onReadyRead(ClientConnection* client) {
+    while (client->state() == QAbstractSocket::ConnectedState) {
+        if (client->binary) {
+            client->buffer += client->readAll();
+            quint8 opcode;
+            QByteArray body;
+            bool malformed = false;
+            while (MasterProtocol::takeFrame(client->buffer, opcode, body, malformed))
+                handleFrame(client, opcode, body);
+            if (malformed) {
+                qWarning() << "Malformed frame from" << client->peerAddress().toString();
+                client->disconnectFromHost();
+            }
+            return;
+        }
+
+        if (!client->canReadLine())
+            return;
         QByteArray data = client->readLine().trimmed();
-        qDebug() << "Received data from client:" << data;
+        // every chunk server heartbeats once a second
+        if (!data.startsWith("HEARTBEAT "))
+            qDebug() << "Received data from client:" << data;
         handleRequest(client, data);
     }
 }
 
-void MasterServer::onDisconnected() {
-    QTcpSocket* client = qobject_cast<QTcpSocket*>(sender());
-    if (!client)
-        return;
-
-    m_clients.remove(client);
+void MasterServer::onDisconnected(ClientConnection* client) {
     qDebug() << "Client disconnected:" << client->peerAddress().toString();
     client->deleteLater();
 }
 
-void MasterServer::handleRequest(QTcpSocket* client, const QByteArray& data) {
+void MasterServer::handleRequest(ClientConnection* client, const QByteArray& data) {
     QList<QByteArray> parts = data.split(' ');
     if (parts.isEmpty()) {
-        client->write("Empty command?\n");
+        sendText(client, "Empty command?");
         return;
     }
 
     QString command = QString::fromUtf8(parts[0]).toUpper();
 
     if (command == "PING") { // just because it's fun
-        client->write("PONG\n");
+        sendText(client, "PONG");
         return;
     }
 
-    if (command == "ALLOCATE_CHUNKS" && parts.size() >= 3) {
-        // fileId, size
+    if (command == "HELLO") {
+        handleHello(client, parts);
+    }
+    else if (command == "ALLOCATE_CHUNKS" && parts.size() >= 3) {
+        // fileId, size [, replication [, chunkSize]]
         QString fileId = QString::fromUtf8(parts[1]);
         qint64 size = parts[2].toLongLong();
-        allocateChunks(client, fileId, size);
+        int replication = parts.size() >= 4 ? parts[3].toInt() : DEFAULT_REPLICATION;
+        int chunkSize = parts.size() >= 5 ? parts[4].toInt() : 0;
+        allocateChunks(client, fileId, size, replication, chunkSize);
+    }
+    else if (command == "REGISTER_CHUNK_SERVER" && parts.size() >= 4) {
+        // serverId, ip, port
+        if (!m_monitor->registerServer(parts[1].toInt(), QString::fromUtf8(parts[2]), parts[3].toUShort())) {
+            sendText(client, "ERROR Too many chunk server addresses");
+            return;
+        }
+        {
+            QMutexLocker locker(&m_serverLinksLock);
+            m_serverLinks.insert(parts[1].toInt(), ServerLink{client, client->parent()});
+        }
+        sendText(client, "OK Registered");
+    }
+    else if (command == "HEARTBEAT" && parts.size() >= 9) {
+        handleHeartbeat(client, parts);
     }
     else if (command == "LOOKUP_FILE" && parts.size() >= 2) {
         // fileId
         QString fileId = QString::fromUtf8(parts[1]);
         lookupFile(client, fileId);
     }
-    // TODO: register chunk replica
-    // else if (command == "REGISTER_CHUNK_REPLICA" && parts.size() >= 4) {
-    //     QString chunkId = QString::fromUtf8(parts[1]);
-    //     QString addr = QString::fromUtf8(parts[2]);
-    //     quint16 port = parts[3].toUShort();
-    //     registerChunkReplica(chunkId, addr, port);
-    // }
+    else if (command == "LOOKUP_RANGE" && parts.size() >= 4) {
+        // fileId, offset, length
+        lookupRange(client, QString::fromUtf8(parts[1]), parts[2].toLongLong(), parts[3].toLongLong());
+    }
+    else if (command == "LOOKUP_FILES" && parts.size() >= 2) {
+        // fileId...
+        QStringList fileIds;
+        fileIds.reserve(parts.size() - 1);
+        for (int i = 1; i < parts.size(); ++i)
+            fileIds.append(QString::fromUtf8(parts[i]));
+        lookupFiles(client, fileIds);
+    }
+    else if (command == "REGISTER_CHUNK_REPLICA" && parts.size() >= 4) {
+        // chunkId, addr, port
+        QString chunkId = QString::fromUtf8(parts[1]);
+        QString addr = QString::fromUtf8(parts[2]);
+        quint16 port = parts[3].toUShort();
+        registerChunkReplicas(client, addr, port, {chunkId});
+    }
+    else if (command == "REGISTER_CHUNK_REPLICAS" && parts.size() >= 4) {
+        // addr, port, chunkId[:length]... : a chunk server's inventory
+        QStringList chunkIds;
+        QVector<qint64> lengths;
+        chunkIds.reserve(parts.size() - 3);
+        lengths.reserve(parts.size() - 3);
+        for (int i = 3; i < parts.size(); ++i) {
+            // chunk IDs end in "_chunk_<i>", so a number after the last ':' is the length
+            qsizetype colon = parts[i].lastIndexOf(':');
+            bool ok = false;
+            qint64 length = colon > 0 ? parts[i].mid(colon + 1).toLongLong(&ok) : -1;
+            chunkIds.append(QString::fromUtf8(ok ? parts[i].left(colon) : parts[i]));
+            lengths.append(ok ? length : -1);
+        }
+        registerChunkReplicas(client, QString::fromUtf8(parts[1]), parts[2].toUShort(), chunkIds, lengths);
+    }
+    else if (command == "REPLICATED" && parts.size() >= 5) {
+        // chunkId, ip, port, ok : a copy the rebalancer asked a chunk server for
+        QString chunkId = QString::fromUtf8(parts[1]);
+        quint16 target = ServerTable::instance().intern(QString::fromUtf8(parts[2]), parts[3].toUShort());
+        if (target == ServerTable::NO_SERVER) {
+            sendText(client, "ERROR Too many chunk server addresses");
+            return;
+        }
+        bool ok = parts[4].toInt() == 1;
+        QMetaObject::invokeMethod(m_rebalancer, [this, chunkId, target, ok]() { m_rebalancer->copyFinished(chunkId, target, ok); });
+    }
+    else if (command == "RING") {
+        subscribeRing(client);
+        describeRing(client);
+    }
+    else if (command == "MKDIR" && parts.size() >= 2) {
+        // path
+        makeDirectory(client, QString::fromUtf8(parts[1]));
+    }
+    else if (command == "DELETE_FILE" && parts.size() >= 2) {
+        // fileId
+        deleteFile(client, QString::fromUtf8(parts[1]));
+    }
+    else if ((command == "LIST" || command == "LIST_RECURSIVE") && parts.size() >= 2) {
+        // path [, limit [, cursor]]
+        int limit = parts.size() >= 3 ? parts[2].toInt() : DEFAULT_LIST_LIMIT;
+        QString cursor = parts.size() >= 4 ? QString::fromUtf8(parts[3]) : QString();
+        listDirectory(client, QString::fromUtf8(parts[1]), limit, cursor, command == "LIST_RECURSIVE");
+    }
     else {
         qWarning() << "Unknown command (" << command << ") or invalid arguments (" << parts.size() << ")";
-        client->write("ERROR Unknown command or invalid arguments\n");
+        sendText(client, "ERROR Unknown command or invalid arguments");
+    }
+}
+
+// HELLO BIN <version> switches the connection to binary framing after the
+// reply; HELLO TEXT keeps the line protocol
+void MasterServer::handleHello(ClientConnection* client, const QList<QByteArray>& parts) {
+    QByteArray mode = parts.size() >= 2 ? parts[1].toUpper() : QByteArray("TEXT");
+    if (mode == "TEXT") {
+        sendText(client, "OK HELLO TEXT");
+        return;
+    }
+    if (mode == "BIN" && parts.size() >= 3 && parts[2].toInt() == MasterProtocol::VERSION) {
+        if (!client->binary) {
+            sendText(client, "OK HELLO BIN " + QByteArray::number(MasterProtocol::VERSION));
+            client->binary = true;
+        }
+        return;
+    }
+    sendText(client, "ERROR Unsupported protocol");
+}
+
+// HEARTBEAT <serverId> <ip> <port> <capacity> <free> <queueDepth> <storesPerSec> <retrievesPerSec>
+// Sent every second by each chunk server; no reply unless it is refused, so
+// heartbeats never queue behind client traffic on the chunk server side.
+void MasterServer::handleHeartbeat(ClientConnection* client, const QList<QByteArray>& parts) {
+    ChunkServerStatus report;
+    report.serverId = parts[1].toInt();
+    report.capacityBytes = parts[4].toLongLong();
+    report.freeBytes = parts[5].toLongLong();
+    report.queueDepth = parts[6].toInt();
+    report.storeRate = parts[7].toDouble();
+    report.retrieveRate = parts[8].toDouble();
+    if (!m_monitor->heartbeat(report, QString::fromUtf8(parts[2]), parts[3].toUShort()))
+        sendText(client, "ERROR Too many chunk server addresses");
+}
+
+void MasterServer::handleFrame(ClientConnection* client, quint8 opcode, const QByteArray& body) {
+    QDataStream in(body);
+    switch (opcode) {
+    case MasterProtocol::OP_TEXT:
+        handleRequest(client, body.trimmed());
+        break;
+    case MasterProtocol::OP_ALLOCATE: {
+        QByteArray fileId;
+        qint64 size = 0;
+        quint8 replication = DEFAULT_REPLICATION;
+        quint32 chunkSize = 0;
+        in >> fileId >> size;
+        if (!in.atEnd())
+            in >> replication;
+        if (!in.atEnd())
+            in >> chunkSize;
+        if (in.status() != QDataStream::Ok || fileId.isEmpty() || chunkSize > quint32(MAX_CHUNK_SIZE))
+            sendText(client, "ERROR Malformed ALLOCATE frame");
+        else
+            allocateChunks(client, QString::fromUtf8(fileId), size, replication, int(chunkSize));
+        break;
+    }
+    case MasterProtocol::OP_LOOKUP: {
+        QByteArray fileId;
+        in >> fileId;
+        if (in.status() != QDataStream::Ok || fileId.isEmpty())
+            sendText(client, "ERROR Malformed LOOKUP frame");
+        else
+            lookupFile(client, QString::fromUtf8(fileId));
+        break;
+    }
+    case MasterProtocol::OP_LOOKUP_RANGE: {
+        QByteArray fileId;
+        qint64 offset = 0;
+        qint64 length = 0;
+        in >> fileId >> offset >> length;
+        if (in.status() != QDataStream::Ok || fileId.isEmpty())
+            sendText(client, "ERROR Malformed LOOKUP_RANGE frame");
+        else
+            lookupRange(client, QString::fromUtf8(fileId), offset, length);
+        break;
+    }
+    case MasterProtocol::OP_LOOKUP_BATCH: {
+        quint32 count = 0;
+        in >> count;
+        QStringList fileIds;
+        for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i) {
+            QByteArray fileId;
+            in >> fileId;
+            fileIds.append(QString::fromUtf8(fileId));
+        }
+        if (in.status() != QDataStream::Ok || fileIds.isEmpty())
+            sendText(client, "ERROR Malformed LOOKUP_BATCH frame");
+        else
+            lookupFiles(client, fileIds);
+        break;
+    }
+    default:
+        qWarning() << "Unknown opcode" << opcode;
+        sendText(client, "ERROR Unknown opcode");
+    }
+}
+
+void MasterServer::sendText(ClientConnection* client, const QByteArray& line) {
+    if (client->binary)
+        writeReply(client, MasterProtocol::encodeFrame(MasterProtocol::OP_TEXT, line));
+    else
+        writeReply(client, line + "\n");
+}
+
+// Every reply goes through here: while a metadata response is still being
+// paged out, later replies queue behind it so the client sees them in
+// request order.
+void MasterServer::writeReply(ClientConnection* client, const QByteArray& message) {
+    if (client->streams.isEmpty()) {
+        client->write(message);
+        return;
+    }
+    MetadataStream queued;
+    queued.message = message;
+    client->streams.enqueue(queued);
+}
+
+// Uploads keep the chain order of the allocation; for reads the replicas
+// nearest the client come first.
+void MasterServer::sendMetadata(ClientConnection* client, MasterProtocol::MetadataKind kind, const FileMetadata& metadata,
+                                int first, int end) {
+    if (end < 0)
+        end = metadata.chunkCount();
+
+    if (kind != MasterProtocol::KIND_ALLOCATED) {
+        QStringList location = clientLocation(client);
+        if (!location.isEmpty()) {
+            FileMetadata nearest = metadata;
+            sortByProximity(location, nearest, first, end);
+            sendSortedMetadata(client, kind, nearest, first, end);
+            return;
+        }
+    }
+    sendSortedMetadata(client, kind, metadata, first, end);
+}
+
+// Small responses go out as one message. Larger ones are queued and paged
+// out PAGE_CHUNKS at a time as METADATA_PAGE messages, only while the
+// socket has less than STREAM_HIGH_WATER unsent, so a huge file never
+// needs its whole reply in memory and the client can start on page one.
+void MasterServer::sendSortedMetadata(ClientConnection* client, MasterProtocol::MetadataKind kind,
+                                      const FileMetadata& metadata, int first, int end) {
+    if (end - first > PAGE_CHUNKS || !client->streams.isEmpty()) {
+        client->streams.enqueue(MetadataStream{kind, metadata, first, first, end});
+        pumpMetadata(client);
+        return;
+    }
+
+    if (client->binary) {
+        writeReply(client, MasterProtocol::encodeFrame(MasterProtocol::OP_METADATA, encodeMetadata(kind, metadata, first, end)));
+        return;
+    }
+
+    QString response;
+    QString chunkSize = QString::number(metadata.chunkSize);
+    if (kind == MasterProtocol::KIND_ALLOCATED)
+        response = "OK Allocated " + QString::number(end - first) + " " + chunkSize;
+    else if (kind == MasterProtocol::KIND_RANGE)
+        response = "RANGE_METADATA " + metadata.fileName + " " + QString::number(metadata.size) + " " + chunkSize + " " + QString::number(first);
+    else
+        response = "FILE_METADATA " + metadata.fileName + " " + QString::number(metadata.size) + " " + chunkSize;
+    response += getMetadataString(metadata, first, end);
+    sendText(client, response.toUtf8());
+}
+
+// text pages are "METADATA_PAGE <kind> <first> <count> <fileId> <size> <chunkSize> <chunks...>",
+// where first and count describe the whole response, not the page
+void MasterServer::pumpMetadata(ClientConnection* client) {
+    while (!client->streams.isEmpty() && client->bytesToWrite() < STREAM_HIGH_WATER) {
+        MetadataStream& stream = client->streams.head();
+        if (!stream.message.isEmpty()) {
+            client->write(stream.message);
+            client->streams.dequeue();
+            continue;
+        }
+        int pageEnd = qMin(stream.next + PAGE_CHUNKS, stream.end);
+        if (client->binary) {
+            QByteArray body;
+            QDataStream out(&body, QIODevice::WriteOnly);
+            out << quint32(stream.first) << quint32(stream.end - stream.first);
+            body += encodeMetadata(stream.kind, stream.metadata, stream.next, pageEnd);
+            client->write(MasterProtocol::encodeFrame(MasterProtocol::OP_METADATA_PAGE, body));
+        }
+        else {
+            QString page = QString("METADATA_PAGE %1 %2 %3 %4 %5 %6")
+                               .arg(int(stream.kind)).arg(stream.first).arg(stream.end - stream.first)
+                               .arg(stream.metadata.fileName).arg(stream.metadata.size).arg(stream.metadata.chunkSize);
+            page += getMetadataString(stream.metadata, stream.next, pageEnd);
+            client->write(page.toUtf8() + "\n");
+        }
+
+        stream.next = pageEnd;
+        if (stream.next >= stream.end)
+            client->streams.dequeue();
+    }
+}
+
+QByteArray MasterServer::encodeMetadata(MasterProtocol::MetadataKind kind, const FileMetadata& metadata, int first, int end) {
+    if (end < 0)
+        end = metadata.chunkCount();
+    QByteArray body;
+    QDataStream out(&body, QIODevice::WriteOnly);
+    const ServerTable& servers = ServerTable::instance();
+    out << quint8(kind) << metadata.fileName.toUtf8() << metadata.size << quint32(metadata.chunkSize)
+        << quint32(end - first);
+    for (int i = first; i < end; ++i) {
+        int count = metadata.locationCount(i);
+        out << quint32(i) << quint8(count);
+        for (int r = 0; r < count; ++r) {
+            const ChunkServerInfo& loc = servers.at(metadata.location(i, r));
+            out << loc.ipv4 << loc.port;
+        }
     }
+    return body;
 }
 
-void MasterServer::allocateChunks(QTcpSocket* client, const QString& fileId, qint64 size) {
-    qDebug() << "Allocating" << size << "bytes for file" << fileId;
+// Smallest power of two from DEFAULT_CHUNK_SIZE up that keeps the file within
+// TARGET_CHUNKS_PER_FILE chunks, inside the configured range: small files
+// keep small chunks, large ones stop costing a record per 8 KB.
+int MasterServer::chooseChunkSize(qint64 size) const {
+    qint64 chunkSize = DEFAULT_CHUNK_SIZE;
+    while (chunkSize < m_maxChunkSize && (size + chunkSize - 1) / chunkSize > TARGET_CHUNKS_PER_FILE)
+        chunkSize *= 2;
+    return int(qBound<qint64>(m_minChunkSize, chunkSize, m_maxChunkSize));
+}
+
+bool MasterServer::setChunkSizeRange(int minimum, int maximum) {
+    if (minimum < MIN_CHUNK_SIZE || maximum > MAX_CHUNK_SIZE || minimum > maximum)
+        return false;
+    m_minChunkSize = minimum;
+    m_maxChunkSize = maximum;
+    return true;
+}
+
+// chunkSize 0 lets the master choose
+void MasterServer::allocateChunks(ClientConnection* client, const QString& fileId, qint64 size, int replication,
+                                  int chunkSize) {
+    qDebug() << "Allocating" << size << "bytes for file" << fileId << "with" << replication << "replicas";
     if (!dfsComputed) {
-        client->write("ERROR Server topology not initialized\n");
+        sendText(client, "ERROR Server topology not initialized");
+        return;
+    }
+    if (journalFailing(client))
+        return;
+    // "/a//b" and "a/b" are one entry in the directory tree, so only one
+    // spelling may name a stored file
+    if (fileId.isEmpty() || fileId != NamespaceTree::canonical(fileId)) {
+        sendText(client, "ERROR File ID must be non-empty with no leading, trailing or repeated '/'");
+        return;
+    }
+    if (replication < 1 || replication > MAX_REPLICATION) {
+        sendText(client, "ERROR Replication factor must be between 1 and " + QByteArray::number(MAX_REPLICATION));
         return;
     }
 
-    int numChunks = int((size + CHUNK_SIZE - 1) / CHUNK_SIZE); // round up
+    if (chunkSize == 0)
+        chunkSize = chooseChunkSize(size);
+    else if (chunkSize < m_minChunkSize || chunkSize > m_maxChunkSize) {
+        sendText(client, "ERROR Chunk size must be between " + QByteArray::number(m_minChunkSize) + " and "
+                             + QByteArray::number(m_maxChunkSize));
+        return;
+    }
 
-    int startIdx = QRandomGenerator::global()->bounded(dfsOrder.size());
+    int numChunks = int((size + chunkSize - 1) / chunkSize); // round up
 
     FileMetadata metadata;
     metadata.fileName = fileId;
+    metadata.size = size;
+    metadata.chunkSize = chunkSize;
+    metadata.resize(numChunks, replication);
+
+    QVector<HashRing::Member> members;
+    QVector<int> candidates;
+    QHash<int, quint16> addresses; // serverId -> ServerTable index
+    for (const ChunkServerStatus& status : liveServers(&members)) {
+        candidates.append(status.serverId);
+        addresses.insert(status.serverId, status.server);
+    }
+    if (candidates.size() < replication) {
+        sendText(client, "ERROR Not enough live chunk servers for " + QByteArray::number(replication) + " replicas");
+        return;
+    }
 
     for (int i = 0; i < numChunks; ++i) {
-        int dfsPos = (startIdx + i) % dfsOrder.size();
-        int chunkServerPort = dfsOrder[dfsPos]; // for fuck sake, i dont understand what the fuck dfs do in this project
+        QVector<int> chosen;
+        for (int owner : m_placement->placeByKey(metadata.chunkId(i), replication, members))
+            chosen.append(candidates[owner]);
+        for (int r = chosen.size(); r < replication; ++r) {
+            // distinct servers, and among those the ones sharing the fewest
+            // failure domains with the replicas already chosen
+            QVector<int> eligible;
+            QVector<quint16> chosenServers;
+            for (int other : chosen)
+                chosenServers.append(addresses.value(other));
+            int bestShared = INT_MAX;
+            for (int node : candidates) {
+                if (chosen.contains(node))
+                    continue;
+                int shared = m_topology.closestShared(addresses.value(node), chosenServers);
+                if (shared < bestShared) {
+                    bestShared = shared;
+                    eligible.clear();
+                }
+                if (shared == bestShared)
+                    eligible.append(node);
+            }
+            chosen.append(m_placement->pick(eligible, *m_monitor));
+        }
+        for (int node : chosen) {
+            m_monitor->noteAssigned(node);
+            metadata.addLocation(i, addresses.value(node));
+        }
+    }
+
+    // reply only once the allocation is durable; the worker outlives the
+    // connection, which may be gone by then
+    QPointer<ClientConnection> peer(client);
+    FileMetadata previous;
+    m_journal->logAllocate(metadata, client->parent(), [this, peer, metadata]() {
+        if (peer)
+            sendMetadata(peer, MasterProtocol::KIND_ALLOCATED, metadata);
+    }, &previous);
+    // a re-upload replaces the chunk list cached under any earlier lease,
+    // and the old replicas it does not reuse are garbage
+    invalidateLeases(fileId);
+    if (previous.chunkCount() > 0)
+        QMetaObject::invokeMethod(m_collector, [this, previous, metadata]() { m_collector->collect(previous, metadata); });
+
+    qDebug() << "Allocated" << numChunks << "chunks for file" << fileId
+             << "across" << candidates.size() << "live chunk servers using" << m_placement->name();
+}
 
-        ChunkInfo chunk;
-        chunk.chunkId = fileId + "_chunk_" + QString::number(i);
-        chunk.locations.append(ChunkServerInfo{"127.0.0.1", quint16(chunkServerPort)});
-        metadata.chunks.append(chunk);
+// Registered chunk servers whose heartbeats still arrive, ordered by address
+// so every call (and every master) sees the same list, with the addresses
+// their ring points are hashed from in members when given.
+QList<ChunkServerStatus> MasterServer::liveServers(QVector<HashRing::Member>* members) const {
+    const ServerTable& servers = ServerTable::instance();
+    QList<ChunkServerStatus> live = m_monitor->servers();
+    live.erase(std::remove_if(live.begin(), live.end(), [](const ChunkServerStatus& status) {
+        return !status.alive || status.server == ServerTable::NO_SERVER;
+    }), live.end());
+    std::sort(live.begin(), live.end(), [&servers](const ChunkServerStatus& a, const ChunkServerStatus& b) {
+        const ChunkServerInfo& x = servers.at(a.server);
+        const ChunkServerInfo& y = servers.at(b.server);
+        return std::make_tuple(x.ipv4, x.port, a.serverId) < std::make_tuple(y.ipv4, y.port, b.serverId);
+    });
+    if (members) {
+        for (const ChunkServerStatus& status : std::as_const(live))
+            members->append({servers.at(status.server).ipv4, servers.at(status.server).port});
     }
+    return live;
+}
 
-    fileMetadata[fileId] = metadata;
+// "RING <policy> <vnodes> <count> <ip> <port>..." is the membership the
+// consistent-hash policy places new chunks with; a client builds the same
+// HashRing from it to find chunks without a lookup
+void MasterServer::describeRing(ClientConnection* client) {
+    QVector<HashRing::Member> members;
+    liveServers(&members);
+    QByteArray reply = "RING " + m_placement->name().toUtf8() + " " + QByteArray::number(HashRing::DEFAULT_VNODES) + " "
+                       + QByteArray::number(members.size());
+    for (const HashRing::Member& member : members)
+        reply += " " + QHostAddress(member.ipv4).toString().toUtf8() + " " + QByteArray::number(member.port);
+    sendText(client, reply);
+}
 
-    QString response = "OK Allocated " + QString::number(numChunks);
-    response += getMetadataString(metadata);
-    response += "\n";
-    client->write(response.toUtf8());
+void MasterServer::subscribeRing(ClientConnection* client) {
+    QMutexLocker locker(&m_ringSubscribersLock);
+    for (const ServerLink& link : std::as_const(m_ringSubscribers)) {
+        if (link.connection == client)
+            return;
+    }
+    m_ringSubscribers.append(ServerLink{client, client->parent()});
+}
 
-    qDebug() << "Allocated" << numChunks << "chunks for file" << fileId
-             << "starting from DFS index" << startIdx
-             << "chunk server" << dfsOrder[startIdx];
+// A server coming or going changes where the ring puts chunks, so clients
+// that placed reads with it get the new membership on their own worker
+// thread; closed connections are dropped on the way.
+void MasterServer::broadcastRing() {
+    QMutexLocker locker(&m_ringSubscribersLock);
+    for (auto it = m_ringSubscribers.begin(); it != m_ringSubscribers.end();) {
+        if (!it->connection) {
+            it = m_ringSubscribers.erase(it);
+            continue;
+        }
+        QPointer<ClientConnection> connection = it->connection;
+        QMetaObject::invokeMethod(it->worker, [this, connection]() {
+            if (connection)
+                describeRing(connection);
+        });
+        ++it;
+    }
+}
+
+// Where a client sits: its subnet in the topology file, or else the host of
+// the live chunk servers sharing its address. With several of those only their
+// common domains count, and domains every server is in (the root of the
+// built-in tree) tell nothing apart, so a master and servers all on
+// localhost prefer none.
+QStringList MasterServer::clientLocation(ClientConnection* client) const {
+    QHostAddress peer = client->peerAddress();
+    QStringList location = m_topology.clientLocation(peer);
+    if (!location.isEmpty())
+        return location;
+
+    bool found = false;
+    bool any = false;
+    QStringList everywhere;
+    const ServerTable& servers = ServerTable::instance();
+    for (const ChunkServerStatus& status : liveServers()) {
+        quint16 server = status.server;
+        QStringList serverLocation = m_topology.serverLocation(server);
+        everywhere = any ? everywhere.mid(0, Topology::sharedDepth(everywhere, serverLocation)) : serverLocation;
+        any = true;
+        if (!QHostAddress(servers.at(server).ipv4).isEqual(peer, QHostAddress::ConvertV4MappedToIPv4))
+            continue;
+        location = found ? location.mid(0, Topology::sharedDepth(location, serverLocation)) : serverLocation;
+        found = true;
+    }
+    if (location.size() <= everywhere.size())
+        return QStringList();
+    return location;
+}
+
+// Puts the replicas of chunks [first, end) nearest to location first; clients
+// read from the first replica and only move on when it does not answer.
+// Ties keep the placement order.
+void MasterServer::sortByProximity(const QStringList& location, FileMetadata& metadata, int first, int end) const {
+    if (location.isEmpty())
+        return;
+    QHash<quint16, int> distances; // server -> distance, most files use few servers
+    auto distance = [&](quint16 server) {
+        auto it = distances.constFind(server);
+        if (it == distances.constEnd())
+            it = distances.insert(server, Topology::distance(location, m_topology.serverLocation(server)));
+        return it.value();
+    };
+    for (int i = first; i < end; ++i) {
+        int count = metadata.locationCount(i);
+        if (count < 2)
+            continue;
+        quint16* begin = metadata.replicas.data() + i * metadata.replicaSlots;
+        std::stable_sort(begin, begin + count, [&](quint16 a, quint16 b) { return distance(a) < distance(b); });
+    }
+}
+
+// The lease is taken before the metadata is read, so a change that the
+// reply misses always revokes it afterwards.
+void MasterServer::takeLease(ClientConnection* client, const QString& fileId) {
+    m_leases.grant(fileId, client, client->parent());
 }
 
-void MasterServer::lookupFile(QTcpSocket* client, const QString& fileId) {
+// "LEASE <fileId> <ms>" ahead of the metadata lets the client reuse it for
+// that long. Missing files get no lease, so lookups of names that do not
+// exist leave nothing behind in the table.
+void MasterServer::grantLease(ClientConnection* client, const QString& fileId, bool exists) {
+    if (exists)
+        sendText(client, "LEASE " + fileId.toUtf8() + " " + QByteArray::number(m_leases.durationMs()));
+    else
+        m_leases.release(fileId, client);
+}
+
+// Revokes the leases on a file whose chunk list changed; holders get
+// "INVALIDATE <fileId>" on their own worker thread.
+void MasterServer::invalidateLeases(const QString& fileId) {
+    const QList<LeaseTable::Lease> leases = m_leases.revoke(fileId);
+    for (const LeaseTable::Lease& lease : leases) {
+        QPointer<QObject> holder = lease.holder;
+        QMetaObject::invokeMethod(lease.context, [this, holder, fileId]() {
+            if (holder)
+                sendText(static_cast<ClientConnection*>(holder.data()), "INVALIDATE " + fileId.toUtf8());
+        });
+    }
+    if (!leases.isEmpty())
+        qDebug() << "Invalidated" << leases.size() << "leases on" << fileId;
+}
+
+void MasterServer::lookupFile(ClientConnection* client, const QString& fileId) {
     qDebug() << "Looking up file" << fileId;
-    if (!fileMetadata.contains(fileId)) {
-        client->write("ERROR File not found\n");
+    takeLease(client, fileId);
+    FileMetadata metadata;
+    bool exists = fileMetadata.lookup(fileId, metadata);
+    grantLease(client, fileId, exists);
+    if (!exists) {
+        sendText(client, "ERROR File not found");
+        return;
+    }
+
+    sendMetadata(client, MasterProtocol::KIND_LOOKUP, metadata);
+}
+
+// Only the chunks overlapping [offset, offset + length). Text clients get
+// "RANGE_METADATA <fileId> <size> <chunkSize> <firstChunk> <chunks...>"; the range is
+// clipped to the file, so reading past the end yields no chunks.
+void MasterServer::lookupRange(ClientConnection* client, const QString& fileId, qint64 offset, qint64 length) {
+    qDebug() << "Looking up" << length << "bytes at" << offset << "of file" << fileId;
+    if (offset < 0 || length < 0) {
+        sendText(client, "ERROR Invalid range");
+        return;
+    }
+    FileMetadata metadata;
+    if (!fileMetadata.lookup(fileId, metadata)) {
+        sendText(client, "ERROR File not found");
+        return;
+    }
+
+    int chunks = metadata.chunkCount();
+    qint64 chunkSize = metadata.chunkSize;
+    int first = int(qMin<qint64>(offset / chunkSize, chunks));
+    // files logged before sizes were recorded have size 0
+    qint64 fileEnd = metadata.size > 0 ? metadata.size : chunks * chunkSize;
+    qint64 stop = length > 0 ? qMin(offset + length, fileEnd) : offset;
+    int end = qMax(first, int(qMin<qint64>((stop + chunkSize - 1) / chunkSize, chunks)));
+
+    sendMetadata(client, MasterProtocol::KIND_RANGE, metadata, first, end);
+}
+
+// One response for the whole batch. Text clients get "FILES_METADATA <n>"
+// followed by one "ENTRY <fileId> <size> <chunkSize> <chunks...>" or "MISSING <fileId>"
+// line per requested file, in request order.
+void MasterServer::lookupFiles(ClientConnection* client, const QStringList& fileIds) {
+    qDebug() << "Looking up" << fileIds.size() << "files";
+    for (const QString& fileId : fileIds)
+        takeLease(client, fileId);
+    QVector<FileMetadata> found(fileIds.size());
+    QVector<bool> exists(fileIds.size());
+    for (int i = 0; i < fileIds.size(); ++i) {
+        exists[i] = fileMetadata.lookup(fileIds[i], found[i]);
+        grantLease(client, fileIds[i], exists[i]);
+    }
+
+    QStringList location = clientLocation(client);
+    if (client->binary) {
+        QByteArray body;
+        QDataStream out(&body, QIODevice::WriteOnly);
+        out << quint32(fileIds.size());
+        for (int i = 0; i < fileIds.size(); ++i) {
+            if (exists[i]) {
+                sortByProximity(location, found[i], 0, found[i].chunkCount());
+                out << quint8(1) << encodeMetadata(MasterProtocol::KIND_LOOKUP, found[i]);
+            }
+            else
+                out << quint8(0) << fileIds[i].toUtf8();
+        }
+        writeReply(client, MasterProtocol::encodeFrame(MasterProtocol::OP_METADATA_BATCH, body));
+        return;
+    }
+
+    QByteArray reply = "FILES_METADATA " + QByteArray::number(fileIds.size()) + "\n";
+    for (int i = 0; i < fileIds.size(); ++i) {
+        const QString& fileId = fileIds[i];
+        if (exists[i]) {
+            FileMetadata& metadata = found[i];
+            sortByProximity(location, metadata, 0, metadata.chunkCount());
+            reply += ("ENTRY " + fileId + " " + QString::number(metadata.size) + " " + QString::number(metadata.chunkSize)
+                      + getMetadataString(metadata)).toUtf8() + "\n";
+        }
+        else
+            reply += "MISSING " + fileId.toUtf8() + "\n";
+    }
+    writeReply(client, reply);
+}
+
+// Mutations are refused while the WAL cannot be written: they would only
+// pile up unacknowledged behind the batch being retried.
+bool MasterServer::journalFailing(ClientConnection* client) {
+    if (!m_journal->isFailing())
+        return false;
+    sendText(client, "ERROR Metadata log unavailable, try again later");
+    return true;
+}
+
+void MasterServer::makeDirectory(ClientConnection* client, const QString& path) {
+    if (NamespaceTree::components(path).isEmpty()) {
+        sendText(client, "ERROR Invalid directory");
+        return;
+    }
+    if (journalFailing(client))
+        return;
+    QPointer<ClientConnection> peer(client);
+    if (!m_journal->logMkdir(path, client->parent(), [this, peer]() {
+            if (peer)
+                sendText(peer, "OK Created");
+        }))
+        sendText(client, "OK Exists");
+}
+
+// The metadata goes at once, with "OK Deleted" once that is durable; the
+// chunks are left to the garbage collector.
+void MasterServer::deleteFile(ClientConnection* client, const QString& fileId) {
+    if (journalFailing(client))
+        return;
+    QPointer<ClientConnection> peer(client);
+    FileMetadata removed;
+    if (!m_journal->logDelete(fileId, &removed, client->parent(), [this, peer]() {
+            if (peer)
+                sendText(peer, "OK Deleted");
+        })) {
+        sendText(client, "ERROR File not found");
+        return;
+    }
+    invalidateLeases(fileId);
+    QMetaObject::invokeMethod(m_collector, [this, removed]() { m_collector->collect(removed); });
+    qDebug() << "Deleted file" << fileId << "with" << removed.chunkCount() << "chunks";
+}
+
+// "LISTING <count> <next> <entries...>", where next is the cursor for the
+// following page or "-" on the last one. Plain listings name the direct
+// children, with a trailing '/' on directories; recursive ones give the file
+// ID of every file below the directory.
+void MasterServer::listDirectory(ClientConnection* client, const QString& path, int limit, const QString& cursor,
+                                 bool recursive) {
+    if (limit < 1 || limit > MAX_LIST_LIMIT) {
+        sendText(client, "ERROR Limit must be between 1 and " + QByteArray::number(MAX_LIST_LIMIT));
+        return;
+    }
+    // "-" is what the last page hands back, so it also means "from the start"
+    QString after = cursor == "-" ? QString() : cursor;
+
+    QStringList entries;
+    QString next;
+    const NamespaceTree& tree = fileMetadata.tree();
+    bool ok = recursive ? tree.listRecursive(path, after, limit, entries, next)
+                        : tree.list(path, after, limit, entries, next);
+    if (!ok) {
+        sendText(client, "ERROR No such directory or invalid cursor");
         return;
     }
 
-    const FileMetadata& metadata = fileMetadata[fileId];
-    QString response = "FILE_METADATA " + metadata.fileName;
-    response += getMetadataString(metadata);
-    response += "\n";
-    client->write(response.toUtf8());
+    QString reply = "LISTING " + QString::number(entries.size()) + " " + (next.isEmpty() ? "-" : next);
+    for (const QString& entry : entries)
+        reply += " " + entry;
+    sendText(client, reply.toUtf8());
 }
 
-QString MasterServer::getMetadataString(const FileMetadata& metadata) {
+QString MasterServer::getMetadataString(const FileMetadata& metadata, int first, int end) {
+    if (end < 0)
+        end = metadata.chunkCount();
     QString response = "";
-    for (const auto& chunk : metadata.chunks) {
-        response += " " + chunk.chunkId;
-        for (const auto& loc : chunk.locations)
+    const ServerTable& servers = ServerTable::instance();
+    for (int i = first; i < end; ++i) {
+        response += " " + metadata.chunkId(i);
+        for (int r = 0; r < metadata.locationCount(i); ++r) {
+            const ChunkServerInfo& loc = servers.at(metadata.location(i, r));
             response += " " + loc.ip + " " + QString::number(loc.port);
+        }
     }
     return response;
 }
 
-// TODO: register chunk replica
-// void MasterServer::registerChunkReplica(const QString& chunkId, const QString& addr, quint16 port) {
-//     for (auto& metadata : fileMetadata) {
-//         for (auto& chunk : metadata.chunks) {
-//             if (chunk.chunkId == chunkId) {
-//                 ChunkServerInfo newLoc{addr, port};
-//                 if (!chunk.locations.contains(newLoc)) {
-//                     chunk.locations.append(newLoc);
-//                     qDebug() << "Registered replica for" << chunkId << "at" << addr << ":" << port;
-//                 }
-//                 return;
-//             }
-//         }
-//     }
-//     qDebug() << "Chunk" << chunkId << "not found for registration";
-// }
\ No newline at end of file
+// Replies "OK Registered <added> <unknown>" once the new locations are in the
+// WAL; chunks already known at that address count as neither. lengths, when
+// given, holds the stored size of each chunk, and a copy whose size does not
+// fit the file is left over from an earlier file with the same ID.
+void MasterServer::registerChunkReplicas(ClientConnection* client, const QString& addr, quint16 port,
+                                         const QStringList& chunkIds, const QVector<qint64>& lengths) {
+    quint16 server = ServerTable::instance().intern(addr, port);
+    if (server == ServerTable::NO_SERVER) {
+        sendText(client, "ERROR Too many chunk server addresses");
+        return;
+    }
+    if (journalFailing(client))
+        return;
+    QList<QPair<QString, int>> chunks;
+    QStringList validIds;
+    QVector<qint64> chunkLengths;
+    int malformed = 0;
+    for (int i = 0; i < chunkIds.size(); ++i) {
+        QString fileId;
+        int chunk = 0;
+        if (MetadataStore::splitChunkId(chunkIds[i], fileId, chunk)) {
+            chunks.append({fileId, chunk});
+            validIds.append(chunkIds[i]);
+            chunkLengths.append(i < lengths.size() ? lengths[i] : -1);
+        }
+        else {
+            ++malformed;
+        }
+    }
+
+    // the reply is only known once the journal has applied the batch, and is
+    // only sent once that is durable; a shared slot lets the callback see it
+    QPointer<ClientConnection> peer(client);
+    auto reply = QSharedPointer<QByteArray>::create();
+    int unknown = 0;
+    int added = m_journal->logAddReplicas(server, chunks, &unknown, client->parent(), [this, peer, reply]() {
+        if (peer)
+            sendText(peer, *reply);
+    }, chunkLengths);
+    unknown += malformed;
+    qDebug() << "Registered" << added << "replicas at" << addr << ":" << port
+             << "," << unknown << "unknown chunks";
+
+    *reply = "OK Registered " + QByteArray::number(added) + " " + QByteArray::number(unknown);
+
+    // chunks of files that were deleted, shrank or were replaced while the
+    // server was away, or whose DELETE_CHUNKS never arrived
+    if (unknown > malformed) {
+        QStringList orphans;
+        for (int i = 0; i < chunks.size(); ++i) {
+            const auto& chunk = chunks[i];
+            FileMetadata metadata;
+            if (!fileMetadata.lookup(chunk.first, metadata) || chunk.second >= metadata.chunkCount()
+                || !metadata.holdsChunk(chunk.second, chunkLengths[i]))
+                orphans.append(validIds[i]);
+        }
+        QMetaObject::invokeMethod(m_collector, [this, server, orphans]() { m_collector->collectOrphans(server, orphans); });
+    }
+    if (added == 0)
+        sendText(client, *reply);
+}
\ No newline at end of file
@@ -5,88 +5,50 @@
 #include <QHash>
 #include <QHostAddress>
 #include <QList>
+#include <QMutex>
+#include <QPointer>
+#include <QQueue>
 #include <QSet>
 #include <QString>
+#include <QStringList>
 #include <QTcpServer>
 #include <QTcpSocket>
+#include <QThread>
 #include <QVector>
-#include <QJsonObject>
-#include <QJsonArray>
 #include <csignal>
-
-struct ChunkServerInfo {
-    QString ip;
-    quint16 port;
-
-    QJsonObject toJson() const {
-        QJsonObject obj;
-        obj["ip"] = ip;
-        obj["port"] = port;
-        return obj;
-    }
-
-    static ChunkServerInfo fromJson(const QJsonObject& obj) {
-        ChunkServerInfo info;
-        info.ip = obj["ip"].toString();
-        info.port = static_cast<quint16>(obj["port"].toInt());
-        return info;
-    }
-
-    bool operator==(const ChunkServerInfo& other) const {
-        return ip == other.ip && port == other.port;
-    }
+#include <memory>
+
+#include "chunkservermonitor.h"
+#include "garbagecollector.h"
+#include "leasetable.h"
+#include "masterProtocol.h"
+#include "metadata.h"
+#include "metadatajournal.h"
+#include "metadatastore.h"
+#include "placementpolicy.h"
+#include "rebalancer.h"
+#include "topology.h"
+
+// a metadata response too large for one message, sent a page at a time, or
+// a finished reply waiting behind such a response
+struct MetadataStream {
+    MasterProtocol::MetadataKind kind = MasterProtocol::KIND_LOOKUP;
+    FileMetadata metadata;
+    int first = 0; // chunks [first, end) of the file
+    int next = 0;
+    int end = 0;
+    QByteArray message; // a reply written whole when it reaches the head
 };
 
-struct ChunkInfo {
-    QString chunkId;
-    QVector<ChunkServerInfo> locations;
-
-    QJsonObject toJson() const {
-        QJsonObject obj;
-        obj["chunkId"] = chunkId;
-        QJsonArray locArray;
-        for (const auto& loc : locations) {
-            locArray.append(loc.toJson());
-        }
-        obj["locations"] = locArray;
-        return obj;
-    }
-
-    static ChunkInfo fromJson(const QJsonObject& obj) {
-        ChunkInfo info;
-        info.chunkId = obj["chunkId"].toString();
-        QJsonArray locArray = obj["locations"].toArray();
-        for (const auto& locVal : locArray) {
-            info.locations.append(ChunkServerInfo::fromJson(locVal.toObject()));
-        }
-        return info;
-    }
-};
+// A client socket with its protocol state. It lives on one worker thread
+// and is only touched from there.
+class ClientConnection : public QTcpSocket {
+public:
+    using QTcpSocket::QTcpSocket;
 
-struct FileMetadata {
-    QString fileName;
-    QVector<ChunkInfo> chunks;
-
-    QJsonObject toJson() const {
-        QJsonObject obj;
-        obj["fileName"] = fileName;
-        QJsonArray chunksArray;
-        for (const auto& chunk : chunks) {
-            chunksArray.append(chunk.toJson());
-        }
-        obj["chunks"] = chunksArray;
-        return obj;
-    }
-
-    static FileMetadata fromJson(const QJsonObject& obj) {
-        FileMetadata meta;
-        meta.fileName = obj["fileName"].toString();
-        QJsonArray chunksArray = obj["chunks"].toArray();
-        for (const auto& chunkVal : chunksArray) {
-            meta.chunks.append(ChunkInfo::fromJson(chunkVal.toObject()));
-        }
-        return meta;
-    }
+    bool binary = false; // switched to MasterProtocol framing by HELLO BIN
+    QByteArray buffer;   // bytes of a partially received binary frame
+    QQueue<MetadataStream> streams; // responses still being paged out, in order
 };
 
 class MasterServer : public QTcpServer {
@@ -95,39 +57,110 @@ public:
     explicit MasterServer(QObject* parent = nullptr);
     ~MasterServer() override;
     bool startListening(const QHostAddress& address, quint16 port);
+    bool setPlacementPolicy(const QString& name);
+    // call before startListening(); defaults to one thread per core
+    void startWorkers(int count);
+    // bounds for per-file chunk sizes, within MIN_CHUNK_SIZE..MAX_CHUNK_SIZE
+    bool setChunkSizeRange(int minimum, int maximum);
+    // failure domains from a file instead of chunkServerTree
+    bool loadTopology(const QString& path);
+    // bytes per second the rebalancer may copy, 0 to disable it
+    void setRebalanceBandwidth(qint64 bytesPerSecond);
+    // bytes per second spent restoring replicas lost with a chunk server, 0 to disable
+    void setRepairBandwidth(qint64 bytesPerSecond);
 
     // Static method to access the instance for signal handling
     static MasterServer* instance() { return s_instance; }
 
-private slots:
-    void onNewConnection();
-    void onReadyRead();
-    void onDisconnected();
+protected:
+    void incomingConnection(qintptr socketDescriptor) override;
 
 private:
     static constexpr int NUM_CHUNK_SERVERS = 15;
     static constexpr int CHUNK_SERVER_BASE_PORT = 5000;
-    static constexpr int CHUNK_SIZE = 8 * 1024;
+    static constexpr int TARGET_CHUNKS_PER_FILE = 1024; // when the client leaves the chunk size to the master
+    static constexpr int DEFAULT_REPLICATION = 1;
+    static constexpr int MAX_REPLICATION = 8;
+    static constexpr int PAGE_CHUNKS = 1024;                   // chunk entries per metadata page
+    static constexpr qint64 STREAM_HIGH_WATER = 256 * 1024;    // unsent bytes before paging pauses
+    static constexpr int DEFAULT_LIST_LIMIT = 1000;            // entries per LIST page
+    static constexpr int MAX_LIST_LIMIT = 10000;
+    static constexpr int LEASE_MS = 10000;                     // client metadata cache lease
 
     QHash<int, QList<int>> chunkServerTree;
     QVector<int> dfsOrder;
     bool dfsComputed = false;
 
-    QSet<QTcpSocket*> m_clients;
-    QHash<QString, FileMetadata> fileMetadata;
-
-    void handleRequest(QTcpSocket* client, const QByteArray& data);
-
-    void allocateChunks(QTcpSocket* client, const QString& fileId, qint64 size);
-    void lookupFile(QTcpSocket* client, const QString& fileId);
-    QString getMetadataString(const FileMetadata& metadata);
-    // TODO: register chunk replica
-    // void registerChunkReplica(const QString& chunkId, const QString& addr, quint16 port);
+    QList<QThread*> m_threads;
+    QList<QObject*> m_workers; // one per thread, parent of its connections
+    quint32 m_nextWorker = 0;  // only touched on the accepting thread
+
+    MetadataStore fileMetadata;
+    MetadataJournal* m_journal;
+    ChunkServerMonitor* m_monitor;
+    std::unique_ptr<PlacementPolicy> m_placement;
+    Topology m_topology;
+    LeaseTable m_leases{LEASE_MS};
+    Rebalancer* m_rebalancer;
+    GarbageCollector* m_collector;
+
+    // the master's line to each registered chunk server, for commands it
+    // starts itself; connections belong to their worker thread
+    struct ServerLink {
+        QPointer<ClientConnection> connection;
+        QObject* worker = nullptr;
+    };
+    QHash<int, ServerLink> m_serverLinks; // serverId -> link
+    QMutex m_serverLinksLock;
+    // connections that asked for the RING, sent it again when membership changes
+    QList<ServerLink> m_ringSubscribers;
+    QMutex m_ringSubscribersLock;
+    int m_minChunkSize = MIN_CHUNK_SIZE;
+    int m_maxChunkSize = MAX_CHUNK_SIZE;
+
+    void onReadyRead(ClientConnection* client);
+    void onDisconnected(ClientConnection* client);
+    void handleRequest(ClientConnection* client, const QByteArray& data);
+    void handleFrame(ClientConnection* client, quint8 opcode, const QByteArray& body);
+    void handleHello(ClientConnection* client, const QList<QByteArray>& parts);
+    void handleHeartbeat(ClientConnection* client, const QList<QByteArray>& parts);
+    void sendText(ClientConnection* client, const QByteArray& line);
+    bool journalFailing(ClientConnection* client);
+    void writeReply(ClientConnection* client, const QByteArray& message);
+    void sendMetadata(ClientConnection* client, MasterProtocol::MetadataKind kind, const FileMetadata& metadata,
+                      int first = 0, int end = -1);
+    void sendSortedMetadata(ClientConnection* client, MasterProtocol::MetadataKind kind, const FileMetadata& metadata,
+                            int first, int end);
+    void pumpMetadata(ClientConnection* client);
+    // chunks [first, end) only; end < 0 means through the last chunk
+    QByteArray encodeMetadata(MasterProtocol::MetadataKind kind, const FileMetadata& metadata, int first = 0, int end = -1);
+
+    void allocateChunks(ClientConnection* client, const QString& fileId, qint64 size, int replication, int chunkSize);
+    int chooseChunkSize(qint64 size) const;
+    QList<ChunkServerStatus> liveServers(QVector<HashRing::Member>* members = nullptr) const;
+    void describeRing(ClientConnection* client);
+    void subscribeRing(ClientConnection* client);
+    void broadcastRing();
+    void takeLease(ClientConnection* client, const QString& fileId);
+    void grantLease(ClientConnection* client, const QString& fileId, bool exists);
+    void invalidateLeases(const QString& fileId);
+    void lookupFile(ClientConnection* client, const QString& fileId);
+    void lookupFiles(ClientConnection* client, const QStringList& fileIds);
+    void lookupRange(ClientConnection* client, const QString& fileId, qint64 offset, qint64 length);
+    QString getMetadataString(const FileMetadata& metadata, int first = 0, int end = -1);
+    void makeDirectory(ClientConnection* client, const QString& path);
+    void deleteFile(ClientConnection* client, const QString& fileId);
+    void listDirectory(ClientConnection* client, const QString& path, int limit, const QString& cursor, bool recursive);
+    bool sendToServer(int serverId, const QByteArray& line);
+    void registerChunkReplicas(ClientConnection* client, const QString& addr, quint16 port, const QStringList& chunkIds,
+                               const QVector<qint64>& lengths = {});
+
+    QStringList clientLocation(ClientConnection* client) const;
+    void sortByProximity(const QStringList& location, FileMetadata& metadata, int first, int end) const;
 
     void buildBinaryTree();
     void computeDFS(int node);
 
-    void saveLog();
     static MasterServer* s_instance; // Static instance for signal handler
     static void handleSigInt(int sig);
 };
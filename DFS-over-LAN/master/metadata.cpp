@@ -0,0 +1,201 @@
+#include "metadata.h"
+
+#include <QHostAddress>
+
+ServerTable& ServerTable::instance() {
+    static ServerTable table;
+    return table;
+}
+
+ServerTable::ServerTable() : m_servers(new ChunkServerInfo[MAX_SERVERS]) {}
+
+quint16 ServerTable::intern(const QString& ip, quint16 port) {
+    QString key = ip + ":" + QString::number(port);
+    QMutexLocker locker(&m_mutex);
+    auto it = m_index.constFind(key);
+    if (it != m_index.constEnd())
+        return it.value();
+
+    int index = m_size.load(std::memory_order_relaxed);
+    if (index >= MAX_SERVERS)
+        return NO_SERVER;
+    m_servers[index] = ChunkServerInfo{ip, port, QHostAddress(ip).toIPv4Address()};
+    m_index.insert(key, quint16(index));
+    m_size.store(index + 1, std::memory_order_release);
+    return quint16(index);
+}
+
+void FileMetadata::resize(int chunks, int slots) {
+    replicaSlots = quint8(qBound(1, slots, 255));
+    replicas.fill(ServerTable::NO_SERVER, chunks * replicaSlots);
+}
+
+int FileMetadata::locationCount(int chunk) const {
+    int count = 0;
+    while (count < replicaSlots && location(chunk, count) != ServerTable::NO_SERVER)
+        ++count;
+    return count;
+}
+
+bool FileMetadata::addLocation(int chunk, quint16 server) {
+    if (server == ServerTable::NO_SERVER)
+        return false;
+    int count = locationCount(chunk);
+    for (int i = 0; i < count; ++i) {
+        if (location(chunk, i) == server)
+            return false;
+    }
+
+    if (count == replicaSlots) {
+        if (replicaSlots == 255)
+            return false;
+        // every slot of this chunk is taken: widen the stride for the whole file
+        int chunks = chunkCount();
+        int slots = replicaSlots + 1;
+        QVector<quint16> widened(chunks * slots, ServerTable::NO_SERVER);
+        for (int c = 0; c < chunks; ++c) {
+            for (int r = 0; r < replicaSlots; ++r)
+                widened[c * slots + r] = location(c, r);
+        }
+        replicas.swap(widened);
+        replicaSlots = quint8(slots);
+    }
+    replicas[chunk * replicaSlots + count] = server;
+    return true;
+}
+
+bool FileMetadata::replaceLocation(int chunk, quint16 from, quint16 to) {
+    if (to == ServerTable::NO_SERVER)
+        return false;
+    int count = locationCount(chunk);
+    int slot = -1;
+    bool present = false;
+    for (int i = 0; i < count; ++i) {
+        if (location(chunk, i) == from)
+            slot = i;
+        else if (location(chunk, i) == to)
+            present = true;
+    }
+    if (slot < 0)
+        return false;
+    if (present)
+        return removeLocation(chunk, from);
+    replicas[chunk * replicaSlots + slot] = to;
+    return true;
+}
+
+qint64 FileMetadata::chunkLength(int chunk) const {
+    if (size <= 0)
+        return -1;
+    return qBound<qint64>(0, size - qint64(chunk) * chunkSize, chunkSize);
+}
+
+bool FileMetadata::holdsChunk(int chunk, qint64 length) const {
+    qint64 expected = chunkLength(chunk);
+    return length < 0 || expected < 0 || length == expected;
+}
+
+bool FileMetadata::operator==(const FileMetadata& other) const {
+    if (fileName != other.fileName || size != other.size || chunkSize != other.chunkSize
+        || chunkCount() != other.chunkCount())
+        return false;
+    for (int i = 0; i < chunkCount(); ++i) {
+        int count = locationCount(i);
+        if (count != other.locationCount(i))
+            return false;
+        for (int r = 0; r < count; ++r) {
+            if (location(i, r) != other.location(i, r))
+                return false;
+        }
+    }
+    return true;
+}
+
+bool FileMetadata::removeLocation(int chunk, quint16 server) {
+    int count = locationCount(chunk);
+    for (int i = 0; i < count; ++i) {
+        if (location(chunk, i) != server)
+            continue;
+        // keep the replicas packed at the front of the chunk's slots
+        quint16* slots = replicas.data() + chunk * replicaSlots;
+        for (int j = i; j + 1 < count; ++j)
+            slots[j] = slots[j + 1];
+        slots[count - 1] = ServerTable::NO_SERVER;
+        return true;
+    }
+    return false;
+}
+
+FileMetadata FileMetadata::fromJson(const QJsonObject& obj) {
+    FileMetadata meta;
+    meta.fileName = obj["fileName"].toString();
+    meta.size = obj["size"].toInteger();
+    QJsonArray chunksArray = obj["chunks"].toArray();
+    int slots = 1;
+    for (const auto& chunkVal : chunksArray)
+        slots = qMax(slots, int(chunkVal.toObject()["locations"].toArray().size()));
+    meta.resize(int(chunksArray.size()), slots);
+
+    ServerTable& servers = ServerTable::instance();
+    for (int i = 0; i < chunksArray.size(); ++i) {
+        for (const auto& locVal : chunksArray[i].toObject()["locations"].toArray()) {
+            ChunkServerInfo loc = ChunkServerInfo::fromJson(locVal.toObject());
+            meta.addLocation(i, servers.intern(loc.ip, loc.port));
+        }
+    }
+    return meta;
+}
+
+void FileMetadata::write(QDataStream& out) const {
+    // servers used by this file, then replicas as indices into that list
+    ServerTable& servers = ServerTable::instance();
+    QHash<quint16, quint16> local;
+    QVector<quint16> order;
+    for (quint16 server : replicas) {
+        if (server != ServerTable::NO_SERVER && !local.contains(server)) {
+            local.insert(server, quint16(order.size()));
+            order.append(server);
+        }
+    }
+
+    out << fileName << size << replicaSlots << quint32(chunkCount()) << quint32(order.size());
+    for (quint16 server : order)
+        out << servers.at(server).ip << servers.at(server).port;
+    for (quint16 server : replicas)
+        out << (server == ServerTable::NO_SERVER ? ServerTable::NO_SERVER : local.value(server));
+    out << qint32(chunkSize);
+}
+
+FileMetadata FileMetadata::read(QDataStream& in) {
+    FileMetadata meta;
+    quint8 slots = 1;
+    quint32 chunks = 0;
+    quint32 serverCount = 0;
+    in >> meta.fileName >> meta.size >> slots >> chunks >> serverCount;
+
+    ServerTable& servers = ServerTable::instance();
+    QVector<quint16> global;
+    for (quint32 i = 0; i < serverCount && in.status() == QDataStream::Ok; ++i) {
+        QString ip;
+        quint16 port = 0;
+        in >> ip >> port;
+        global.append(servers.intern(ip, port));
+    }
+
+    meta.resize(int(chunks), slots);
+    // addLocation keeps the replicas packed if a server did not fit in the table
+    for (int i = 0; i < meta.replicas.size() && in.status() == QDataStream::Ok; ++i) {
+        quint16 server = ServerTable::NO_SERVER;
+        in >> server;
+        if (server < global.size())
+            meta.addLocation(i / meta.replicaSlots, global[server]);
+    }
+    // records written before chunk sizes were per file end here
+    if (!in.atEnd()) {
+        qint32 chunkSize = 0;
+        in >> chunkSize;
+        if (chunkSize > 0)
+            meta.chunkSize = chunkSize;
+    }
+    return meta;
+}
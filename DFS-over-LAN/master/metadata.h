@@ -0,0 +1,92 @@
+#ifndef METADATA_H
+#define METADATA_H
+
+#include <QDataStream>
+#include <QHash>
+#include <QJsonArray>
+#include <QJsonObject>
+#include <QMutex>
+#include <QString>
+#include <QVector>
+#include <atomic>
+#include <memory>
+
+#include "chunkFrames.h"
+
+struct ChunkServerInfo {
+    QString ip;
+    quint16 port;
+    quint32 ipv4 = 0; // ip as a number, filled in by ServerTable
+
+    static ChunkServerInfo fromJson(const QJsonObject& obj) {
+        ChunkServerInfo info;
+        info.ip = obj["ip"].toString();
+        info.port = static_cast<quint16>(obj["port"].toInt());
+        return info;
+    }
+
+    bool operator==(const ChunkServerInfo& other) const {
+        return ip == other.ip && port == other.port;
+    }
+};
+
+// Process-wide table of chunk server addresses. File metadata refers to
+// servers by u16 index, so each replica costs two bytes instead of a QString.
+// Entries are never moved or removed, so at() needs no lock.
+class ServerTable {
+public:
+    static constexpr quint16 NO_SERVER = 0xFFFF;
+    static constexpr int MAX_SERVERS = NO_SERVER;
+
+    static ServerTable& instance();
+
+    quint16 intern(const QString& ip, quint16 port);
+    const ChunkServerInfo& at(quint16 index) const { return m_servers[index]; }
+    int size() const { return m_size.load(std::memory_order_acquire); }
+
+private:
+    ServerTable();
+
+    std::unique_ptr<ChunkServerInfo[]> m_servers;
+    std::atomic<int> m_size{0};
+    QHash<QString, quint16> m_index; // "ip:port" -> index
+    QMutex m_mutex;
+};
+
+// Metadata of one file. Chunk i is "<fileName>_chunk_<i>" and its replicas are
+// the first non-NO_SERVER entries of replicas[i * replicaSlots ...].
+struct FileMetadata {
+    QString fileName;
+    qint64 size = 0;
+    int chunkSize = DEFAULT_CHUNK_SIZE; // bytes per chunk, the last one may be shorter
+    quint8 replicaSlots = 1;
+    QVector<quint16> replicas;
+
+    int chunkCount() const { return replicas.size() / replicaSlots; }
+    QString chunkId(int chunk) const { return fileName + "_chunk_" + QString::number(chunk); }
+    void resize(int chunks, int slots);
+    int locationCount(int chunk) const;
+    quint16 location(int chunk, int replica) const { return replicas[chunk * replicaSlots + replica]; }
+    // false if server is already listed or is NO_SERVER
+    bool addLocation(int chunk, quint16 server);
+    bool removeLocation(int chunk, quint16 server);
+    // puts to in from's slot, or just drops from if to is already listed;
+    // false if from is not a replica of the chunk
+    bool replaceLocation(int chunk, quint16 from, quint16 to);
+    // bytes in the chunk, or -1 for files logged before sizes were recorded
+    qint64 chunkLength(int chunk) const;
+    // whether a stored copy of length bytes (-1 if not known) can be this
+    // chunk rather than one of an earlier file with the same ID
+    bool holdsChunk(int chunk, qint64 length) const;
+    // same file, chunk size and replicas, however the replica slots are padded
+    bool operator==(const FileMetadata& other) const;
+
+    // chunk IDs in legacy logs are always <fileName>_chunk_<i>, so only order is kept
+    static FileMetadata fromJson(const QJsonObject& obj);
+
+    // self-contained encoding for WAL records: addresses are written out, not table indices
+    void write(QDataStream& out) const;
+    static FileMetadata read(QDataStream& in);
+};
+
+#endif // METADATA_H
@@ -0,0 +1,297 @@
+#include "metadataimage.h"
+
+#include <QDebug>
+#include <QHostAddress>
+#include <QSaveFile>
+#include <QtEndian>
+#include <algorithm>
+#include <cstring>
+
+static const char IMAGE_MAGIC[8] = {'D', 'F', 'S', 'I', 'M', 'G', '0', '1'};
+static constexpr quint32 IMAGE_VERSION = 2;
+static constexpr int HEADER_SIZE = 88;
+static constexpr int FILE_RECORD_SIZE = 28;
+static constexpr int V1_FILE_RECORD_SIZE = 24; // before the per-file chunk size
+static constexpr int CHUNK_RECORD_SIZE = 16;
+static constexpr int LOCATION_RECORD_SIZE = 2;
+static constexpr int SERVER_RECORD_SIZE = 8;
+
+template <typename T>
+static T readLE(const uchar* p) {
+    return qFromLittleEndian<T>(p);
+}
+
+template <typename T>
+static void appendLE(QByteArray& out, T value) {
+    char buf[sizeof(T)];
+    qToLittleEndian<T>(value, buf);
+    out.append(buf, sizeof(T));
+}
+
+MetadataImage::~MetadataImage() {
+    if (m_data)
+        m_file.unmap(const_cast<uchar*>(m_data));
+}
+
+bool MetadataImage::open(const QString& path) {
+    m_file.setFileName(path);
+    if (!m_file.open(QIODevice::ReadOnly))
+        return false;
+    m_size = m_file.size();
+    if (m_size < HEADER_SIZE) {
+        qWarning() << "Metadata image" << path << "is truncated";
+        return false;
+    }
+    m_data = m_file.map(0, m_size);
+    if (!m_data) {
+        qWarning() << "Could not map metadata image" << path;
+        return false;
+    }
+    m_version = readLE<quint32>(m_data + 8);
+    if (memcmp(m_data, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 || m_version < 1 || m_version > IMAGE_VERSION) {
+        qWarning() << "Unsupported metadata image" << path;
+        return false;
+    }
+    m_fileRecordSize = m_version == 1 ? V1_FILE_RECORD_SIZE : FILE_RECORD_SIZE;
+
+    m_walGeneration = readLE<quint32>(m_data + 12);
+    m_fileCount = readLE<quint32>(m_data + 16);
+    m_serverCount = readLE<quint32>(m_data + 20);
+    m_fileOffset = readLE<quint64>(m_data + 24);
+    m_chunkOffset = readLE<quint64>(m_data + 32);
+    m_locationOffset = readLE<quint64>(m_data + 40);
+    m_serverOffset = readLE<quint64>(m_data + 48);
+    m_stringOffset = readLE<quint64>(m_data + 56);
+    m_chunkTotal = readLE<quint64>(m_data + 64);
+    m_locationTotal = readLE<quint64>(m_data + 72);
+    m_stringSize = readLE<quint64>(m_data + 80);
+
+    auto fits = [this](quint64 offset, quint64 bytes) {
+        return offset <= quint64(m_size) && bytes <= quint64(m_size) - offset;
+    };
+    if (!fits(m_fileOffset, quint64(m_fileCount) * m_fileRecordSize)
+        || !fits(m_chunkOffset, m_chunkTotal * CHUNK_RECORD_SIZE)
+        || !fits(m_locationOffset, m_locationTotal * LOCATION_RECORD_SIZE)
+        || !fits(m_serverOffset, quint64(m_serverCount) * SERVER_RECORD_SIZE)
+        || !fits(m_stringOffset, m_stringSize)) {
+        qWarning() << "Metadata image" << path << "has out-of-range tables";
+        m_file.unmap(const_cast<uchar*>(m_data));
+        m_data = nullptr;
+        return false;
+    }
+
+    ServerTable& servers = ServerTable::instance();
+    m_serverMap.reserve(int(m_serverCount));
+    for (quint32 i = 0; i < m_serverCount; ++i) {
+        const uchar* s = m_data + m_serverOffset + quint64(i) * SERVER_RECORD_SIZE;
+        m_serverMap.append(servers.intern(QHostAddress(readLE<quint32>(s)).toString(), readLE<quint16>(s + 4)));
+    }
+    return true;
+}
+
+const uchar* MetadataImage::fileRecord(int index) const {
+    return m_data + m_fileOffset + quint64(index) * m_fileRecordSize;
+}
+
+QByteArray MetadataImage::nameBytes(int index) const {
+    const uchar* rec = fileRecord(index);
+    quint32 offset = readLE<quint32>(rec);
+    quint32 length = readLE<quint32>(rec + 4);
+    if (quint64(offset) + length > m_stringSize)
+        return QByteArray();
+    return QByteArray::fromRawData(reinterpret_cast<const char*>(m_data + m_stringOffset + offset), int(length));
+}
+
+int MetadataImage::find(const QString& fileId) const {
+    if (!m_data)
+        return -1;
+    QByteArray key = fileId.toUtf8();
+    int lo = 0;
+    int hi = int(m_fileCount) - 1;
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        QByteArray name = nameBytes(mid);
+        if (name == key)
+            return mid;
+        if (name < key)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
+    }
+    return -1;
+}
+
+QString MetadataImage::fileName(int index) const {
+    return QString::fromUtf8(nameBytes(index));
+}
+
+FileMetadata MetadataImage::hydrate(int index) const {
+    const uchar* rec = fileRecord(index);
+    FileMetadata meta;
+    meta.fileName = fileName(index);
+    meta.size = readLE<qint64>(rec + 8);
+    quint32 firstChunk = readLE<quint32>(rec + 16);
+    quint32 chunkCount = readLE<quint32>(rec + 20);
+    if (m_version >= 2 && readLE<quint32>(rec + 24) > 0)
+        meta.chunkSize = int(readLE<quint32>(rec + 24));
+    if (quint64(firstChunk) + chunkCount > m_chunkTotal)
+        return meta;
+
+    // chunk records carry no ID string any more: IDs are derived from the index
+    int slots = 1;
+    for (quint32 i = 0; i < chunkCount; ++i) {
+        const uchar* c = m_data + m_chunkOffset + quint64(firstChunk + i) * CHUNK_RECORD_SIZE;
+        slots = qMax(slots, int(readLE<quint32>(c + 12)));
+    }
+    meta.resize(int(chunkCount), slots);
+
+    for (quint32 i = 0; i < chunkCount; ++i) {
+        const uchar* c = m_data + m_chunkOffset + quint64(firstChunk + i) * CHUNK_RECORD_SIZE;
+        quint32 firstLocation = readLE<quint32>(c + 8);
+        quint32 locationCount = readLE<quint32>(c + 12);
+        if (quint64(firstLocation) + locationCount > m_locationTotal)
+            continue;
+        for (quint32 j = 0; j < locationCount; ++j) {
+            quint16 server = readLE<quint16>(m_data + m_locationOffset + quint64(firstLocation + j) * LOCATION_RECORD_SIZE);
+            if (server < m_serverMap.size())
+                meta.addLocation(int(i), m_serverMap[server]);
+        }
+    }
+    return meta;
+}
+
+bool MetadataImage::write(const QString& path, quint32 walGeneration, const MetadataImage* base,
+                          const QHash<QString, FileMetadata>& changed, const QSet<QString>& removed, int* fileCount) {
+    QList<QByteArray> names;
+    names.reserve(changed.size());
+    for (auto it = changed.constBegin(); it != changed.constEnd(); ++it)
+        names.append(it.key().toUtf8());
+    std::sort(names.begin(), names.end());
+
+    QByteArray fileTable, chunkTable, locationTable, serverTable, strings;
+    QHash<quint16, quint16> serverIndex; // ServerTable index -> image server index
+    const ServerTable& servers = ServerTable::instance();
+    quint32 chunkTotal = 0;
+    quint32 locationTotal = 0;
+    quint32 written = 0;
+
+    auto appendFile = [&](const QByteArray& name, qint64 size, quint32 chunks, quint32 chunkSize) {
+        appendLE<quint32>(fileTable, quint32(strings.size()));
+        appendLE<quint32>(fileTable, quint32(name.size()));
+        strings.append(name);
+        appendLE<qint64>(fileTable, size);
+        appendLE<quint32>(fileTable, chunkTotal);
+        appendLE<quint32>(fileTable, chunks);
+        appendLE<quint32>(fileTable, chunkSize);
+        ++written;
+    };
+    auto appendChunk = [&](const QVector<quint16>& locations) {
+        appendLE<quint32>(chunkTable, 0); // derived chunk ID
+        appendLE<quint32>(chunkTable, 0);
+        appendLE<quint32>(chunkTable, locationTotal);
+        appendLE<quint32>(chunkTable, quint32(locations.size()));
+        for (quint16 server : locations) {
+            auto found = serverIndex.constFind(server);
+            if (found == serverIndex.constEnd()) {
+                found = serverIndex.insert(server, quint16(serverIndex.size()));
+                appendLE<quint32>(serverTable, servers.at(server).ipv4);
+                appendLE<quint16>(serverTable, servers.at(server).port);
+                appendLE<quint16>(serverTable, 0);
+            }
+            appendLE<quint16>(locationTable, found.value());
+            ++locationTotal;
+        }
+        ++chunkTotal;
+    };
+
+    auto writeChanged = [&](const QByteArray& name, const FileMetadata& meta) {
+        appendFile(name, meta.size, quint32(meta.chunkCount()), quint32(meta.chunkSize));
+        QVector<quint16> locations;
+        for (int i = 0; i < meta.chunkCount(); ++i) {
+            locations.clear();
+            for (int r = 0; r < meta.locationCount(i); ++r)
+                locations.append(meta.location(i, r));
+            appendChunk(locations);
+        }
+    };
+
+    // the records are re-based onto the new tables, the locations renumbered
+    // through ServerTable so they share server entries with changed files
+    auto copyBase = [&](int index) {
+        const uchar* rec = base->fileRecord(index);
+        quint32 firstChunk = readLE<quint32>(rec + 16);
+        quint32 chunks = readLE<quint32>(rec + 20);
+        quint32 chunkSize = base->m_version >= 2 ? readLE<quint32>(rec + 24) : 0;
+        if (quint64(firstChunk) + chunks > base->m_chunkTotal)
+            chunks = 0;
+        appendFile(base->nameBytes(index), readLE<qint64>(rec + 8), chunks, chunkSize);
+        QVector<quint16> locations;
+        for (quint32 i = 0; i < chunks; ++i) {
+            const uchar* c = base->m_data + base->m_chunkOffset + quint64(firstChunk + i) * CHUNK_RECORD_SIZE;
+            quint32 firstLocation = readLE<quint32>(c + 8);
+            quint32 count = readLE<quint32>(c + 12);
+            locations.clear();
+            if (quint64(firstLocation) + count <= base->m_locationTotal) {
+                for (quint32 j = 0; j < count; ++j) {
+                    quint16 server = readLE<quint16>(base->m_data + base->m_locationOffset
+                                                     + quint64(firstLocation + j) * LOCATION_RECORD_SIZE);
+                    if (server < base->m_serverMap.size() && base->m_serverMap[server] != ServerTable::NO_SERVER)
+                        locations.append(base->m_serverMap[server]);
+                }
+            }
+            appendChunk(locations);
+        }
+    };
+
+    // both inputs are in name order, so one merge pass keeps the output sorted
+    int baseCount = base ? base->fileCount() : 0;
+    int b = 0;
+    int c = 0;
+    while (b < baseCount || c < names.size()) {
+        QByteArray baseName = b < baseCount ? base->nameBytes(b) : QByteArray();
+        if (c < names.size() && (b >= baseCount || !(baseName < names[c]))) {
+            if (b < baseCount && baseName == names[c])
+                ++b; // overridden
+            writeChanged(names[c], changed[QString::fromUtf8(names[c])]);
+            ++c;
+        }
+        else {
+            if (!removed.contains(QString::fromUtf8(baseName)))
+                copyBase(b);
+            ++b;
+        }
+    }
+    if (fileCount)
+        *fileCount = int(written);
+
+    quint64 fileOffset = HEADER_SIZE;
+    quint64 chunkOffset = fileOffset + fileTable.size();
+    quint64 locationOffset = chunkOffset + chunkTable.size();
+    quint64 serverOffset = locationOffset + locationTable.size();
+    quint64 stringOffset = serverOffset + serverTable.size();
+
+    QByteArray header(IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    appendLE<quint32>(header, IMAGE_VERSION);
+    appendLE<quint32>(header, walGeneration);
+    appendLE<quint32>(header, written);
+    appendLE<quint32>(header, quint32(serverIndex.size()));
+    appendLE<quint64>(header, fileOffset);
+    appendLE<quint64>(header, chunkOffset);
+    appendLE<quint64>(header, locationOffset);
+    appendLE<quint64>(header, serverOffset);
+    appendLE<quint64>(header, stringOffset);
+    appendLE<quint64>(header, chunkTotal);
+    appendLE<quint64>(header, locationTotal);
+    appendLE<quint64>(header, quint64(strings.size()));
+
+    QSaveFile file(path);
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+    file.write(header);
+    file.write(fileTable);
+    file.write(chunkTable);
+    file.write(locationTable);
+    file.write(serverTable);
+    file.write(strings);
+    return file.commit();
+}
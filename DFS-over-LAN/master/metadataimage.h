@@ -0,0 +1,74 @@
+#ifndef METADATAIMAGE_H
+#define METADATAIMAGE_H
+
+#include <QFile>
+#include <QHash>
+#include <QSet>
+#include <QString>
+#include <QVector>
+
+#include "metadata.h"
+
+// Read-only binary image of the master's metadata, memory-mapped at startup.
+//
+// Layout (little endian):
+//   header   magic "DFSIMG01", u32 version, u32 walGeneration, u32 fileCount,
+//            u32 serverCount, u64 offsets of the file, chunk, location, server
+//            and string tables, u64 chunk, location and string byte counts
+//   files    fileCount x { u32 nameOffset, u32 nameLength, i64 size,
+//                          u32 firstChunk, u32 chunkCount, u32 chunkSize },
+//            sorted by name; version 1 images lack chunkSize
+//   chunks   { u32 idOffset, u32 idLength, u32 firstLocation, u32 locationCount },
+//            idLength 0 meaning the ID is <fileName>_chunk_<index>, which is
+//            the only form the master writes
+//   locations  u16 server index per replica
+//   servers  serverCount x { u32 IPv4, u16 port, u16 reserved }
+//   strings  UTF-8 names
+//
+// Opening only validates the header, so startup cost does not depend on the
+// namespace size; files are found by binary search and hydrated on demand.
+class MetadataImage {
+public:
+    MetadataImage() = default;
+    ~MetadataImage();
+    MetadataImage(const MetadataImage&) = delete;
+    MetadataImage& operator=(const MetadataImage&) = delete;
+
+    bool open(const QString& path);
+    quint32 walGeneration() const { return m_walGeneration; }
+    int fileCount() const { return int(m_fileCount); }
+    int find(const QString& fileId) const; // file index or -1
+    QString fileName(int index) const;
+    FileMetadata hydrate(int index) const;
+
+    // Writes base's files with changed laid over them and removed left out;
+    // base may be null. Files of base that did not change are copied record
+    // by record without being hydrated.
+    static bool write(const QString& path, quint32 walGeneration, const MetadataImage* base,
+                      const QHash<QString, FileMetadata>& changed, const QSet<QString>& removed = {},
+                      int* fileCount = nullptr);
+
+private:
+    const uchar* fileRecord(int index) const;
+    QByteArray nameBytes(int index) const;
+
+    QFile m_file;
+    const uchar* m_data = nullptr;
+    qint64 m_size = 0;
+    quint32 m_version = 0;
+    quint32 m_walGeneration = 0;
+    quint32 m_fileCount = 0;
+    quint32 m_serverCount = 0;
+    quint64 m_fileOffset = 0;
+    quint64 m_chunkOffset = 0;
+    quint64 m_locationOffset = 0;
+    quint64 m_serverOffset = 0;
+    quint64 m_stringOffset = 0;
+    quint64 m_chunkTotal = 0;
+    quint64 m_locationTotal = 0;
+    quint64 m_stringSize = 0;
+    QVector<quint16> m_serverMap; // image server index -> ServerTable index
+    int m_fileRecordSize = 0;
+};
+
+#endif // METADATAIMAGE_H
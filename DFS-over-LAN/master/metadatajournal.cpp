@@ -0,0 +1,498 @@
+#include "metadatajournal.h"
+
+#include <QDataStream>
+#include <QDebug>
+#include <QDir>
+#include <QJsonDocument>
+#include <QtEndian>
+#include <algorithm>
+#include <unistd.h>
+
+static const QString IMAGE_FILE = "master_image.bin";
+static const QString LEGACY_SNAPSHOT_FILE = "master_log.json";
+static constexpr int RECORD_HEADER_SIZE = 6; // u32 length, u16 checksum
+
+MetadataJournal::MetadataJournal(MetadataStore& store, QObject* parent)
+    : QObject(parent), m_store(store) {
+    m_commitTimer = new QTimer(this);
+    m_commitTimer->setSingleShot(true);
+    m_commitTimer->setInterval(GROUP_COMMIT_MS);
+    connect(m_commitTimer, &QTimer::timeout, this, &MetadataJournal::commit);
+
+    m_snapshotTimer = new QTimer(this);
+    m_snapshotTimer->setInterval(SNAPSHOT_INTERVAL_MS);
+    connect(m_snapshotTimer, &QTimer::timeout, this, &MetadataJournal::onSnapshotTimer);
+}
+
+MetadataJournal::~MetadataJournal() {
+    sync();
+    if (m_snapshotThread)
+        m_snapshotThread->wait();
+}
+
+void MetadataJournal::recover() {
+    int snapshotGeneration = loadSnapshot();
+    int lastGeneration = snapshotGeneration;
+    int replayed = 0;
+    for (int generation : segmentGenerations()) {
+        if (generation < snapshotGeneration) {
+            // already covered; left behind by a crash right after a snapshot
+            QFile::remove(segmentPath(generation));
+            continue;
+        }
+        replaySegment(segmentPath(generation));
+        lastGeneration = qMax(lastGeneration, generation);
+        ++replayed;
+    }
+
+    openSegment(lastGeneration + 1);
+    m_snapshotTimer->start();
+    qDebug() << "Recovered" << m_store.size() << "files from snapshot generation"
+             << snapshotGeneration << "and" << replayed << "WAL segments";
+}
+
+int MetadataJournal::loadSnapshot() {
+    auto image = QSharedPointer<MetadataImage>::create();
+    if (image->open(IMAGE_FILE)) {
+        m_store.setImage(image);
+        qDebug() << "Mapped metadata image with" << image->fileCount() << "files";
+        return int(image->walGeneration());
+    }
+    return loadLegacySnapshot();
+}
+
+// JSON snapshots from before the binary image; replaced by the next snapshot
+int MetadataJournal::loadLegacySnapshot() {
+    QFile file(LEGACY_SNAPSHOT_FILE);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qDebug() << "No snapshot found, starting with empty metadata";
+        return 0;
+    }
+
+    QJsonDocument doc = QJsonDocument::fromJson(file.readAll());
+    if (!doc.isObject()) {
+        qWarning() << "Invalid JSON in snapshot";
+        return 0;
+    }
+
+    QJsonObject root = doc.object();
+    int generation = 0;
+    // logs written before the WAL existed are a bare fileId -> metadata map
+    if (root.contains("files")) {
+        generation = root["walGeneration"].toInt();
+        root = root["files"].toObject();
+    }
+    for (auto it = root.begin(); it != root.end(); ++it) {
+        if (it.value().isObject())
+            m_store.insert(FileMetadata::fromJson(it.value().toObject()));
+    }
+    qDebug() << "Loaded" << m_store.size() << "file metadata from snapshot";
+    return generation;
+}
+
+void MetadataJournal::replaySegment(const QString& path) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Cannot open WAL segment" << path;
+        return;
+    }
+
+    QByteArray data = file.readAll();
+    qsizetype pos = 0;
+    while (data.size() - pos >= RECORD_HEADER_SIZE) {
+        quint32 length = qFromBigEndian<quint32>(data.constData() + pos);
+        quint16 checksum = qFromBigEndian<quint16>(data.constData() + pos + 4);
+        if (length == 0 || length > quint64(data.size() - pos - RECORD_HEADER_SIZE))
+            break;
+        QByteArray record = data.mid(pos + RECORD_HEADER_SIZE, length);
+        if (qChecksum(record) != checksum)
+            break;
+        applyRecord(quint8(record.at(0)), record.mid(1));
+        pos += RECORD_HEADER_SIZE + length;
+        ++m_recordsSinceSnapshot;
+    }
+    // a crash mid-append leaves a torn record at the tail, which was never acknowledged
+    if (pos < data.size())
+        qWarning() << "Ignoring" << (data.size() - pos) << "bytes of torn WAL tail in" << path;
+}
+
+void MetadataJournal::applyRecord(quint8 type, const QByteArray& payload) {
+    QDataStream in(payload);
+    switch (type) {
+    case RECORD_ALLOCATE: {
+        FileMetadata metadata = FileMetadata::read(in);
+        if (in.status() == QDataStream::Ok)
+            m_store.insert(metadata);
+        break;
+    }
+    case RECORD_ADD_REPLICAS: {
+        QByteArray ip;
+        quint16 port = 0;
+        quint32 count = 0;
+        in >> ip >> port >> count;
+        quint16 server = ServerTable::instance().intern(QString::fromUtf8(ip), port);
+        QList<QPair<QString, int>> chunks;
+        for (quint32 i = 0; i < count && in.status() == QDataStream::Ok; ++i) {
+            QByteArray fileId;
+            quint32 chunk = 0;
+            in >> fileId >> chunk;
+            chunks.append({QString::fromUtf8(fileId), int(chunk)});
+        }
+        addReplicas(server, chunks, nullptr);
+        break;
+    }
+    case RECORD_MKDIR: {
+        QByteArray path;
+        in >> path;
+        if (in.status() == QDataStream::Ok)
+            m_store.tree().mkdir(QString::fromUtf8(path));
+        break;
+    }
+    case RECORD_MOVE_REPLICA: {
+        QByteArray fileId, fromIp, toIp;
+        quint32 chunk = 0;
+        quint16 fromPort = 0;
+        quint16 toPort = 0;
+        in >> fileId >> chunk >> fromIp >> fromPort >> toIp >> toPort;
+        if (in.status() != QDataStream::Ok)
+            break;
+        ServerTable& servers = ServerTable::instance();
+        moveReplica(QString::fromUtf8(fileId), int(chunk), servers.intern(QString::fromUtf8(fromIp), fromPort),
+                    servers.intern(QString::fromUtf8(toIp), toPort));
+        break;
+    }
+    case RECORD_DELETE: {
+        QByteArray fileId;
+        in >> fileId;
+        if (in.status() == QDataStream::Ok)
+            m_store.remove(QString::fromUtf8(fileId));
+        break;
+    }
+    default:
+        qWarning() << "Unknown WAL record type" << type;
+    }
+}
+
+int MetadataJournal::addReplicas(quint16 server, const QList<QPair<QString, int>>& chunks,
+                                 QList<QPair<QString, int>>* added, const QVector<qint64>& lengths) {
+    int unknown = 0;
+    for (int i = 0; i < chunks.size(); ++i) {
+        const auto& chunk = chunks[i];
+        qint64 length = i < lengths.size() ? lengths[i] : -1;
+        bool exists = false;
+        bool isNew = false;
+        m_store.update(chunk.first, [&](FileMetadata& metadata) {
+            if (chunk.second < metadata.chunkCount() && metadata.holdsChunk(chunk.second, length)) {
+                exists = true;
+                isNew = metadata.addLocation(chunk.second, server);
+            }
+        });
+        if (!exists)
+            ++unknown;
+        else if (isNew && added)
+            added->append(chunk);
+    }
+    return unknown;
+}
+
+bool MetadataJournal::moveReplica(const QString& fileId, int chunk, quint16 from, quint16 to) {
+    bool moved = false;
+    m_store.update(fileId, [&](FileMetadata& metadata) {
+        if (chunk < metadata.chunkCount())
+            moved = metadata.replaceLocation(chunk, from, to);
+    });
+    return moved;
+}
+
+void MetadataJournal::logAllocate(const FileMetadata& metadata, QObject* context, std::function<void()> onDurable,
+                                  FileMetadata* previous) {
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    metadata.write(out);
+
+    QMutexLocker locker(&m_lock);
+    if (!m_store.insert(metadata, previous) && previous)
+        *previous = FileMetadata();
+    append(RECORD_ALLOCATE, payload, context, std::move(onDurable));
+}
+
+int MetadataJournal::logAddReplicas(quint16 server, const QList<QPair<QString, int>>& chunks, int* unknown,
+                                    QObject* context, std::function<void()> onDurable, const QVector<qint64>& lengths) {
+    QMutexLocker locker(&m_lock);
+    QList<QPair<QString, int>> added;
+    int missing = addReplicas(server, chunks, &added, lengths);
+    if (unknown)
+        *unknown = missing;
+    if (added.isEmpty())
+        return 0;
+
+    const ChunkServerInfo& info = ServerTable::instance().at(server);
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out << info.ip.toUtf8() << info.port << quint32(added.size());
+    for (const auto& chunk : added)
+        out << chunk.first.toUtf8() << quint32(chunk.second);
+    append(RECORD_ADD_REPLICAS, payload, context, std::move(onDurable));
+    return added.size();
+}
+
+bool MetadataJournal::logMoveReplica(const QString& fileId, int chunk, quint16 from, quint16 to, QObject* context,
+                                     std::function<void()> onDurable) {
+    const ServerTable& servers = ServerTable::instance();
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out << fileId.toUtf8() << quint32(chunk) << servers.at(from).ip.toUtf8() << servers.at(from).port
+        << servers.at(to).ip.toUtf8() << servers.at(to).port;
+
+    QMutexLocker locker(&m_lock);
+    if (!moveReplica(fileId, chunk, from, to))
+        return false;
+    append(RECORD_MOVE_REPLICA, payload, context, std::move(onDurable));
+    return true;
+}
+
+bool MetadataJournal::logDelete(const QString& fileId, FileMetadata* removed, QObject* context,
+                                std::function<void()> onDurable) {
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out << fileId.toUtf8();
+
+    QMutexLocker locker(&m_lock);
+    if (!m_store.remove(fileId, removed))
+        return false;
+    append(RECORD_DELETE, payload, context, std::move(onDurable));
+    return true;
+}
+
+bool MetadataJournal::logMkdir(const QString& path, QObject* context, std::function<void()> onDurable) {
+    QByteArray payload;
+    QDataStream out(&payload, QIODevice::WriteOnly);
+    out << path.toUtf8();
+
+    QMutexLocker locker(&m_lock);
+    if (!m_store.tree().mkdir(path))
+        return false;
+    append(RECORD_MKDIR, payload, context, std::move(onDurable));
+    return true;
+}
+
+void MetadataJournal::append(RecordType type, const QByteArray& payload, QObject* context,
+                             std::function<void()> onDurable) {
+    QByteArray record;
+    record.reserve(payload.size() + 1);
+    record.append(char(type));
+    record.append(payload);
+
+    QByteArray header(RECORD_HEADER_SIZE, '\0');
+    qToBigEndian<quint32>(quint32(record.size()), header.data());
+    qToBigEndian<quint16>(qChecksum(record), header.data() + 4);
+    m_buffer.append(header);
+    m_buffer.append(record);
+
+    if (onDurable)
+        m_pendingCallbacks.append(PendingCallback{context ? context : this, std::move(onDurable)});
+    // records arriving within GROUP_COMMIT_MS share one fsync; the timer
+    // belongs to the journal's thread, so other threads ask it to start
+    if (!m_commitScheduled) {
+        m_commitScheduled = true;
+        QTimer* timer = m_commitTimer;
+        QMetaObject::invokeMethod(timer, [timer]() {
+            if (!timer->isActive())
+                timer->start();
+        });
+    }
+
+    if (++m_recordsSinceSnapshot >= SNAPSHOT_EVERY_RECORDS && !m_snapshotRequested) {
+        m_snapshotRequested = true;
+        QMetaObject::invokeMethod(this, [this]() { startSnapshot(); }, Qt::QueuedConnection);
+    }
+}
+
+bool MetadataJournal::flushLocked(QList<PendingCallback>* callbacks) {
+    QByteArray batch;
+    takeBatch(&batch, callbacks);
+    if (writeBatch(batch))
+        return true;
+    restoreBatch(batch, callbacks);
+    return false;
+}
+
+void MetadataJournal::takeBatch(QByteArray* batch, QList<PendingCallback>* callbacks) {
+    m_commitScheduled = false;
+    batch->swap(m_buffer);
+    callbacks->swap(m_pendingCallbacks);
+}
+
+bool MetadataJournal::writeBatch(const QByteArray& batch) {
+    if (batch.isEmpty())
+        return true;
+    qint64 start = m_wal.size();
+    if (m_wal.write(batch) == batch.size() && ::fsync(m_wal.handle()) == 0) {
+        if (m_failing.exchange(false))
+            qInfo() << "WAL writes to" << m_wal.fileName() << "work again";
+        return true;
+    }
+    qCritical() << "Could not write to" << m_wal.fileName() << ":" << m_wal.errorString();
+    // cut off whatever part of the batch landed, so the retry does not
+    // follow a torn record that would end replay early
+    m_wal.unsetError();
+    if (!m_wal.resize(start))
+        qCritical() << "Could not truncate" << m_wal.fileName() << "after a failed write";
+    return false;
+}
+
+// Puts a batch that did not reach the disk back in front of the buffer.
+// Its callbacks wait with it, so nothing is acknowledged that is not
+// durable; meanwhile isFailing() tells the master to refuse new mutations,
+// and the batch is retried every WRITE_RETRY_MS.
+void MetadataJournal::restoreBatch(const QByteArray& batch, QList<PendingCallback>* callbacks) {
+    m_buffer.prepend(batch);
+    callbacks->append(m_pendingCallbacks);
+    m_pendingCallbacks.swap(*callbacks);
+    callbacks->clear();
+    m_failing = true;
+    // appends must not schedule a commit of their own while this one waits
+    m_commitScheduled = true;
+    QTimer::singleShot(WRITE_RETRY_MS, this, &MetadataJournal::commit);
+}
+
+// each callback goes to its context's thread, directly if that is this one
+void MetadataJournal::dispatch(const QList<PendingCallback>& callbacks) {
+    for (const PendingCallback& pending : callbacks) {
+        if (pending.context)
+            QMetaObject::invokeMethod(pending.context, pending.callback);
+    }
+}
+
+// Only taking the batch holds m_lock; the write and fsync hold just
+// m_writeLock, so log* calls keep appending to the next batch meanwhile.
+void MetadataJournal::commit() {
+    QByteArray batch;
+    QList<PendingCallback> callbacks;
+    {
+        QMutexLocker writeLocker(&m_writeLock);
+        {
+            QMutexLocker locker(&m_lock);
+            takeBatch(&batch, &callbacks);
+        }
+        if (!writeBatch(batch)) {
+            QMutexLocker locker(&m_lock);
+            restoreBatch(batch, &callbacks);
+            return;
+        }
+    }
+    dispatch(callbacks);
+}
+
+void MetadataJournal::sync() {
+    m_commitTimer->stop();
+    commit();
+}
+
+void MetadataJournal::onSnapshotTimer() {
+    bool pending;
+    {
+        QMutexLocker locker(&m_lock);
+        pending = m_recordsSinceSnapshot > 0;
+    }
+    if (pending)
+        startSnapshot();
+}
+
+void MetadataJournal::startSnapshot() {
+    if (m_snapshotThread) {
+        QMutexLocker locker(&m_lock);
+        m_snapshotRequested = false;
+        return; // one at a time; the next trigger catches up
+    }
+
+    QList<PendingCallback> callbacks;
+    MetadataStore::Snapshot snapshot;
+    int covered;
+    {
+        // no append can slip between the flush, the rotation and the copy
+        QMutexLocker writeLocker(&m_writeLock);
+        QMutexLocker locker(&m_lock);
+        m_snapshotRequested = false;
+        // a segment that cannot take the pending records must not be rotated away
+        if (!flushLocked(&callbacks))
+            return;
+        // everything logged so far is in segments below `covered`
+        covered = m_generation + 1;
+        if (!openSegment(covered)) {
+            // keep appending to the current segment
+            openSegment(covered - 1);
+            locker.unlock();
+            writeLocker.unlock();
+            dispatch(callbacks);
+            return;
+        }
+        // the new segment must recreate directories on its own, including
+        // empty ones; leaves are enough since mkdir creates parents
+        for (const QString& path : m_store.tree().leafDirectories()) {
+            QByteArray payload;
+            QDataStream out(&payload, QIODevice::WriteOnly);
+            out << path.toUtf8();
+            append(RECORD_MKDIR, payload, nullptr, {});
+        }
+        m_recordsSinceSnapshot = 0;
+        // the overlay copies are implicitly shared: writers detach on their next change
+        snapshot = m_store.snapshot();
+    }
+    dispatch(callbacks);
+
+    m_snapshotThread = QThread::create([snapshot, covered]() {
+        int files = 0;
+        if (!snapshot.write(IMAGE_FILE, quint32(covered), &files)) {
+            qWarning() << "Could not write metadata image";
+            return;
+        }
+
+        QFile::remove(LEGACY_SNAPSHOT_FILE);
+        for (int generation : segmentGenerations()) {
+            if (generation < covered)
+                QFile::remove(segmentPath(generation));
+        }
+        qDebug() << "Snapshot of" << files << "files written, WAL now starts at generation" << covered;
+    });
+    m_snapshotThread->setParent(this);
+    connect(m_snapshotThread, &QThread::finished, this, [this, covered]() {
+        m_snapshotThread->deleteLater();
+        m_snapshotThread = nullptr;
+        // serve cold files from the new image from now on
+        auto image = QSharedPointer<MetadataImage>::create();
+        if (image->open(IMAGE_FILE) && int(image->walGeneration()) == covered)
+            m_store.setImage(image);
+    });
+    m_snapshotThread->start();
+}
+
+bool MetadataJournal::openSegment(int generation) {
+    if (m_wal.isOpen())
+        m_wal.close();
+    m_wal.setFileName(segmentPath(generation));
+    // batches are written whole, so Qt's buffer would only hide partial writes
+    if (!m_wal.open(QIODevice::WriteOnly | QIODevice::Append | QIODevice::Unbuffered)) {
+        qCritical() << "Could not open WAL segment" << m_wal.fileName();
+        return false;
+    }
+    m_generation = generation;
+    return true;
+}
+
+QList<int> MetadataJournal::segmentGenerations() {
+    QList<int> generations;
+    const QStringList names = QDir(".").entryList({"master_wal.*.log"}, QDir::Files);
+    for (const QString& name : names) {
+        bool ok = false;
+        int generation = name.section('.', 1, 1).toInt(&ok);
+        if (ok)
+            generations.append(generation);
+    }
+    std::sort(generations.begin(), generations.end());
+    return generations;
+}
+
+QString MetadataJournal::segmentPath(int generation) {
+    return QString("master_wal.%1.log").arg(generation);
+}
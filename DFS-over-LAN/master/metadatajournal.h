@@ -0,0 +1,133 @@
+#ifndef METADATAJOURNAL_H
+#define METADATAJOURNAL_H
+
+#include <QFile>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QPair>
+#include <QPointer>
+#include <QString>
+#include <QThread>
+#include <QTimer>
+#include <atomic>
+#include <functional>
+
+#include "metadata.h"
+#include "metadatastore.h"
+
+// Write-ahead log for the master's file metadata.
+//
+// Every mutation is appended to the current WAL segment (master_wal.<gen>.log)
+// as  u32 length | u16 checksum | payload  and fsynced in groups; callers get
+// a callback once their record is durable. A snapshot (master_image.bin, see
+// MetadataImage) is written in the background from a copy of the metadata; it
+// records the first WAL generation it does not cover, and older segments are
+// deleted. The image only holds files, so directories are carried over by
+// re-logging them at the start of each new segment. Recovery maps the image
+// and replays the remaining segments.
+//
+// The log* calls may come from any master worker thread. Each applies its
+// mutation to the store and appends the record to an in-memory batch under
+// one lock, so the WAL order is the order in which changes became visible and
+// a snapshot never sees a change whose record lands in a segment it deletes.
+// Group commit writes and fsyncs a batch without holding that lock.
+class MetadataJournal : public QObject {
+    Q_OBJECT
+public:
+    explicit MetadataJournal(MetadataStore& store, QObject* parent = nullptr);
+    ~MetadataJournal() override;
+
+    void recover();
+    // onDurable runs on context's thread once the record is fsynced, and is
+    // dropped if context has been destroyed by then
+    // previous receives the metadata this allocation replaces, if any
+    void logAllocate(const FileMetadata& metadata, QObject* context = nullptr, std::function<void()> onDurable = {},
+                     FileMetadata* previous = nullptr);
+    // records server as holding each existing (fileId, chunk index) it is not
+    // yet known for and returns how many that was; no record is written (and
+    // onDurable never runs) when it is none. Chunks of unknown files or past
+    // the end of their file are counted in *unknown, and so are those whose
+    // length, when given in lengths (parallel to chunks, -1 for unknown),
+    // does not match the file: a leftover of an earlier file with that ID.
+    int logAddReplicas(quint16 server, const QList<QPair<QString, int>>& chunks, int* unknown,
+                       QObject* context = nullptr, std::function<void()> onDurable = {},
+                       const QVector<qint64>& lengths = {});
+    // switches one replica of a chunk from one server to another in a single
+    // step, so readers see either location but never neither; false, and no
+    // record, if from no longer holds the chunk
+    bool logMoveReplica(const QString& fileId, int chunk, quint16 from, quint16 to, QObject* context = nullptr,
+                        std::function<void()> onDurable = {});
+    // removes the file and copies its last metadata into removed; false, and
+    // no record, if it does not exist
+    bool logDelete(const QString& fileId, FileMetadata* removed = nullptr, QObject* context = nullptr,
+                   std::function<void()> onDurable = {});
+    // false, and no record, if the directory already existed
+    bool logMkdir(const QString& path, QObject* context = nullptr, std::function<void()> onDurable = {});
+    void sync();
+    void startSnapshot();
+    // true while the last WAL write failed; records logged meanwhile stay
+    // unacknowledged until a retry gets them to disk
+    bool isFailing() const { return m_failing; }
+
+private slots:
+    void commit();
+    void onSnapshotTimer();
+
+private:
+    enum RecordType : quint8 {
+        RECORD_ALLOCATE = 1,
+        RECORD_ADD_REPLICAS = 2,
+        RECORD_MKDIR = 3,
+        RECORD_MOVE_REPLICA = 4,
+        RECORD_DELETE = 5,
+    };
+
+    struct PendingCallback {
+        QPointer<QObject> context;
+        std::function<void()> callback;
+    };
+
+    // append, takeBatch and restoreBatch expect m_lock to be held,
+    // flushLocked both locks and writeBatch m_writeLock
+    void append(RecordType type, const QByteArray& payload, QObject* context, std::function<void()> onDurable);
+    // false, with the batch put back, if it could not be made durable
+    bool flushLocked(QList<PendingCallback>* callbacks);
+    void takeBatch(QByteArray* batch, QList<PendingCallback>* callbacks);
+    bool writeBatch(const QByteArray& batch);
+    void restoreBatch(const QByteArray& batch, QList<PendingCallback>* callbacks);
+    static void dispatch(const QList<PendingCallback>& callbacks);
+    int addReplicas(quint16 server, const QList<QPair<QString, int>>& chunks, QList<QPair<QString, int>>* added,
+                    const QVector<qint64>& lengths = {});
+    bool moveReplica(const QString& fileId, int chunk, quint16 from, quint16 to);
+    void applyRecord(quint8 type, const QByteArray& payload);
+    int loadSnapshot();
+    int loadLegacySnapshot();
+    void replaySegment(const QString& path);
+    bool openSegment(int generation);
+    static QList<int> segmentGenerations();
+    static QString segmentPath(int generation);
+
+    MetadataStore& m_store;
+    QMutex m_writeLock; // the segment file; taken before m_lock
+    QMutex m_lock; // the batch, counters and pending callbacks
+    QFile m_wal;
+    QByteArray m_buffer; // records not yet written to m_wal
+    std::atomic<bool> m_failing{false};
+    int m_generation = 0;
+    int m_recordsSinceSnapshot = 0;
+    QList<PendingCallback> m_pendingCallbacks;
+    bool m_commitScheduled = false;
+    bool m_snapshotRequested = false;
+    QTimer* m_commitTimer;
+    QTimer* m_snapshotTimer;
+    QThread* m_snapshotThread = nullptr;
+
+    static constexpr int GROUP_COMMIT_MS = 2;
+    static constexpr int WRITE_RETRY_MS = 1000;
+    static constexpr int SNAPSHOT_EVERY_RECORDS = 10000;
+    static constexpr int SNAPSHOT_INTERVAL_MS = 5 * 60 * 1000;
+};
+
+#endif // METADATAJOURNAL_H
@@ -0,0 +1,242 @@
+#include "metadatastore.h"
+
+MetadataStore::Shard& MetadataStore::shardFor(const QString& fileId) const {
+    return m_shards[qHash(fileId) % SHARD_COUNT];
+}
+
+QSharedPointer<const MetadataImage> MetadataStore::image() const {
+    QMutexLocker locker(&m_imageLock);
+    return m_image;
+}
+
+void MetadataStore::lockAll(bool write) const {
+    for (Shard& shard : m_shards) {
+        if (write)
+            shard.lock.lockForWrite();
+        else
+            shard.lock.lockForRead();
+    }
+}
+
+void MetadataStore::unlockAll() const {
+    for (Shard& shard : m_shards)
+        shard.lock.unlock();
+}
+
+void MetadataStore::setImage(QSharedPointer<const MetadataImage> image) {
+    // with every shard held no insert can race the recount
+    lockAll(true);
+    bool first;
+    {
+        QMutexLocker locker(&m_imageLock);
+        first = !m_image;
+        m_image = image;
+    }
+    // later images only hold files that were already indexed
+    if (first && image) {
+        for (int i = 0; i < image->fileCount(); ++i)
+            m_namespace.addFile(image->fileName(i));
+    }
+    qsizetype overlayOnly = 0;
+    qsizetype removed = 0;
+    for (Shard& shard : m_shards) {
+        for (auto it = shard.overlay.begin(); it != shard.overlay.end();) {
+            int index = image ? image->find(it.key()) : -1;
+            if (index < 0) {
+                ++overlayOnly;
+                ++it;
+            }
+            else if (it.value() == image->hydrate(index)) {
+                // unchanged since the snapshot: the new image serves it again
+                it = shard.overlay.erase(it);
+            }
+            else {
+                ++it;
+            }
+        }
+        // tombstones only matter for files in the image: those deleted after
+        // the snapshot was taken
+        for (auto it = shard.removed.begin(); it != shard.removed.end();) {
+            if (!image || image->find(*it) < 0)
+                it = shard.removed.erase(it);
+            else
+                ++it;
+        }
+        removed += shard.removed.size();
+    }
+    m_overlayOnly = overlayOnly;
+    m_removed = removed;
+    unlockAll();
+}
+
+FileMetadata* MetadataStore::findLocked(Shard& shard, const QString& fileId) {
+    auto it = shard.overlay.find(fileId);
+    if (it != shard.overlay.end())
+        return &it.value();
+    QSharedPointer<const MetadataImage> base = image();
+    if (!base || shard.removed.contains(fileId))
+        return nullptr;
+    int index = base->find(fileId);
+    if (index < 0)
+        return nullptr;
+    // first access since startup or the last snapshot: hydrate from the image
+    return &shard.overlay.insert(fileId, base->hydrate(index)).value();
+}
+
+bool MetadataStore::lookup(const QString& fileId, FileMetadata& out) const {
+    Shard& shard = shardFor(fileId);
+    {
+        QReadLocker locker(&shard.lock);
+        auto it = shard.overlay.constFind(fileId);
+        if (it != shard.overlay.constEnd()) {
+            out = it.value();
+            return true;
+        }
+    }
+    // cold file: hydrating caches it in the overlay, which needs the write lock
+    QWriteLocker locker(&shard.lock);
+    const FileMetadata* metadata = const_cast<MetadataStore*>(this)->findLocked(shard, fileId);
+    if (!metadata)
+        return false;
+    out = *metadata;
+    return true;
+}
+
+bool MetadataStore::update(const QString& fileId, const std::function<void(FileMetadata&)>& fn) {
+    Shard& shard = shardFor(fileId);
+    QWriteLocker locker(&shard.lock);
+    FileMetadata* metadata = findLocked(shard, fileId);
+    if (!metadata)
+        return false;
+    fn(*metadata);
+    return true;
+}
+
+bool MetadataStore::splitChunkId(const QString& chunkId, QString& fileId, int& chunk) {
+    static const QString separator = QStringLiteral("_chunk_");
+    qsizetype at = chunkId.lastIndexOf(separator);
+    if (at <= 0)
+        return false;
+    bool ok = false;
+    chunk = chunkId.mid(at + separator.size()).toInt(&ok);
+    if (!ok || chunk < 0)
+        return false;
+    fileId = chunkId.left(at);
+    return true;
+}
+
+bool MetadataStore::contains(const QString& fileId) const {
+    const Shard& shard = shardFor(fileId);
+    {
+        QReadLocker locker(&shard.lock);
+        if (shard.overlay.contains(fileId))
+            return true;
+        if (shard.removed.contains(fileId))
+            return false;
+    }
+    QSharedPointer<const MetadataImage> base = image();
+    return base && base->find(fileId) >= 0;
+}
+
+bool MetadataStore::insert(const FileMetadata& metadata, FileMetadata* previous) {
+    Shard& shard = shardFor(metadata.fileName);
+    QWriteLocker locker(&shard.lock);
+    bool existed = false;
+    if (previous) {
+        if (const FileMetadata* old = findLocked(shard, metadata.fileName)) {
+            *previous = *old;
+            existed = true;
+        }
+    }
+    if (!shard.overlay.contains(metadata.fileName)) {
+        QSharedPointer<const MetadataImage> base = image();
+        bool inImage = base && base->find(metadata.fileName) >= 0;
+        bool deleted = shard.removed.remove(metadata.fileName);
+        if (inImage && deleted)
+            --m_removed;
+        if (!inImage)
+            ++m_overlayOnly;
+        if (!inImage || deleted)
+            m_namespace.addFile(metadata.fileName);
+        else
+            existed = true;
+    } else {
+        existed = true;
+    }
+    shard.overlay.insert(metadata.fileName, metadata);
+    return existed;
+}
+
+bool MetadataStore::remove(const QString& fileId, FileMetadata* removed) {
+    Shard& shard = shardFor(fileId);
+    QWriteLocker locker(&shard.lock);
+    FileMetadata* metadata = findLocked(shard, fileId);
+    if (!metadata)
+        return false;
+    if (removed)
+        *removed = *metadata;
+    shard.overlay.remove(fileId);
+    // the image is read-only, so the file is hidden until an image without
+    // it is mapped; overlay-only files get a tombstone too, in case the
+    // snapshot being written right now still has them
+    shard.removed.insert(fileId);
+    QSharedPointer<const MetadataImage> base = image();
+    if (base && base->find(fileId) >= 0)
+        ++m_removed;
+    else
+        --m_overlayOnly;
+    m_namespace.removeFile(fileId);
+    return true;
+}
+
+qsizetype MetadataStore::size() const {
+    QSharedPointer<const MetadataImage> base = image();
+    return (base ? base->fileCount() : 0) - m_removed + m_overlayOnly;
+}
+
+QStringList MetadataStore::fileIds() const {
+    QStringList ids;
+    ids.reserve(size());
+    lockAll(false);
+    QSharedPointer<const MetadataImage> base = image();
+    if (base) {
+        for (int i = 0; i < base->fileCount(); ++i) {
+            QString name = base->fileName(i);
+            if (!shardFor(name).removed.contains(name))
+                ids.append(name);
+        }
+    }
+    for (const Shard& shard : m_shards) {
+        for (auto it = shard.overlay.constBegin(); it != shard.overlay.constEnd(); ++it) {
+            if (!base || base->find(it.key()) < 0)
+                ids.append(it.key());
+        }
+    }
+    unlockAll();
+    return ids;
+}
+
+MetadataStore::Snapshot MetadataStore::snapshot() const {
+    Snapshot snapshot;
+    snapshot.overlay.reserve(SHARD_COUNT);
+    lockAll(false);
+    snapshot.base = image();
+    // implicitly shared copies: writers detach on their next change
+    for (const Shard& shard : m_shards) {
+        snapshot.overlay.append(shard.overlay);
+        snapshot.removed.unite(shard.removed);
+    }
+    unlockAll();
+    return snapshot;
+}
+
+QHash<QString, FileMetadata> MetadataStore::Snapshot::changes() const {
+    QHash<QString, FileMetadata> files;
+    for (const auto& shard : overlay)
+        files.insert(shard);
+    return files;
+}
+
+bool MetadataStore::Snapshot::write(const QString& path, quint32 walGeneration, int* fileCount) const {
+    return MetadataImage::write(path, walGeneration, base.data(), changes(), removed, fileCount);
+}
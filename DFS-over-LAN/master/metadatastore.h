@@ -0,0 +1,99 @@
+#ifndef METADATASTORE_H
+#define METADATASTORE_H
+
+#include <QHash>
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QSet>
+#include <QSharedPointer>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <array>
+#include <atomic>
+#include <functional>
+
+#include "metadata.h"
+#include "metadataimage.h"
+#include "namespacetree.h"
+
+// The master's file metadata: a memory-mapped image from the last snapshot
+// plus an in-memory overlay of files hydrated from it or changed since.
+// Overlay entries always win over the image, and an image file deleted
+// since the snapshot is hidden by a tombstone in its shard until the next
+// image is written without it.
+//
+// The overlay is split into SHARD_COUNT shards by file ID, each behind its
+// own read-write lock, so lookups from different worker threads only contend
+// when they hit the same shard and readers never block each other. The image
+// is immutable and read without locks. Operations that need the whole table
+// take the shard locks in index order.
+//
+// Every file is also indexed in a NamespaceTree for directory listings.
+class MetadataStore {
+public:
+    // consistent view handed to the snapshot thread
+    struct Snapshot {
+        QSharedPointer<const MetadataImage> base;
+        QVector<QHash<QString, FileMetadata>> overlay; // one hash per shard
+        QSet<QString> removed;                          // image files deleted since
+
+        // the overlay of every shard in one hash
+        QHash<QString, FileMetadata> changes() const;
+        // the next image: base's unchanged files are copied over as they
+        // are, so only the overlay is ever decoded
+        bool write(const QString& path, quint32 walGeneration, int* fileCount = nullptr) const;
+    };
+
+    // maps a new image and drops the overlay entries it holds unchanged, so
+    // the overlay only keeps what changed since the snapshot
+    void setImage(QSharedPointer<const MetadataImage> image);
+    // copies the file's metadata into out
+    bool lookup(const QString& fileId, FileMetadata& out) const;
+    // runs fn on the file's metadata under its shard's write lock; false if
+    // the file does not exist. fn must not call back into the store.
+    bool update(const QString& fileId, const std::function<void(FileMetadata&)>& fn);
+    // "<fileId>_chunk_<i>": chunk IDs are derived from the file name, so the
+    // file table itself is the chunkId -> (file, index) hash and stays in
+    // sync without a second map
+    static bool splitChunkId(const QString& chunkId, QString& fileId, int& chunk);
+    bool contains(const QString& fileId) const;
+    // replaces any earlier metadata of the file, copying it into previous
+    // first when given; true if the file existed
+    bool insert(const FileMetadata& metadata, FileMetadata* previous = nullptr);
+    // drops the file and copies its last metadata into removed when given;
+    // false if the file does not exist
+    bool remove(const QString& fileId, FileMetadata* removed = nullptr);
+    qsizetype size() const;
+    QStringList fileIds() const;
+    Snapshot snapshot() const;
+
+    NamespaceTree& tree() { return m_namespace; }
+    const NamespaceTree& tree() const { return m_namespace; }
+
+private:
+    static constexpr int SHARD_COUNT = 64;
+
+    struct Shard {
+        mutable QReadWriteLock lock;
+        QHash<QString, FileMetadata> overlay;
+        QSet<QString> removed; // tombstones of deleted image files
+    };
+
+    Shard& shardFor(const QString& fileId) const;
+    QSharedPointer<const MetadataImage> image() const;
+    // the file's overlay entry, hydrated from the image on first access;
+    // caller holds the shard's write lock
+    FileMetadata* findLocked(Shard& shard, const QString& fileId);
+    void lockAll(bool write) const;
+    void unlockAll() const;
+
+    mutable std::array<Shard, SHARD_COUNT> m_shards;
+    mutable QMutex m_imageLock; // guards the pointer, not the mapped image
+    QSharedPointer<const MetadataImage> m_image;
+    std::atomic<qsizetype> m_overlayOnly{0}; // overlay files absent from the image
+    std::atomic<qsizetype> m_removed{0};     // image files behind a tombstone
+    NamespaceTree m_namespace;
+};
+
+#endif // METADATASTORE_H
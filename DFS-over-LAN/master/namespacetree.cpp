@@ -0,0 +1,182 @@
+#include "namespacetree.h"
+
+#include <utility>
+
+NamespaceTree::~NamespaceTree() {
+    for (Directory* dir : std::as_const(m_root.subdirs))
+        destroy(dir);
+}
+
+void NamespaceTree::destroy(Directory* dir) {
+    for (Directory* child : std::as_const(dir->subdirs))
+        destroy(child);
+    delete dir;
+}
+
+QStringList NamespaceTree::components(const QString& path) {
+    return path.split('/', Qt::SkipEmptyParts);
+}
+
+QString NamespaceTree::canonical(const QString& path) {
+    return components(path).join('/');
+}
+
+const NamespaceTree::Directory* NamespaceTree::findDirectory(const QStringList& path) const {
+    const Directory* dir = &m_root;
+    for (const QString& name : path) {
+        dir = dir->subdirs.value(name);
+        if (!dir)
+            return nullptr;
+    }
+    return dir;
+}
+
+NamespaceTree::Directory* NamespaceTree::makeDirectory(const QStringList& path, bool* created) {
+    Directory* dir = &m_root;
+    if (created)
+        *created = false;
+    for (const QString& name : path) {
+        Directory*& child = dir->subdirs[name];
+        if (!child) {
+            child = new Directory;
+            if (created)
+                *created = true;
+        }
+        dir = child;
+    }
+    return dir;
+}
+
+void NamespaceTree::addFile(const QString& fileId) {
+    QStringList path = components(fileId);
+    if (path.isEmpty())
+        return;
+    QString name = path.takeLast();
+    QWriteLocker locker(&m_lock);
+    makeDirectory(path)->files.insert(name, fileId);
+}
+
+void NamespaceTree::removeFile(const QString& fileId) {
+    QStringList path = components(fileId);
+    if (path.isEmpty())
+        return;
+    QString name = path.takeLast();
+    QWriteLocker locker(&m_lock);
+    // "a/b" and "/a/b" share an entry; only drop it for the ID it lists
+    Directory* dir = const_cast<Directory*>(findDirectory(path));
+    if (dir && dir->files.value(name) == fileId)
+        dir->files.remove(name);
+}
+
+bool NamespaceTree::mkdir(const QString& path) {
+    bool created = false;
+    QWriteLocker locker(&m_lock);
+    makeDirectory(components(path), &created);
+    return created;
+}
+
+bool NamespaceTree::isDirectory(const QString& path) const {
+    QReadLocker locker(&m_lock);
+    return findDirectory(components(path)) != nullptr;
+}
+
+bool NamespaceTree::list(const QString& path, const QString& after, int limit, QStringList& entries,
+                         QString& next) const {
+    entries.clear();
+    next.clear();
+    QReadLocker locker(&m_lock);
+    const Directory* dir = findDirectory(components(path));
+    if (!dir)
+        return false;
+
+    // position both maps just past `after` in the merged (name, file < dir) order
+    bool afterDir = after.endsWith('/');
+    QString afterName = afterDir ? after.chopped(1) : after;
+    auto file = dir->files.constBegin();
+    auto sub = dir->subdirs.constBegin();
+    if (!after.isEmpty()) {
+        file = dir->files.upperBound(afterName);
+        sub = afterDir ? dir->subdirs.upperBound(afterName) : dir->subdirs.lowerBound(afterName);
+    }
+
+    while (file != dir->files.constEnd() || sub != dir->subdirs.constEnd()) {
+        if (entries.size() == limit) {
+            next = entries.last();
+            break;
+        }
+        if (sub == dir->subdirs.constEnd() || (file != dir->files.constEnd() && file.key() <= sub.key()))
+            entries.append((file++).key());
+        else
+            entries.append((sub++).key() + '/');
+    }
+    return true;
+}
+
+bool NamespaceTree::listRecursive(const QString& path, const QString& after, int limit, QStringList& fileIds,
+                                  QString& next) const {
+    fileIds.clear();
+    next.clear();
+    QStringList root = components(path);
+    QStringList cursor;
+    if (!after.isEmpty()) {
+        cursor = components(after);
+        if (cursor.size() <= root.size() || cursor.mid(0, root.size()) != root)
+            return false;
+        cursor = cursor.mid(root.size());
+    }
+
+    QReadLocker locker(&m_lock);
+    const Directory* dir = findDirectory(root);
+    if (!dir)
+        return false;
+    if (!collect(dir, cursor, 0, limit, fileIds))
+        next = fileIds.last();
+    return true;
+}
+
+// Appends files under dir in listing order, starting after the file at
+// cursor[depth...] when the cursor reaches this far. Returns false once the
+// page is full and more files remain.
+bool NamespaceTree::collect(const Directory* dir, const QStringList& cursor, int depth, int limit, QStringList& out) {
+    int remaining = cursor.size() - depth;
+    // the cursor's own directory: resume after its file; an ancestor: its files were all listed
+    auto file = remaining == 1 ? dir->files.upperBound(cursor[depth])
+                               : remaining > 1 ? dir->files.constEnd() : dir->files.constBegin();
+    for (; file != dir->files.constEnd(); ++file) {
+        if (out.size() == limit)
+            return false;
+        out.append(file.value());
+    }
+
+    auto sub = dir->subdirs.constBegin();
+    if (remaining > 1) {
+        sub = dir->subdirs.lowerBound(cursor[depth]);
+        if (sub != dir->subdirs.constEnd() && sub.key() == cursor[depth]) {
+            if (!collect(sub.value(), cursor, depth + 1, limit, out))
+                return false;
+            ++sub;
+        }
+    }
+    for (; sub != dir->subdirs.constEnd(); ++sub) {
+        if (!collect(sub.value(), QStringList(), 0, limit, out))
+            return false;
+    }
+    return true;
+}
+
+QStringList NamespaceTree::leafDirectories() const {
+    QStringList paths;
+    QReadLocker locker(&m_lock);
+    for (auto it = m_root.subdirs.constBegin(); it != m_root.subdirs.constEnd(); ++it)
+        collectLeaves(it.value(), '/' + it.key(), paths);
+    return paths;
+}
+
+void NamespaceTree::collectLeaves(const Directory* dir, const QString& path, QStringList& out) {
+    if (dir->subdirs.isEmpty()) {
+        out.append(path);
+        return;
+    }
+    for (auto it = dir->subdirs.constBegin(); it != dir->subdirs.constEnd(); ++it)
+        collectLeaves(it.value(), path + '/' + it.key(), out);
+}
@@ -0,0 +1,67 @@
+#ifndef NAMESPACETREE_H
+#define NAMESPACETREE_H
+
+#include <QMap>
+#include <QReadWriteLock>
+#include <QString>
+#include <QStringList>
+
+// Directory tree over file IDs, which are '/'-separated paths such as
+// "a.bin" or "datasets/2026/a.bin". Empty components are ignored, so
+// "/a//b" and "a/b" name the same entry; the master only accepts new file
+// IDs in canonical form so each entry maps to exactly one stored file.
+// Each directory keeps its files and subdirectories in name order; listing
+// a directory or a whole subtree costs O(depth * log fanout + entries
+// returned), whatever the namespace size. Parent directories of a file are
+// created with it. Thread-safe.
+class NamespaceTree {
+public:
+    NamespaceTree() = default;
+    ~NamespaceTree();
+    NamespaceTree(const NamespaceTree&) = delete;
+    NamespaceTree& operator=(const NamespaceTree&) = delete;
+
+    static QStringList components(const QString& path);
+    // the path without empty components, e.g. "a/b" for "/a//b/"
+    static QString canonical(const QString& path);
+
+    void addFile(const QString& fileId);
+    // directories the file leaves empty are kept
+    void removeFile(const QString& fileId);
+    // creates the directory and its parents; false if it already existed
+    bool mkdir(const QString& path);
+    bool isDirectory(const QString& path) const;
+
+    // Up to limit immediate children of path, in name order with a file
+    // sorting before a directory of the same name. Directories end in '/'.
+    // Listing resumes after the entry `after`; next is the entry to pass
+    // for the following page, or empty on the last one. False if path is
+    // not a directory.
+    bool list(const QString& path, const QString& after, int limit, QStringList& entries, QString& next) const;
+    // Up to limit file IDs anywhere under path: each directory's files in
+    // name order, then its subdirectories. `after` is the last file ID of
+    // the previous page and must lie under path.
+    bool listRecursive(const QString& path, const QString& after, int limit, QStringList& fileIds,
+                       QString& next) const;
+
+    // directories without subdirectories, as "/a/b"; recreating these
+    // recreates the whole tree
+    QStringList leafDirectories() const;
+
+private:
+    struct Directory {
+        QMap<QString, Directory*> subdirs; // owned
+        QMap<QString, QString> files;      // name -> file ID as the client wrote it
+    };
+
+    const Directory* findDirectory(const QStringList& path) const;
+    Directory* makeDirectory(const QStringList& path, bool* created = nullptr);
+    static bool collect(const Directory* dir, const QStringList& cursor, int depth, int limit, QStringList& out);
+    static void collectLeaves(const Directory* dir, const QString& path, QStringList& out);
+    static void destroy(Directory* dir);
+
+    mutable QReadWriteLock m_lock;
+    Directory m_root;
+};
+
+#endif // NAMESPACETREE_H
@@ -0,0 +1,99 @@
+#include "placementpolicy.h"
+
+#include <QRandomGenerator>
+
+std::unique_ptr<PlacementPolicy> PlacementPolicy::create(const QString& name) {
+    if (name == "round-robin")
+        return std::make_unique<RoundRobinPlacement>();
+    if (name == "least-loaded")
+        return std::make_unique<LeastLoadedPlacement>();
+    if (name == "power-of-two")
+        return std::make_unique<PowerOfTwoPlacement>();
+    if (name == "capacity-weighted")
+        return std::make_unique<CapacityWeightedPlacement>();
+    if (name == "consistent-hash")
+        return std::make_unique<ConsistentHashPlacement>();
+    return nullptr;
+}
+
+QStringList PlacementPolicy::names() {
+    return {"round-robin", "least-loaded", "power-of-two", "capacity-weighted", "consistent-hash"};
+}
+
+RoundRobinPlacement::RoundRobinPlacement() : m_next(QRandomGenerator::global()->generate()) {}
+
+int RoundRobinPlacement::pick(const QVector<int>& candidates, const ChunkServerMonitor& monitor) {
+    Q_UNUSED(monitor);
+    return candidates[m_next.fetch_add(1, std::memory_order_relaxed) % quint32(candidates.size())];
+}
+
+int LeastLoadedPlacement::pick(const QVector<int>& candidates, const ChunkServerMonitor& monitor) {
+    int best = candidates.first();
+    double bestLoad = monitor.load(best);
+    for (int i = 1; i < candidates.size(); ++i) {
+        double load = monitor.load(candidates[i]);
+        if (load < bestLoad) {
+            best = candidates[i];
+            bestLoad = load;
+        }
+    }
+    return best;
+}
+
+int PowerOfTwoPlacement::pick(const QVector<int>& candidates, const ChunkServerMonitor& monitor) {
+    QRandomGenerator* rng = QRandomGenerator::global();
+    int a = candidates[rng->bounded(candidates.size())];
+    if (candidates.size() == 1)
+        return a;
+    int b = a;
+    while (b == a)
+        b = candidates[rng->bounded(candidates.size())];
+    return monitor.load(b) < monitor.load(a) ? b : a;
+}
+
+int CapacityWeightedPlacement::pick(const QVector<int>& candidates, const ChunkServerMonitor& monitor) {
+    // servers that have not reported yet get the average known free space
+    QVector<double> weights(candidates.size(), -1);
+    double known = 0;
+    int knownCount = 0;
+    for (int i = 0; i < candidates.size(); ++i) {
+        ChunkServerStatus status;
+        if (monitor.status(candidates[i], &status) && status.capacityBytes > 0) {
+            weights[i] = double(status.freeBytes);
+            known += weights[i];
+            ++knownCount;
+        }
+    }
+    double fallback = knownCount ? known / knownCount : 1.0;
+
+    double total = 0;
+    for (double& w : weights) {
+        if (w < 0)
+            w = fallback;
+        total += w;
+    }
+    if (total <= 0)
+        return candidates[QRandomGenerator::global()->bounded(candidates.size())];
+
+    double target = QRandomGenerator::global()->generateDouble() * total;
+    for (int i = 0; i < candidates.size(); ++i) {
+        target -= weights[i];
+        if (target < 0)
+            return candidates[i];
+    }
+    return candidates.last();
+}
+
+// only reached for candidates without a known address
+int ConsistentHashPlacement::pick(const QVector<int>& candidates, const ChunkServerMonitor& monitor) {
+    Q_UNUSED(monitor);
+    return candidates[QRandomGenerator::global()->bounded(candidates.size())];
+}
+
+QVector<int> ConsistentHashPlacement::placeByKey(const QString& chunkId, int replication,
+                                                 const QVector<HashRing::Member>& members) {
+    QMutexLocker locker(&m_lock);
+    if (m_ring.members() != members)
+        m_ring.setMembers(members);
+    return m_ring.locate(chunkId.toUtf8(), replication);
+}
@@ -0,0 +1,85 @@
+#ifndef PLACEMENTPOLICY_H
+#define PLACEMENTPOLICY_H
+
+#include <QMutex>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <atomic>
+#include <memory>
+
+#include "chunkservermonitor.h"
+#include "hashRing.h"
+
+// Chooses the chunk server for each newly allocated chunk. Candidates are
+// live chunk server ids in address order; pick() always returns one of them.
+// Master worker threads share one policy, so pick() must be thread-safe.
+class PlacementPolicy {
+public:
+    virtual ~PlacementPolicy() = default;
+    virtual QString name() const = 0;
+    virtual int pick(const QVector<int>& candidates, const ChunkServerMonitor& monitor) = 0;
+    // Policies that derive all replicas of a chunk from its ID return them at
+    // once, as indices into members (the addresses of the candidates, in
+    // order). An empty result means pick() is asked once per replica.
+    virtual QVector<int> placeByKey(const QString& chunkId, int replication, const QVector<HashRing::Member>& members) {
+        Q_UNUSED(chunkId);
+        Q_UNUSED(replication);
+        Q_UNUSED(members);
+        return {};
+    }
+
+    // nullptr for an unknown name
+    static std::unique_ptr<PlacementPolicy> create(const QString& name);
+    static QStringList names();
+};
+
+// consecutive candidates from a random start
+class RoundRobinPlacement : public PlacementPolicy {
+public:
+    RoundRobinPlacement();
+    QString name() const override { return "round-robin"; }
+    int pick(const QVector<int>& candidates, const ChunkServerMonitor& monitor) override;
+
+private:
+    std::atomic<quint32> m_next;
+};
+
+class LeastLoadedPlacement : public PlacementPolicy {
+public:
+    QString name() const override { return "least-loaded"; }
+    int pick(const QVector<int>& candidates, const ChunkServerMonitor& monitor) override;
+};
+
+// least loaded of two random candidates; avoids herding onto the single
+// server that looked idlest in the last round of heartbeats
+class PowerOfTwoPlacement : public PlacementPolicy {
+public:
+    QString name() const override { return "power-of-two"; }
+    int pick(const QVector<int>& candidates, const ChunkServerMonitor& monitor) override;
+};
+
+// random choice weighted by free disk space
+class CapacityWeightedPlacement : public PlacementPolicy {
+public:
+    QString name() const override { return "capacity-weighted"; }
+    int pick(const QVector<int>& candidates, const ChunkServerMonitor& monitor) override;
+};
+
+// chunks go to the owners of their ID on a consistent-hash ring of the
+// live servers, so membership changes move about 1/N of the chunks and
+// clients holding the ring can locate a chunk without asking the master.
+// The ring knows nothing of failure domains: all replicas come from
+// placeByKey(), so the topology never spreads them.
+class ConsistentHashPlacement : public PlacementPolicy {
+public:
+    QString name() const override { return "consistent-hash"; }
+    int pick(const QVector<int>& candidates, const ChunkServerMonitor& monitor) override;
+    QVector<int> placeByKey(const QString& chunkId, int replication, const QVector<HashRing::Member>& members) override;
+
+private:
+    QMutex m_lock; // m_ring is rebuilt when the live membership changes
+    HashRing m_ring;
+};
+
+#endif // PLACEMENTPOLICY_H
@@ -0,0 +1,387 @@
+#include "rebalancer.h"
+
+#include <QDebug>
+#include <climits>
+
+Rebalancer::Rebalancer(MetadataStore& store, MetadataJournal* journal, ChunkServerMonitor* monitor,
+                       const Topology& topology, QObject* parent)
+    : QObject(parent), m_store(store), m_journal(journal), m_monitor(monitor), m_topology(topology) {
+    m_clock.start();
+    m_timer = new QTimer(this);
+    m_timer->setInterval(TICK_MS);
+    connect(m_timer, &QTimer::timeout, this, &Rebalancer::tick);
+}
+
+void Rebalancer::setBandwidth(qint64 bytesPerSecond) {
+    m_bandwidth = qMax<qint64>(0, bytesPerSecond);
+    m_tokens = 0;
+    updateTimer();
+}
+
+void Rebalancer::setRepairBandwidth(qint64 bytesPerSecond) {
+    m_repairBandwidth = qMax<qint64>(0, bytesPerSecond);
+    m_repairTokens = 0;
+    updateTimer();
+}
+
+void Rebalancer::updateTimer() {
+    if (m_bandwidth > 0 || m_repairBandwidth > 0)
+        m_timer->start();
+    else
+        m_timer->stop();
+}
+
+void Rebalancer::serverDown(int serverId) {
+    ChunkServerStatus status;
+    if (!m_monitor->status(serverId, &status) || status.server == ServerTable::NO_SERVER)
+        return;
+    if (!m_lostServers.contains(status.server))
+        m_lostServers.insert(status.server, m_clock.elapsed());
+}
+
+// chunks queued for it are dropped as they come up; its inventory report
+// brings back any location a repair already replaced, and those extra
+// replicas are trimmed once it is in
+void Rebalancer::serverUp(int serverId) {
+    ChunkServerStatus status;
+    if (!m_monitor->status(serverId, &status))
+        return;
+    m_lostServers.remove(status.server);
+    if (m_repairing.remove(status.server))
+        qInfo() << "Chunk server" << serverId << "is back, no longer repairing its chunks";
+    if (m_repaired.contains(status.server)) {
+        quint16 server = status.server;
+        QTimer::singleShot(TRIM_DELAY_MS, this, [this, serverId, server]() { trimRepaired(serverId, server); });
+    }
+}
+
+// A server the metadata lists that never registered after a master restart
+// sends no heartbeats to miss, so it would never count as lost; once every
+// live server has had time to register, the rest are treated as lost since
+// startup.
+void Rebalancer::markUnreported() {
+    QSet<quint16> reported;
+    for (const ChunkServerStatus& status : m_monitor->servers()) {
+        if (status.alive)
+            reported.insert(status.server);
+    }
+    int marked = 0;
+    const int known = ServerTable::instance().size();
+    for (int server = 0; server < known; ++server) {
+        if (!reported.contains(quint16(server)) && !m_lostServers.contains(quint16(server))) {
+            m_lostServers.insert(quint16(server), 0);
+            ++marked;
+        }
+    }
+    if (marked > 0)
+        qWarning() << marked << "known chunk servers did not register after startup";
+}
+
+// Each chunk repaired while the server was away has one replica too many
+// if its inventory brought the old location back. The returned copy is the
+// one dropped: the replacement is already placed with the other replicas'
+// domains in mind.
+void Rebalancer::trimRepaired(int serverId, quint16 server) {
+    if (m_lostServers.contains(server))
+        return; // gone again; the entries wait for its next return
+    const QList<Repaired> repaired = m_repaired.take(server);
+    int trimmed = 0;
+    for (const Repaired& entry : repaired) {
+        FileMetadata metadata;
+        if (!m_store.lookup(entry.fileId, metadata) || entry.chunk >= metadata.chunkCount())
+            continue;
+        bool onServer = false;
+        bool onReplacement = false;
+        for (int r = 0; r < metadata.locationCount(entry.chunk); ++r) {
+            onServer |= metadata.location(entry.chunk, r) == server;
+            onReplacement |= metadata.location(entry.chunk, r) == entry.replacement;
+        }
+        QString chunkId = metadata.chunkId(entry.chunk);
+        if (!onServer || !onReplacement || m_migrations.contains(chunkId))
+            continue;
+        // with the replacement already listed this only drops the server
+        if (!m_journal->logMoveReplica(entry.fileId, entry.chunk, server, entry.replacement))
+            continue;
+        emit locationsChanged(entry.fileId);
+        removeLater(serverId, server, chunkId, entry.fileId, entry.chunk);
+        ++trimmed;
+    }
+    if (trimmed > 0)
+        qInfo() << "Dropped" << trimmed << "surplus replicas on returning chunk server" << serverId;
+}
+
+void Rebalancer::tick() {
+    qint64 now = m_clock.elapsed();
+    for (auto it = m_migrations.begin(); it != m_migrations.end();) {
+        if (now - it->started > COPY_TIMEOUT_MS) {
+            qWarning() << "Rebalancer: copy of" << it.key() << "timed out";
+            it = m_migrations.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+
+    // a second's worth of budget at most, so an idle spell does not turn into a burst
+    m_tokens = qMin(m_tokens + m_bandwidth * TICK_MS / 1000, m_bandwidth);
+    m_repairTokens = qMin(m_repairTokens + m_repairBandwidth * TICK_MS / 1000, m_repairBandwidth);
+
+    if (!m_startupChecked && now >= STARTUP_GRACE_MS) {
+        m_startupChecked = true;
+        markUnreported();
+    }
+    // a lost server past its grace period restarts the scan so its chunks are covered too
+    for (auto it = m_lostServers.constBegin(); it != m_lostServers.constEnd(); ++it) {
+        if (now - it.value() >= REPAIR_GRACE_MS && !m_repairing.contains(it.key())) {
+            m_repairing.insert(it.key());
+            m_repairScan = true;
+            m_repairCursor.clear();
+            m_unrecoverable = 0;
+            qWarning() << "Chunk server" << ServerTable::instance().at(it.key()).port
+                       << "lost, re-replicating its chunks";
+        }
+    }
+
+    const QList<ChunkServerStatus> servers = m_monitor->servers();
+    if (m_repairBandwidth > 0) {
+        scanForRepairs();
+        dispatchRepairs(servers, now);
+    }
+    if (m_bandwidth > 0)
+        rebalance(servers, now);
+}
+
+void Rebalancer::scanForRepairs() {
+    if (!m_repairScan)
+        return;
+    QStringList fileIds;
+    QString next;
+    if (!m_store.tree().listRecursive("/", m_repairCursor, REPAIR_SCAN_FILES, fileIds, next))
+        fileIds.clear();
+    m_repairCursor = next;
+
+    for (const QString& fileId : fileIds) {
+        FileMetadata metadata;
+        if (!m_store.lookup(fileId, metadata))
+            continue;
+        for (int i = 0; i < metadata.chunkCount(); ++i) {
+            int live = 0;
+            quint16 lost = ServerTable::NO_SERVER;
+            for (int r = 0; r < metadata.locationCount(i); ++r) {
+                if (m_repairing.contains(metadata.location(i, r)))
+                    lost = metadata.location(i, r);
+                else
+                    ++live;
+            }
+            QString chunkId = metadata.chunkId(i);
+            if (lost == ServerTable::NO_SERVER || m_queuedRepairs.contains(chunkId) || m_migrations.contains(chunkId))
+                continue;
+            if (live == 0) {
+                ++m_unrecoverable;
+                continue;
+            }
+            m_repairs[live].enqueue(Repair{chunkId, fileId, i, lost});
+            m_queuedRepairs.insert(chunkId);
+        }
+    }
+
+    if (next.isEmpty()) {
+        m_repairScan = false;
+        qInfo() << "Repair scan done:" << m_queuedRepairs.size() << "chunks to re-replicate,"
+                << m_unrecoverable << "without a live replica";
+    }
+}
+
+// fewest live replicas first; each copy goes from the first surviving replica
+// to a live server that does not hold the chunk yet: of those sharing the
+// fewest failure domains with the surviving replicas, the emptiest
+void Rebalancer::dispatchRepairs(const QList<ChunkServerStatus>& servers, qint64 now) {
+    QHash<quint16, const ChunkServerStatus*> byServer;
+    for (const ChunkServerStatus& status : servers) {
+        if (status.alive && status.server != ServerTable::NO_SERVER)
+            byServer.insert(status.server, &status);
+    }
+
+    while (m_repairTokens > 0 && m_migrations.size() < MAX_MIGRATIONS && !m_repairs.isEmpty()) {
+        auto bucket = m_repairs.begin();
+        Repair repair = bucket->dequeue();
+        if (bucket->isEmpty())
+            m_repairs.erase(bucket);
+        const QString& chunkId = repair.chunkId;
+        m_queuedRepairs.remove(chunkId);
+        FileMetadata metadata;
+        if (!m_repairing.contains(repair.lost) || m_migrations.contains(chunkId)
+            || !m_store.lookup(repair.fileId, metadata) || repair.chunk >= metadata.chunkCount())
+            continue;
+
+        const ChunkServerStatus* source = nullptr;
+        bool stillLost = false;
+        QSet<quint16> holders;
+        QVector<quint16> survivors;
+        for (int r = 0; r < metadata.locationCount(repair.chunk); ++r) {
+            quint16 server = metadata.location(repair.chunk, r);
+            holders.insert(server);
+            stillLost |= server == repair.lost;
+            if (byServer.contains(server)) {
+                survivors.append(server);
+                if (!source)
+                    source = byServer.value(server);
+            }
+        }
+        const ChunkServerStatus* target = nullptr;
+        int targetShared = INT_MAX;
+        for (const ChunkServerStatus* candidate : byServer) {
+            if (holders.contains(candidate->server))
+                continue;
+            int shared = m_topology.closestShared(candidate->server, survivors);
+            if (!target || shared < targetShared
+                || (shared == targetShared && utilisation(*candidate) < utilisation(*target))) {
+                target = candidate;
+                targetShared = shared;
+            }
+        }
+        if (!stillLost || !source || !target) {
+            if (stillLost)
+                qWarning() << "Cannot re-replicate" << chunkId << ": no live source or spare server";
+            continue;
+        }
+
+        Migration migration{repair.fileId, repair.chunk, source->serverId, repair.lost, target->server, metadata.chunkSize, now, true};
+        m_migrations.insert(chunkId, migration);
+        m_repairTokens -= migration.bytes;
+        emit replicate(migration.sourceId, chunkId, migration.target);
+    }
+}
+
+// Deletes a replica the metadata no longer lists once readers holding older
+// metadata are done with it. The file may have been re-uploaded, or the
+// server's inventory re-reported, meanwhile; if the chunk lists the server
+// again by then, that copy is in use and stays.
+void Rebalancer::removeLater(int serverId, quint16 server, const QString& chunkId, const QString& fileId, int chunk) {
+    QTimer::singleShot(DELETE_GRACE_MS, this, [this, serverId, server, chunkId, fileId, chunk]() {
+        FileMetadata metadata;
+        if (m_store.lookup(fileId, metadata) && chunk < metadata.chunkCount()) {
+            for (int r = 0; r < metadata.locationCount(chunk); ++r) {
+                if (metadata.location(chunk, r) == server)
+                    return;
+            }
+        }
+        emit removeReplica(serverId, chunkId);
+    });
+}
+
+// disk in use, counting copies already heading to the server
+double Rebalancer::utilisation(const ChunkServerStatus& status) const {
+    if (status.capacityBytes <= 0)
+        return 1.0;
+    qint64 incoming = 0;
+    for (const Migration& migration : m_migrations) {
+        if (migration.target == status.server)
+            incoming += migration.bytes;
+    }
+    return double(status.capacityBytes - status.freeBytes + incoming) / double(status.capacityBytes);
+}
+
+void Rebalancer::rebalance(const QList<ChunkServerStatus>& servers, qint64 now) {
+    if (m_tokens <= 0 || m_migrations.size() >= MAX_MIGRATIONS)
+        return;
+
+    const ChunkServerStatus* fullest = nullptr;
+    const ChunkServerStatus* emptiest = nullptr;
+    double highest = 0;
+    double lowest = 0;
+    for (const ChunkServerStatus& status : servers) {
+        if (!status.alive || status.capacityBytes <= 0 || status.server == ServerTable::NO_SERVER)
+            continue;
+        double used = utilisation(status);
+        if (!fullest || used > highest) {
+            fullest = &status;
+            highest = used;
+        }
+        if (!emptiest || used < lowest) {
+            emptiest = &status;
+            lowest = used;
+        }
+    }
+    if (!fullest || fullest == emptiest || highest - lowest < MIN_SPREAD)
+        return;
+
+    QStringList fileIds;
+    QString next;
+    if (!m_store.tree().listRecursive("/", m_cursor, SCAN_FILES, fileIds, next))
+        fileIds.clear();
+    m_cursor = next; // wraps to the start after the last page
+
+    for (const QString& fileId : fileIds) {
+        FileMetadata metadata;
+        if (!m_store.lookup(fileId, metadata))
+            continue;
+        for (int i = 0; i < metadata.chunkCount(); ++i) {
+            if (m_tokens <= 0 || m_migrations.size() >= MAX_MIGRATIONS)
+                return;
+            bool onSource = false;
+            bool onTarget = false;
+            QVector<quint16> others;
+            for (int r = 0; r < metadata.locationCount(i); ++r) {
+                quint16 server = metadata.location(i, r);
+                onSource |= server == fullest->server;
+                onTarget |= server == emptiest->server;
+                if (server != fullest->server)
+                    others.append(server);
+            }
+            QString chunkId = metadata.chunkId(i);
+            if (!onSource || onTarget || m_migrations.contains(chunkId))
+                continue;
+            // evening out disk use must not put two replicas in one domain
+            if (m_topology.closestShared(emptiest->server, others) > m_topology.closestShared(fullest->server, others))
+                continue;
+
+            Migration migration{fileId, i, fullest->serverId, fullest->server, emptiest->server, metadata.chunkSize, now};
+            m_migrations.insert(chunkId, migration);
+            m_tokens -= migration.bytes;
+            emit replicate(migration.sourceId, chunkId, migration.target);
+        }
+    }
+}
+
+void Rebalancer::copyFinished(const QString& chunkId, quint16 target, bool ok) {
+    auto it = m_migrations.find(chunkId);
+    if (it == m_migrations.end() || it->target != target)
+        return;
+    Migration migration = it.value();
+    m_migrations.erase(it);
+    if (!ok) {
+        qWarning() << "Rebalancer: copy of" << chunkId << "failed";
+        // a repair goes back in line by the replicas it has left now
+        FileMetadata metadata;
+        if (migration.repair && m_repairing.contains(migration.source) && !m_queuedRepairs.contains(chunkId)
+            && m_store.lookup(migration.fileId, metadata) && migration.chunk < metadata.chunkCount()) {
+            int live = 0;
+            for (int r = 0; r < metadata.locationCount(migration.chunk); ++r) {
+                if (!m_repairing.contains(metadata.location(migration.chunk, r)))
+                    ++live;
+            }
+            if (live > 0) {
+                m_repairs[live].enqueue(Repair{chunkId, migration.fileId, migration.chunk, migration.source});
+                m_queuedRepairs.insert(chunkId);
+            }
+        }
+        return;
+    }
+
+    int sourceId = migration.sourceId;
+    std::function<void()> onDurable;
+    if (!migration.repair) {
+        onDurable = [this, sourceId, chunkId, migration]() {
+            removeLater(sourceId, migration.source, chunkId, migration.fileId, migration.chunk);
+        };
+    }
+    if (!m_journal->logMoveReplica(migration.fileId, migration.chunk, migration.source, migration.target, this, onDurable)) {
+        qWarning() << "Rebalancer:" << chunkId << "is no longer on the replica it was to replace";
+        return;
+    }
+    if (migration.repair)
+        m_repaired[migration.source].append(Repaired{migration.fileId, migration.chunk, migration.target});
+    emit locationsChanged(migration.fileId);
+    qDebug() << (migration.repair ? "Re-replicated" : "Rebalanced") << chunkId << "from server" << sourceId;
+}
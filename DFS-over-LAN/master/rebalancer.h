@@ -0,0 +1,137 @@
+#ifndef REBALANCER_H
+#define REBALANCER_H
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QMap>
+#include <QObject>
+#include <QQueue>
+#include <QSet>
+#include <QString>
+#include <QTimer>
+
+#include "chunkservermonitor.h"
+#include "metadatajournal.h"
+#include "metadatastore.h"
+#include "topology.h"
+
+// Moves replicas between chunk servers, for two reasons:
+//
+// Repair: once a chunk server has missed heartbeats for REPAIR_GRACE_MS,
+// or has not reported at all STARTUP_GRACE_MS after the master started,
+// the namespace is scanned for chunks it held and each is queued by how
+// many live replicas it has left, fewest first. A surviving replica is
+// copied to the emptiest live server among those sharing the fewest
+// failure domains with the other live replicas, and the copy takes the
+// lost replica's place. Should the lost server come back, its copies of
+// repaired chunks are surplus and are dropped once its inventory is in.
+//
+// Rebalancing: every tick walks the next slice of the namespace for chunks
+// on the fullest live server and moves them to the emptiest one, while
+// their disk utilisation differs by MIN_SPREAD or more. A chunk only moves
+// if the target shares no more failure domains with its other replicas than
+// the source did. The old copy is deleted after a grace period, unless the
+// chunk lists the source again by then.
+//
+// Copies run chunk server to chunk server, each kind within its own
+// bandwidth budget, and a location is only switched (in one WAL record,
+// revoking leases) once the target has ACKed the whole chunk. Lives on the
+// master's main thread; report calls from workers are posted to it.
+class Rebalancer : public QObject {
+    Q_OBJECT
+public:
+    Rebalancer(MetadataStore& store, MetadataJournal* journal, ChunkServerMonitor* monitor, const Topology& topology,
+               QObject* parent = nullptr);
+
+    // bytes per second spent on rebalancing copies, 0 to stop rebalancing
+    void setBandwidth(qint64 bytesPerSecond);
+    // bytes per second spent restoring lost replicas, 0 to stop repairs
+    void setRepairBandwidth(qint64 bytesPerSecond);
+    // the source server's REPLICATED report for a copy to target
+    void copyFinished(const QString& chunkId, quint16 target, bool ok);
+
+public slots:
+    void serverDown(int serverId);
+    void serverUp(int serverId);
+
+signals:
+    // the chunk server answers with "REPLICATED <chunkId> <ip> <port> <ok>"
+    void replicate(int serverId, const QString& chunkId, quint16 target);
+    void removeReplica(int serverId, const QString& chunkId);
+    void locationsChanged(const QString& fileId);
+
+private slots:
+    void tick();
+
+private:
+    friend class RebalancerTest; // ages lost servers instead of waiting out the grace periods
+
+    struct Migration {
+        QString fileId;
+        int chunk = 0;
+        int sourceId = -1;                        // chunk server doing the copy
+        quint16 source = ServerTable::NO_SERVER;  // replica the copy replaces
+        quint16 target = ServerTable::NO_SERVER;
+        qint64 bytes = 0;
+        qint64 started = 0;
+        bool repair = false; // the replaced replica is lost, nothing to delete
+    };
+
+    struct Repair {
+        QString chunkId;
+        QString fileId;
+        int chunk = 0;
+        quint16 lost = ServerTable::NO_SERVER;
+    };
+
+    struct Repaired {
+        QString fileId;
+        int chunk = 0;
+        quint16 replacement = ServerTable::NO_SERVER;
+    };
+
+    void scanForRepairs();
+    void dispatchRepairs(const QList<ChunkServerStatus>& servers, qint64 now);
+    void rebalance(const QList<ChunkServerStatus>& servers, qint64 now);
+    double utilisation(const ChunkServerStatus& status) const;
+    void removeLater(int serverId, quint16 server, const QString& chunkId, const QString& fileId, int chunk);
+    void markUnreported();
+    void trimRepaired(int serverId, quint16 server);
+    void updateTimer();
+
+    MetadataStore& m_store;
+    MetadataJournal* m_journal;
+    ChunkServerMonitor* m_monitor;
+    const Topology& m_topology;
+    QTimer* m_timer;
+    QElapsedTimer m_clock;
+    qint64 m_bandwidth = 0;
+    qint64 m_tokens = 0;  // bytes that may still be sent; goes negative after a large chunk
+    QString m_cursor;     // last file scanned, empty to start over
+    QHash<QString, Migration> m_migrations; // chunkId -> copy in flight
+
+    qint64 m_repairBandwidth = 0;
+    qint64 m_repairTokens = 0;
+    QHash<quint16, qint64> m_lostServers; // server -> when its heartbeats stopped
+    QSet<quint16> m_repairing;            // lost servers past the grace period
+    bool m_repairScan = false;
+    QString m_repairCursor;
+    int m_unrecoverable = 0;              // chunks found with no live replica in this scan
+    QMap<int, QQueue<Repair>> m_repairs;  // live replicas left -> chunks to repair
+    QSet<QString> m_queuedRepairs;        // chunkIds in m_repairs
+    QHash<quint16, QList<Repaired>> m_repaired; // lost server -> chunks re-replicated elsewhere
+    bool m_startupChecked = false;
+
+    static constexpr int TICK_MS = 1000;
+    static constexpr int SCAN_FILES = 256;          // files examined per tick when rebalancing
+    static constexpr int REPAIR_SCAN_FILES = 4096;  // and when looking for lost replicas
+    static constexpr int MAX_MIGRATIONS = 64;       // copies in flight
+    static constexpr double MIN_SPREAD = 0.10;      // utilisation gap worth moving data for
+    static constexpr int COPY_TIMEOUT_MS = 60000;
+    static constexpr int DELETE_GRACE_MS = 15000;   // readers with older metadata finish first
+    static constexpr int REPAIR_GRACE_MS = 30000;   // a restarting server keeps its chunks
+    static constexpr int STARTUP_GRACE_MS = 60000;  // for every known server to register after a master restart
+    static constexpr int TRIM_DELAY_MS = 30000;     // for a returning server's inventory to be recorded
+};
+
+#endif // REBALANCER_H
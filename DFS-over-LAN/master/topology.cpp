@@ -0,0 +1,135 @@
+#include "topology.h"
+
+#include <QDebug>
+#include <QFile>
+#include <QTextStream>
+#include <climits>
+
+#include "metadata.h"
+
+void Topology::setTree(const QHash<int, QList<int>>& tree, int basePort) {
+    m_servers.clear();
+    m_ports.clear();
+    QHash<int, int> parent;
+    for (auto it = tree.constBegin(); it != tree.constEnd(); ++it)
+        for (int child : it.value())
+            parent.insert(child, it.key());
+    for (auto it = tree.constBegin(); it != tree.constEnd(); ++it) {
+        QStringList location;
+        for (int node = it.key();; node = parent.value(node)) {
+            location.prepend(QString::number(node));
+            if (!parent.contains(node))
+                break;
+        }
+        m_ports.insert(quint16(it.key() + basePort), location);
+    }
+}
+
+bool Topology::load(const QString& path) {
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
+        qWarning() << "Cannot open topology file" << path;
+        return false;
+    }
+
+    QHash<QString, QStringList> servers;
+    QHash<quint16, QStringList> ports;
+    QList<QPair<QPair<QHostAddress, int>, QStringList>> clients;
+    QTextStream in(&file);
+    for (int lineNumber = 1; !in.atEnd(); ++lineNumber) {
+        QString line = in.readLine();
+        line = line.left(line.indexOf('#')).trimmed();
+        if (line.isEmpty())
+            continue;
+        QStringList fields = line.split(' ', Qt::SkipEmptyParts);
+        QStringList location = fields.size() == 3 ? fields[2].split('/', Qt::SkipEmptyParts) : QStringList();
+        bool ok = !location.isEmpty();
+        if (ok && fields[0] == "server") {
+            int colon = fields[1].lastIndexOf(':');
+            quint16 port = fields[1].mid(colon + 1).toUShort(&ok);
+            if (ok && colon < 0) {
+                ports.insert(port, location);
+            }
+            else if (ok) {
+                QString host = fields[1].left(colon);
+                if (host.startsWith('[') && host.endsWith(']'))
+                    host = host.mid(1, host.size() - 2);
+                QHostAddress address(host);
+                ok = !address.isNull();
+                servers.insert(addressKey(address, port), location);
+            }
+        }
+        else if (ok && fields[0] == "client") {
+            QPair<QHostAddress, int> subnet = QHostAddress::parseSubnet(fields[1]);
+            ok = !subnet.first.isNull();
+            clients.append({subnet, location});
+        }
+        else {
+            ok = false;
+        }
+        if (!ok) {
+            qWarning() << "Invalid topology entry at" << path << "line" << lineNumber << ":" << line;
+            return false;
+        }
+    }
+
+    m_servers = servers;
+    m_ports = ports;
+    m_clients = clients;
+    qInfo() << "Topology:" << servers.size() + ports.size() << "chunk servers," << clients.size() << "client subnets";
+    return true;
+}
+
+// servers registered under a hostname are only found by port
+QStringList Topology::serverLocation(quint16 server) const {
+    if (server == ServerTable::NO_SERVER)
+        return QStringList();
+    const ChunkServerInfo& info = ServerTable::instance().at(server);
+    QHostAddress address(info.ip);
+    if (!address.isNull()) {
+        auto it = m_servers.constFind(addressKey(address, info.port));
+        if (it != m_servers.constEnd())
+            return it.value();
+    }
+    return m_ports.value(info.port);
+}
+
+int Topology::closestShared(quint16 server, const QVector<quint16>& others) const {
+    QStringList location = serverLocation(server);
+    int shared = -1;
+    for (quint16 other : others)
+        shared = qMax(shared, sharedDepth(location, serverLocation(other)));
+    return shared;
+}
+
+QString Topology::addressKey(const QHostAddress& address, quint16 port) {
+    // IPv4-mapped and plain IPv4 spellings name the same server
+    bool isV4 = false;
+    quint32 ipv4 = address.toIPv4Address(&isV4);
+    return (isV4 ? QHostAddress(ipv4) : address).toString() + ":" + QString::number(port);
+}
+
+QStringList Topology::clientLocation(const QHostAddress& address) const {
+    // clients reaching a dual-stack listener show up as IPv4-mapped addresses
+    bool isV4 = false;
+    quint32 ipv4 = address.toIPv4Address(&isV4);
+    QHostAddress peer = isV4 ? QHostAddress(ipv4) : address;
+    for (const auto& entry : m_clients)
+        if (peer.isInSubnet(entry.first))
+            return entry.second;
+    return QStringList();
+}
+
+int Topology::sharedDepth(const QStringList& a, const QStringList& b) {
+    int depth = 0;
+    while (depth < a.size() && depth < b.size() && a[depth] == b[depth])
+        ++depth;
+    return depth;
+}
+
+int Topology::distance(const QStringList& a, const QStringList& b) {
+    if (a.isEmpty() || b.isEmpty())
+        return INT_MAX;
+    int shared = sharedDepth(a, b);
+    return int(a.size() - shared) + int(b.size() - shared);
+}
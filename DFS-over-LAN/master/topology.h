@@ -0,0 +1,45 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <QHash>
+#include <QHostAddress>
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+// Failure and bandwidth domains of the chunk servers, outermost first (say
+// rack, then host). Servers sharing a longer prefix fail together and talk
+// cheaply, so reads go to the replica nearest the client, and policies that
+// pick replicas one at a time spread them across domains (consistent-hash
+// takes the ring's owners as they are). Without a topology file chunkServerTree is the
+// hierarchy: a server sits below each of its ancestors. Set up before the
+// master starts serving and read-only afterwards, so it needs no lock.
+class Topology {
+public:
+    void setTree(const QHash<int, QList<int>>& tree, int basePort);
+    // lines of "server <ip>:<port> <domain>/<domain>/..." and
+    // "client <subnet> <domain>/...", '#' starting a comment; replaces the tree.
+    // "server <port> ..." matches that port on any address.
+    bool load(const QString& path);
+
+    // by ServerTable index; empty when unknown
+    QStringList serverLocation(quint16 server) const;
+    QStringList clientLocation(const QHostAddress& address) const;
+    // the most domains server shares with any of others, -1 if others is empty
+    int closestShared(quint16 server, const QVector<quint16>& others) const;
+
+    static int sharedDepth(const QStringList& a, const QStringList& b);
+    // hops up to the common domain and back down; unknown locations are far from everything
+    static int distance(const QStringList& a, const QStringList& b);
+
+private:
+    static QString addressKey(const QHostAddress& address, quint16 port);
+
+    QHash<QString, QStringList> m_servers; // chunk server "ip:port" -> location
+    QHash<quint16, QStringList> m_ports; // chunk server port on any address -> location
+    QList<QPair<QPair<QHostAddress, int>, QStringList>> m_clients; // client subnet -> location
+};
+
+#endif // TOPOLOGY_H
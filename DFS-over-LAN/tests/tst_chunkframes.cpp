@@ -0,0 +1,80 @@
+#include <QtTest>
+
+#include "chunkFrames.h"
+
+class ChunkFramesTest : public QObject {
+    Q_OBJECT
+private slots:
+    void frameCounts();
+    void reassemblesOutOfOrder();
+    void rejectsFramesThatDoNotFit();
+    void missingFramesLimit();
+    void frameLists();
+};
+
+void ChunkFramesTest::frameCounts() {
+    QCOMPARE(frameCount(0), 1);
+    QCOMPARE(frameCount(1), 1);
+    QCOMPARE(frameCount(FRAME_PAYLOAD_SIZE), 1);
+    QCOMPARE(frameCount(FRAME_PAYLOAD_SIZE + 1), 2);
+}
+
+void ChunkFramesTest::reassemblesOutOfOrder() {
+    const int total = 2 * FRAME_PAYLOAD_SIZE + 100;
+    QByteArray chunk(total, '\0');
+    for (int i = 0; i < total; ++i)
+        chunk[i] = char(i * 7);
+
+    FrameAssembly assembly(total);
+    QVERIFY(assembly.isEmpty());
+    QCOMPARE(assembly.totalLength(), total);
+
+    bool duplicate = true;
+    QVERIFY(assembly.addFrame(FRAME_PAYLOAD_SIZE, chunk.mid(FRAME_PAYLOAD_SIZE, FRAME_PAYLOAD_SIZE), &duplicate));
+    QVERIFY(!duplicate);
+    QVERIFY(!assembly.isEmpty());
+    QVERIFY(assembly.hasFrame(1));
+    QCOMPARE(assembly.missingFrames(), QList<int>({0, 2}));
+
+    QVERIFY(assembly.addFrame(FRAME_PAYLOAD_SIZE, chunk.mid(FRAME_PAYLOAD_SIZE, FRAME_PAYLOAD_SIZE), &duplicate));
+    QVERIFY(duplicate);
+
+    QVERIFY(assembly.addFrame(2 * FRAME_PAYLOAD_SIZE, chunk.mid(2 * FRAME_PAYLOAD_SIZE)));
+    QVERIFY(!assembly.isComplete());
+    QVERIFY(assembly.addFrame(0, chunk.left(FRAME_PAYLOAD_SIZE)));
+    QVERIFY(assembly.isComplete());
+    QVERIFY(assembly.missingFrames().isEmpty());
+    QCOMPARE(assembly.data(), chunk);
+}
+
+void ChunkFramesTest::rejectsFramesThatDoNotFit() {
+    const int total = FRAME_PAYLOAD_SIZE + 100;
+    FrameAssembly assembly(total);
+    QByteArray full(FRAME_PAYLOAD_SIZE, 'x');
+    QVERIFY(!assembly.addFrame(-FRAME_PAYLOAD_SIZE, full));
+    QVERIFY(!assembly.addFrame(1, full));                          // not on a frame boundary
+    QVERIFY(!assembly.addFrame(FRAME_PAYLOAD_SIZE, full));         // past the end
+    QVERIFY(!assembly.addFrame(FRAME_PAYLOAD_SIZE, QByteArray(99, 'x'))); // short last frame
+    QVERIFY(!assembly.addFrame(0, full.left(10)));                 // short middle frame
+    QVERIFY(assembly.isEmpty());
+    QVERIFY(!assembly.hasFrame(-1));
+    QVERIFY(!assembly.hasFrame(2));
+}
+
+void ChunkFramesTest::missingFramesLimit() {
+    FrameAssembly assembly(10 * FRAME_PAYLOAD_SIZE);
+    QCOMPARE(assembly.missingFrames(3), QList<int>({0, 1, 2}));
+    QCOMPARE(assembly.missingFrames().size(), qsizetype(10));
+}
+
+// the lists carried by NACK and selective RETRIEVE
+void ChunkFramesTest::frameLists() {
+    QCOMPARE(encodeFrameList({}), QString());
+    QCOMPARE(encodeFrameList({1, 5, 9}), QString("1,5,9"));
+    QCOMPARE(decodeFrameList("1,5,9"), QList<int>({1, 5, 9}));
+    QCOMPARE(decodeFrameList("1,x,-2,,3"), QList<int>({1, 3}));
+    QVERIFY(decodeFrameList(QString()).isEmpty());
+}
+
+QTEST_APPLESS_MAIN(ChunkFramesTest)
+#include "tst_chunkframes.moc"
@@ -0,0 +1,102 @@
+#include <QSignalSpy>
+#include <QtTest>
+
+#include "chunkservermonitor.h"
+#include "garbagecollector.h"
+#include "metadatastore.h"
+
+class GarbageCollectorTest : public QObject {
+    Q_OBJECT
+private slots:
+    void keepsReplicasInUseAgain();
+    void keepsReplicasOfReplacement();
+    void ignoresOrphansAtStartup();
+
+private:
+    static quint16 report(ChunkServerMonitor& monitor, int serverId);
+    static FileMetadata file(const QString& name, int chunks, const QVector<quint16>& replicas);
+    // serverId -> chunk IDs of every batch sent
+    static QHash<int, QSet<QString>> batches(const QSignalSpy& spy);
+};
+
+quint16 GarbageCollectorTest::report(ChunkServerMonitor& monitor, int serverId) {
+    ChunkServerStatus status;
+    status.serverId = serverId;
+    monitor.heartbeat(status, "10.0.4." + QString::number(serverId), quint16(5000 + serverId));
+    monitor.status(serverId, &status);
+    return status.server;
+}
+
+// every chunk on all of replicas
+FileMetadata GarbageCollectorTest::file(const QString& name, int chunks, const QVector<quint16>& replicas) {
+    FileMetadata metadata;
+    metadata.fileName = name;
+    metadata.chunkSize = 1024;
+    metadata.size = qint64(chunks) * metadata.chunkSize;
+    metadata.resize(chunks, replicas.size());
+    for (int i = 0; i < chunks; ++i) {
+        for (quint16 server : replicas)
+            metadata.addLocation(i, server);
+    }
+    return metadata;
+}
+
+QHash<int, QSet<QString>> GarbageCollectorTest::batches(const QSignalSpy& spy) {
+    QHash<int, QSet<QString>> sent;
+    for (const QList<QVariant>& arguments : spy) {
+        const QStringList chunkIds = arguments[1].toStringList();
+        sent[arguments[0].toInt()].unite(QSet<QString>(chunkIds.begin(), chunkIds.end()));
+    }
+    return sent;
+}
+
+// a file deleted and created anew before the batch goes out keeps the
+// replicas it lists again
+void GarbageCollectorTest::keepsReplicasInUseAgain() {
+    MetadataStore store;
+    ChunkServerMonitor monitor;
+    GarbageCollector collector(store, &monitor);
+    quint16 first = report(monitor, 1);
+    quint16 second = report(monitor, 2);
+    QSignalSpy spy(&collector, &GarbageCollector::deleteChunks);
+
+    collector.collect(file("f", 2, {first, second}));
+    store.insert(file("f", 1, {first}));
+
+    QTRY_COMPARE(spy.size(), 2);
+    QHash<int, QSet<QString>> sent = batches(spy);
+    QCOMPARE(sent.value(1), QSet<QString>({"f_chunk_1"}));
+    QCOMPARE(sent.value(2), QSet<QString>({"f_chunk_0", "f_chunk_1"}));
+}
+
+void GarbageCollectorTest::keepsReplicasOfReplacement() {
+    MetadataStore store;
+    ChunkServerMonitor monitor;
+    GarbageCollector collector(store, &monitor);
+    quint16 first = report(monitor, 1);
+    quint16 second = report(monitor, 2);
+    QSignalSpy spy(&collector, &GarbageCollector::deleteChunks);
+
+    FileMetadata replacement = file("g", 1, {first});
+    store.insert(replacement);
+    collector.collect(file("g", 1, {first, second}), replacement);
+
+    QTRY_COMPARE(spy.size(), 1);
+    QCOMPARE(batches(spy).value(2), QSet<QString>({"g_chunk_0"}));
+}
+
+// a restarted master may not know every file yet
+void GarbageCollectorTest::ignoresOrphansAtStartup() {
+    MetadataStore store;
+    ChunkServerMonitor monitor;
+    GarbageCollector collector(store, &monitor);
+    quint16 server = report(monitor, 1);
+    store.insert(file("h", 1, {server}));
+    QSignalSpy spy(&collector, &GarbageCollector::deleteChunks);
+
+    collector.collectOrphans(server, {"unknown_chunk_0"});
+    QVERIFY(!spy.wait(1500));
+}
+
+QTEST_GUILESS_MAIN(GarbageCollectorTest)
+#include "tst_garbagecollector.moc"
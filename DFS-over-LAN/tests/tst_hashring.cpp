@@ -0,0 +1,84 @@
+#include <QtTest>
+
+#include "hashRing.h"
+
+class HashRingTest : public QObject {
+    Q_OBJECT
+private slots:
+    void hashIsFixed();
+    void locateDistinctOwners();
+    void locateIgnoresMemberOrder();
+    void removingMemberMovesOnlyItsKeys();
+
+private:
+    static QVector<HashRing::Member> members(int count);
+};
+
+QVector<HashRing::Member> HashRingTest::members(int count) {
+    QVector<HashRing::Member> out;
+    for (int i = 0; i < count; ++i)
+        out.append({0x0A000001u + quint32(i), quint16(5000 + i)});
+    return out;
+}
+
+// clients and the master must agree, so the hash may never change
+void HashRingTest::hashIsFixed() {
+    QCOMPARE(HashRing::hash(QByteArray()), 2872998923u);
+    QCOMPARE(HashRing::hash("a.bin_chunk_0"), 837959214u);
+}
+
+void HashRingTest::locateDistinctOwners() {
+    HashRing ring;
+    QVERIFY(ring.locate("key", 3).isEmpty());
+
+    ring.setMembers(members(5));
+    for (int i = 0; i < 100; ++i) {
+        QVector<int> owners = ring.locate("file_chunk_" + QByteArray::number(i), 3);
+        QCOMPARE(owners.size(), qsizetype(3));
+        QCOMPARE(QSet<int>(owners.begin(), owners.end()).size(), qsizetype(3));
+    }
+    // never more owners than members
+    QCOMPARE(ring.locate("key", 8).size(), qsizetype(5));
+}
+
+void HashRingTest::locateIgnoresMemberOrder() {
+    QVector<HashRing::Member> forward = members(4);
+    QVector<HashRing::Member> backward(forward.rbegin(), forward.rend());
+    HashRing a;
+    HashRing b;
+    a.setMembers(forward);
+    b.setMembers(backward);
+    for (int i = 0; i < 100; ++i) {
+        QByteArray key = "file_chunk_" + QByteArray::number(i);
+        QVector<int> fromA = a.locate(key, 2);
+        QVector<int> fromB = b.locate(key, 2);
+        for (int r = 0; r < 2; ++r)
+            QVERIFY(a.members()[fromA[r]] == b.members()[fromB[r]]);
+    }
+}
+
+void HashRingTest::removingMemberMovesOnlyItsKeys() {
+    QVector<HashRing::Member> all = members(5);
+    HashRing before;
+    before.setMembers(all);
+    HashRing::Member removed = all.takeAt(2);
+    HashRing after;
+    after.setMembers(all);
+
+    int moved = 0;
+    const int keys = 1000;
+    for (int i = 0; i < keys; ++i) {
+        QByteArray key = "file_chunk_" + QByteArray::number(i);
+        HashRing::Member owner = before.members()[before.locate(key, 1).first()];
+        HashRing::Member now = after.members()[after.locate(key, 1).first()];
+        if (owner != removed)
+            QVERIFY(now == owner);
+        else
+            ++moved;
+    }
+    // about a fifth of the keys belonged to the removed member
+    QVERIFY(moved > keys / 10 && moved < keys * 3 / 10);
+}
+
+QTEST_APPLESS_MAIN(HashRingTest)
+#include "tst_hashring.moc"
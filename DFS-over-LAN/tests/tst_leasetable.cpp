@@ -0,0 +1,74 @@
+#include <QtTest>
+
+#include "leasetable.h"
+
+class LeaseTableTest : public QObject {
+    Q_OBJECT
+private slots:
+    void grantRenews();
+    void revokeReturnsLiveLeases();
+    void release();
+    void expire();
+};
+
+void LeaseTableTest::grantRenews() {
+    LeaseTable table(10000);
+    QObject holder;
+    QObject context;
+    table.grant("a", &holder, &context);
+    table.grant("a", &holder, &context);
+    QList<LeaseTable::Lease> leases = table.revoke("a");
+    QCOMPARE(leases.size(), 1);
+    QCOMPARE(leases.first().holder.data(), &holder);
+    QCOMPARE(leases.first().context, &context);
+}
+
+// leases of disconnected holders are dropped, and revoking empties the file's list
+void LeaseTableTest::revokeReturnsLiveLeases() {
+    LeaseTable table(10000);
+    QObject kept;
+    auto gone = new QObject;
+    table.grant("a", &kept, &kept);
+    table.grant("a", gone, gone);
+    table.grant("b", &kept, &kept);
+    delete gone;
+
+    QList<LeaseTable::Lease> leases = table.revoke("a");
+    QCOMPARE(leases.size(), 1);
+    QCOMPARE(leases.first().holder.data(), &kept);
+    QVERIFY(table.revoke("a").isEmpty());
+    QCOMPARE(table.revoke("b").size(), 1);
+}
+
+void LeaseTableTest::release() {
+    LeaseTable table(10000);
+    QObject first;
+    QObject second;
+    table.grant("a", &first, &first);
+    table.grant("a", &second, &second);
+    table.release("a", &first);
+    table.release("missing", &first);
+
+    QList<LeaseTable::Lease> leases = table.revoke("a");
+    QCOMPARE(leases.size(), 1);
+    QCOMPARE(leases.first().holder.data(), &second);
+}
+
+void LeaseTableTest::expire() {
+    LeaseTable live(10000);
+    QObject holder;
+    live.grant("a", &holder, &holder);
+    live.expire();
+    QCOMPARE(live.revoke("a").size(), 1);
+
+    // a duration that more than cancels the grace period: leases are over when granted
+    LeaseTable over(-10000);
+    over.grant("a", &holder, &holder);
+    QVERIFY(over.revoke("a").isEmpty());
+    over.grant("b", &holder, &holder);
+    over.expire();
+    QVERIFY(over.revoke("b").isEmpty());
+}
+
+QTEST_APPLESS_MAIN(LeaseTableTest)
+#include "tst_leasetable.moc"
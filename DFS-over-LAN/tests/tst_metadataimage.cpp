@@ -0,0 +1,100 @@
+#include <QTemporaryDir>
+#include <QtTest>
+
+#include "metadataimage.h"
+
+class MetadataImageTest : public QObject {
+    Q_OBJECT
+private slots:
+    void initTestCase();
+    void roundTrip();
+    void writeOverBase();
+
+private:
+    static quint16 server(int n);
+    static FileMetadata file(const QString& name, int chunks, int first);
+    QString path(const QString& name) const { return m_dir.filePath(name); }
+
+    QTemporaryDir m_dir;
+};
+
+void MetadataImageTest::initTestCase() {
+    QVERIFY(m_dir.isValid());
+    for (int n = 0; n < 3; ++n)
+        QVERIFY(server(n) != ServerTable::NO_SERVER);
+}
+
+quint16 MetadataImageTest::server(int n) {
+    return ServerTable::instance().intern("10.0.0." + QString::number(n % 3 + 1), quint16(5000 + n % 3));
+}
+
+// two replicas per chunk on consecutive servers, the first chunk's on
+// servers first and first + 1
+FileMetadata MetadataImageTest::file(const QString& name, int chunks, int first) {
+    FileMetadata metadata;
+    metadata.fileName = name;
+    metadata.chunkSize = 1024;
+    metadata.size = chunks > 0 ? qint64(chunks) * metadata.chunkSize - 10 : 0;
+    metadata.resize(chunks, 2);
+    for (int i = 0; i < chunks; ++i) {
+        metadata.addLocation(i, server(first + i));
+        metadata.addLocation(i, server(first + i + 1));
+    }
+    return metadata;
+}
+
+void MetadataImageTest::roundTrip() {
+    QHash<QString, FileMetadata> files;
+    files.insert("b/two", file("b/two", 3, 1));
+    files.insert("a", file("a", 1, 0));
+    files.insert("empty", file("empty", 0, 0));
+
+    int written = 0;
+    QVERIFY(MetadataImage::write(path("round.bin"), 7, nullptr, files, {}, &written));
+    QCOMPARE(written, 3);
+
+    MetadataImage image;
+    QVERIFY(image.open(path("round.bin")));
+    QCOMPARE(image.walGeneration(), 7u);
+    QCOMPARE(image.fileCount(), 3);
+    QCOMPARE(image.find("missing"), -1);
+    for (const FileMetadata& expected : std::as_const(files)) {
+        int index = image.find(expected.fileName);
+        QVERIFY(index >= 0);
+        QCOMPARE(image.fileName(index), expected.fileName);
+        QVERIFY(image.hydrate(index) == expected);
+    }
+}
+
+// unchanged files are copied from the base, changed ones replace theirs
+// and removed ones are left out
+void MetadataImageTest::writeOverBase() {
+    QHash<QString, FileMetadata> files;
+    for (const QString& name : {"a", "b", "c", "d"})
+        files.insert(name, file(name, 2, 0));
+    QVERIFY(MetadataImage::write(path("base.bin"), 1, nullptr, files));
+    MetadataImage base;
+    QVERIFY(base.open(path("base.bin")));
+
+    QHash<QString, FileMetadata> changed;
+    changed.insert("b", file("b", 4, 2));
+    changed.insert("bb", file("bb", 1, 1));
+    changed.insert("e", file("e", 2, 1));
+    int written = 0;
+    QVERIFY(MetadataImage::write(path("next.bin"), 2, &base, changed, {"c", "e"}, &written));
+    QCOMPARE(written, 5); // a, b, bb, d, e
+
+    MetadataImage next;
+    QVERIFY(next.open(path("next.bin")));
+    QCOMPARE(next.fileCount(), 5);
+    QCOMPARE(next.find("c"), -1);
+    QVERIFY(next.hydrate(next.find("a")) == files["a"]);
+    QVERIFY(next.hydrate(next.find("d")) == files["d"]);
+    QVERIFY(next.hydrate(next.find("b")) == changed["b"]);
+    QVERIFY(next.hydrate(next.find("bb")) == changed["bb"]);
+    // removed only drops files of the base
+    QVERIFY(next.hydrate(next.find("e")) == changed["e"]);
+}
+
+QTEST_APPLESS_MAIN(MetadataImageTest)
+#include "tst_metadataimage.moc"
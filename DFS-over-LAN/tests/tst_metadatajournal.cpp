@@ -0,0 +1,157 @@
+#include <QDir>
+#include <QTemporaryDir>
+#include <QtTest>
+#include <memory>
+
+#include "metadatajournal.h"
+#include "metadatastore.h"
+
+// The journal keeps its files in the working directory, so every test
+// runs in a fresh temporary one.
+class MetadataJournalTest : public QObject {
+    Q_OBJECT
+private slots:
+    void init();
+    void cleanup();
+    void replaysRecords();
+    void acknowledgesOnlyAfterCommit();
+    void stopsAtBadChecksum();
+    void ignoresTornTail();
+
+private:
+    static FileMetadata file(const QString& name, int chunks);
+    static QString onlySegment();
+    // logs a.bin and b.bin in a journal of their own, which syncs on destruction
+    static void logTwoFiles();
+
+    std::unique_ptr<QTemporaryDir> m_dir;
+    QString m_previous;
+};
+
+void MetadataJournalTest::init() {
+    m_dir = std::make_unique<QTemporaryDir>();
+    QVERIFY(m_dir->isValid());
+    m_previous = QDir::currentPath();
+    QVERIFY(QDir::setCurrent(m_dir->path()));
+}
+
+void MetadataJournalTest::cleanup() {
+    QDir::setCurrent(m_previous);
+    m_dir.reset();
+}
+
+FileMetadata MetadataJournalTest::file(const QString& name, int chunks) {
+    FileMetadata metadata;
+    metadata.fileName = name;
+    metadata.chunkSize = 4096;
+    metadata.size = qint64(chunks) * metadata.chunkSize;
+    metadata.resize(chunks, 2);
+    ServerTable& servers = ServerTable::instance();
+    for (int i = 0; i < chunks; ++i) {
+        metadata.addLocation(i, servers.intern("10.0.1.1", quint16(5000 + i % 2)));
+        metadata.addLocation(i, servers.intern("10.0.1.2", quint16(5001 - i % 2)));
+    }
+    return metadata;
+}
+
+QString MetadataJournalTest::onlySegment() {
+    const QStringList segments = QDir(".").entryList({"master_wal.*.log"}, QDir::Files);
+    return segments.size() == 1 ? segments.first() : QString();
+}
+
+void MetadataJournalTest::logTwoFiles() {
+    MetadataStore store;
+    MetadataJournal journal(store);
+    journal.recover();
+    journal.logAllocate(file("a.bin", 2));
+    journal.logAllocate(file("b.bin", 3));
+}
+
+void MetadataJournalTest::replaysRecords() {
+    {
+        MetadataStore store;
+        MetadataJournal journal(store);
+        journal.recover();
+        journal.logAllocate(file("d/a.bin", 2));
+        journal.logAllocate(file("d/b.bin", 1));
+        QVERIFY(journal.logMkdir("/empty/dir"));
+        QVERIFY(journal.logDelete("d/b.bin"));
+        quint16 from = ServerTable::instance().intern("10.0.1.1", 5000);
+        quint16 to = ServerTable::instance().intern("10.0.1.3", 5002);
+        QVERIFY(journal.logMoveReplica("d/a.bin", 0, from, to));
+        journal.sync();
+    }
+
+    MetadataStore store;
+    MetadataJournal journal(store);
+    journal.recover();
+    QCOMPARE(store.size(), qsizetype(1));
+    FileMetadata expected = file("d/a.bin", 2);
+    expected.replaceLocation(0, ServerTable::instance().intern("10.0.1.1", 5000),
+                             ServerTable::instance().intern("10.0.1.3", 5002));
+    FileMetadata replayed;
+    QVERIFY(store.lookup("d/a.bin", replayed));
+    QVERIFY(replayed == expected);
+    QVERIFY(!store.contains("d/b.bin"));
+    QVERIFY(store.tree().isDirectory("empty/dir"));
+}
+
+void MetadataJournalTest::acknowledgesOnlyAfterCommit() {
+    MetadataStore store;
+    MetadataJournal journal(store);
+    journal.recover();
+    bool durable = false;
+    journal.logAllocate(file("x.bin", 1), nullptr, [&durable]() { durable = true; });
+    QVERIFY(!durable);
+    QVERIFY(store.contains("x.bin"));
+    // the group commit timer fires on the event loop
+    QTRY_VERIFY(durable);
+    QVERIFY(!journal.isFailing());
+
+    // a mutation that changes nothing writes no record and never calls back
+    bool added = false;
+    int unknown = -1;
+    quint16 server = ServerTable::instance().intern("10.0.1.1", 5000);
+    QCOMPARE(journal.logAddReplicas(server, {{"x.bin", 0}}, &unknown, nullptr, [&added]() { added = true; }), 0);
+    QCOMPARE(unknown, 0);
+    journal.sync();
+    QVERIFY(!added);
+}
+
+// a record whose checksum does not match ends replay: it and everything
+// after it were never acknowledged
+void MetadataJournalTest::stopsAtBadChecksum() {
+    logTwoFiles();
+    QString segment = onlySegment();
+    QVERIFY(!segment.isEmpty());
+    QFile wal(segment);
+    QVERIFY(wal.open(QIODevice::ReadWrite));
+    QByteArray data = wal.readAll();
+    data[data.size() - 1] = char(data.at(data.size() - 1) ^ 0x5a);
+    QVERIFY(wal.seek(0));
+    QCOMPARE(wal.write(data), qint64(data.size()));
+    wal.close();
+
+    MetadataStore store;
+    MetadataJournal journal(store);
+    journal.recover();
+    QVERIFY(store.contains("a.bin"));
+    QVERIFY(!store.contains("b.bin"));
+}
+
+void MetadataJournalTest::ignoresTornTail() {
+    logTwoFiles();
+    QString segment = onlySegment();
+    QVERIFY(!segment.isEmpty());
+    QFile wal(segment);
+    QVERIFY(wal.resize(wal.size() - 3));
+
+    MetadataStore store;
+    MetadataJournal journal(store);
+    journal.recover();
+    QCOMPARE(store.size(), qsizetype(1));
+    QVERIFY(store.contains("a.bin"));
+}
+
+QTEST_GUILESS_MAIN(MetadataJournalTest)
+#include "tst_metadatajournal.moc"
@@ -0,0 +1,135 @@
+#include <QTemporaryDir>
+#include <QtTest>
+#include <thread>
+#include <vector>
+
+#include "metadatastore.h"
+
+class MetadataStoreTest : public QObject {
+    Q_OBJECT
+private slots:
+    void initTestCase();
+    void counts();
+    void snapshot();
+    void concurrentWriters();
+    void tracksNamespace();
+
+private:
+    static quint16 server(int n);
+    static FileMetadata file(const QString& name, int chunks, int first);
+    QString path(const QString& name) const { return m_dir.filePath(name); }
+
+    QTemporaryDir m_dir;
+};
+
+void MetadataStoreTest::initTestCase() {
+    QVERIFY(m_dir.isValid());
+    for (int n = 0; n < 3; ++n)
+        QVERIFY(server(n) != ServerTable::NO_SERVER);
+}
+
+quint16 MetadataStoreTest::server(int n) {
+    return ServerTable::instance().intern("10.0.0." + QString::number(n % 3 + 1), quint16(5000 + n % 3));
+}
+
+// two replicas per chunk on consecutive servers
+FileMetadata MetadataStoreTest::file(const QString& name, int chunks, int first) {
+    FileMetadata metadata;
+    metadata.fileName = name;
+    metadata.chunkSize = 1024;
+    metadata.size = chunks > 0 ? qint64(chunks) * metadata.chunkSize - 10 : 0;
+    metadata.resize(chunks, 2);
+    for (int i = 0; i < chunks; ++i) {
+        metadata.addLocation(i, server(first + i));
+        metadata.addLocation(i, server(first + i + 1));
+    }
+    return metadata;
+}
+
+void MetadataStoreTest::counts() {
+    MetadataStore store;
+    QVERIFY(!store.insert(file("x/1", 1, 0)));
+    QVERIFY(!store.insert(file("x/2", 1, 0)));
+    QCOMPARE(store.size(), qsizetype(2));
+
+    FileMetadata previous;
+    QVERIFY(store.insert(file("x/1", 2, 1), &previous));
+    QVERIFY(previous == file("x/1", 1, 0));
+    QCOMPARE(store.size(), qsizetype(2));
+
+    QVERIFY(store.remove("x/2"));
+    QVERIFY(!store.remove("x/2"));
+    QCOMPARE(store.size(), qsizetype(1));
+    QVERIFY(!store.contains("x/2"));
+    QCOMPARE(store.fileIds(), QStringList({"x/1"}));
+}
+
+// after an image replaces the overlay, counts keep covering both and a
+// delete hides the image's copy
+void MetadataStoreTest::snapshot() {
+    MetadataStore store;
+    for (const QString& name : {"s/a", "s/b", "s/c"})
+        store.insert(file(name, 2, 0));
+    QVERIFY(store.snapshot().write(path("store.bin"), 3));
+
+    auto image = QSharedPointer<MetadataImage>::create();
+    QVERIFY(image->open(path("store.bin")));
+    store.setImage(image);
+    QCOMPARE(store.size(), qsizetype(3));
+    // unchanged files are served from the image alone
+    QVERIFY(store.snapshot().changes().isEmpty());
+
+    QVERIFY(store.remove("s/a"));
+    QCOMPARE(store.size(), qsizetype(2));
+    FileMetadata metadata;
+    QVERIFY(!store.lookup("s/a", metadata));
+
+    QVERIFY(!store.insert(file("s/a", 1, 2)));
+    QVERIFY(!store.insert(file("s/d", 1, 2)));
+    QCOMPARE(store.size(), qsizetype(4));
+    QVERIFY(store.update("s/b", [](FileMetadata& file) { file.size = 1; }));
+    QVERIFY(store.lookup("s/b", metadata));
+    QCOMPARE(metadata.size, qint64(1));
+    QCOMPARE(store.snapshot().changes().size(), qsizetype(3)); // s/a, s/b, s/d
+}
+
+// worker threads write disjoint files while others read them back
+void MetadataStoreTest::concurrentWriters() {
+    MetadataStore store;
+    constexpr int THREADS = 4;
+    constexpr int FILES = 500;
+    std::atomic<int> misses{0};
+    std::vector<std::thread> threads;
+    for (int t = 0; t < THREADS; ++t) {
+        threads.emplace_back([&, t] {
+            for (int i = 0; i < FILES; ++i) {
+                QString name = QString("t%1/%2").arg(t).arg(i);
+                store.insert(file(name, 1, i));
+                store.update(name, [](FileMetadata& file) { ++file.size; });
+                FileMetadata metadata;
+                if (!store.lookup(name, metadata) || metadata.size != file(name, 1, i).size + 1)
+                    ++misses;
+            }
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+    QCOMPARE(misses.load(), 0);
+    QCOMPARE(store.size(), qsizetype(THREADS * FILES));
+}
+
+// inserts and removes keep the directory tree in step with the file table
+void MetadataStoreTest::tracksNamespace() {
+    MetadataStore store;
+    for (const QString& name : {"n/a", "n/b", "n/sub/c"})
+        store.insert(file(name, 1, 0));
+    QVERIFY(store.remove("n/b"));
+
+    QStringList ids;
+    QString next;
+    QVERIFY(store.tree().listRecursive("n", QString(), 10, ids, next));
+    QCOMPARE(ids, QStringList({"n/a", "n/sub/c"}));
+}
+
+QTEST_GUILESS_MAIN(MetadataStoreTest)
+#include "tst_metadatastore.moc"
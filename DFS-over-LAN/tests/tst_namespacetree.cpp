@@ -0,0 +1,100 @@
+#include <QtTest>
+
+#include "namespacetree.h"
+
+class NamespaceTreeTest : public QObject {
+    Q_OBJECT
+private slots:
+    void canonical();
+    void listPages();
+    void listRecursivePages();
+    void removeFileKeepsDirectories();
+    void mkdir();
+};
+
+void NamespaceTreeTest::canonical() {
+    QCOMPARE(NamespaceTree::canonical("/a//b/"), QString("a/b"));
+    QCOMPARE(NamespaceTree::canonical("a/b"), QString("a/b"));
+    QCOMPARE(NamespaceTree::canonical("//"), QString());
+}
+
+// a file sorts before a directory of the same name, and every page resumes
+// exactly after the previous one
+void NamespaceTreeTest::listPages() {
+    NamespaceTree tree;
+    tree.addFile("d/b");
+    tree.addFile("d/a");
+    tree.addFile("d/c");
+    tree.addFile("d/b/x");
+    tree.addFile("d/e/y");
+
+    QStringList entries;
+    QString next;
+    QVERIFY(tree.list("d", QString(), 2, entries, next));
+    QCOMPARE(entries, QStringList({"a", "b"}));
+    QCOMPARE(next, QString("b"));
+
+    QVERIFY(tree.list("d", next, 2, entries, next));
+    QCOMPARE(entries, QStringList({"b/", "c"}));
+    QCOMPARE(next, QString("c"));
+
+    QVERIFY(tree.list("d", next, 2, entries, next));
+    QCOMPARE(entries, QStringList({"e/"}));
+    QVERIFY(next.isEmpty());
+
+    QVERIFY(!tree.list("missing", QString(), 10, entries, next));
+}
+
+void NamespaceTreeTest::listRecursivePages() {
+    NamespaceTree tree;
+    const QStringList files = {"r/f1", "r/f2", "r/a/g1", "r/a/b/h1", "r/a/b/h2", "r/z/i1"};
+    for (const QString& file : files)
+        tree.addFile(file);
+
+    // each directory's files first, then its subdirectories in name order
+    const QStringList expected = {"r/f1", "r/f2", "r/a/g1", "r/a/b/h1", "r/a/b/h2", "r/z/i1"};
+    for (int limit = 1; limit <= expected.size() + 1; ++limit) {
+        QStringList all;
+        QStringList page;
+        QString after;
+        QString next;
+        do {
+            QVERIFY(tree.listRecursive("r", after, limit, page, next));
+            QVERIFY(page.size() <= limit);
+            all += page;
+            after = next;
+        } while (!next.isEmpty());
+        QCOMPARE(all, expected);
+    }
+
+    QStringList page;
+    QString next;
+    QVERIFY(tree.listRecursive("r/a", QString(), 10, page, next));
+    QCOMPARE(page, QStringList({"r/a/g1", "r/a/b/h1", "r/a/b/h2"}));
+    // a cursor outside the listed directory is rejected
+    QVERIFY(!tree.listRecursive("r/a", "r/z/i1", 10, page, next));
+}
+
+void NamespaceTreeTest::removeFileKeepsDirectories() {
+    NamespaceTree tree;
+    tree.addFile("x/y/file");
+    tree.removeFile("x/y/file");
+
+    QStringList entries;
+    QString next;
+    QVERIFY(tree.list("x/y", QString(), 10, entries, next));
+    QVERIFY(entries.isEmpty());
+    QVERIFY(tree.isDirectory("x/y"));
+    QCOMPARE(tree.leafDirectories(), QStringList({"/x/y"}));
+}
+
+void NamespaceTreeTest::mkdir() {
+    NamespaceTree tree;
+    QVERIFY(tree.mkdir("/p/q"));
+    QVERIFY(!tree.mkdir("p//q/"));
+    QVERIFY(tree.isDirectory("p"));
+    QVERIFY(!tree.isDirectory("p/r"));
+}
+
+QTEST_APPLESS_MAIN(NamespaceTreeTest)
+#include "tst_namespacetree.moc"
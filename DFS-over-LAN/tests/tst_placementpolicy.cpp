@@ -0,0 +1,121 @@
+#include <QSet>
+#include <QtTest>
+
+#include "chunkservermonitor.h"
+#include "placementpolicy.h"
+
+class PlacementPolicyTest : public QObject {
+    Q_OBJECT
+private slots:
+    void createKnowsEveryName();
+    void roundRobinCycles();
+    void leastLoadedPicksIdlest();
+    void powerOfTwoAvoidsBusiest();
+    void capacityWeightedSkipsFullServers();
+    void consistentHashIsStable();
+
+private:
+    static void report(ChunkServerMonitor& monitor, int serverId, int queueDepth, qint64 freeBytes = 1 << 20);
+};
+
+void PlacementPolicyTest::report(ChunkServerMonitor& monitor, int serverId, int queueDepth, qint64 freeBytes) {
+    ChunkServerStatus status;
+    status.serverId = serverId;
+    status.capacityBytes = 1 << 20;
+    status.freeBytes = freeBytes;
+    status.queueDepth = queueDepth;
+    QVERIFY(monitor.heartbeat(status, "10.0.1." + QString::number(serverId), quint16(5000 + serverId)));
+}
+
+void PlacementPolicyTest::createKnowsEveryName() {
+    for (const QString& name : PlacementPolicy::names()) {
+        std::unique_ptr<PlacementPolicy> policy = PlacementPolicy::create(name);
+        QVERIFY(policy);
+        QCOMPARE(policy->name(), name);
+    }
+    QVERIFY(!PlacementPolicy::create("nearest"));
+}
+
+void PlacementPolicyTest::roundRobinCycles() {
+    ChunkServerMonitor monitor;
+    RoundRobinPlacement policy;
+    const QVector<int> candidates{1, 2, 3};
+    int previous = policy.pick(candidates, monitor);
+    QHash<int, int> counts{{previous, 1}};
+    for (int i = 1; i < 6; ++i) {
+        int next = policy.pick(candidates, monitor);
+        QCOMPARE(next, candidates[(candidates.indexOf(previous) + 1) % candidates.size()]);
+        ++counts[next];
+        previous = next;
+    }
+    for (int candidate : candidates)
+        QCOMPARE(counts.value(candidate), 2);
+}
+
+void PlacementPolicyTest::leastLoadedPicksIdlest() {
+    ChunkServerMonitor monitor;
+    report(monitor, 1, 5);
+    report(monitor, 2, 1);
+    report(monitor, 3, 3);
+    LeastLoadedPlacement policy;
+    const QVector<int> candidates{1, 2, 3};
+    QCOMPARE(policy.pick(candidates, monitor), 2);
+
+    // chunks placed since the last heartbeat count as load; ties keep the earlier candidate
+    monitor.noteAssigned(2);
+    monitor.noteAssigned(2);
+    QCOMPARE(policy.pick(candidates, monitor), 2);
+    monitor.noteAssigned(2);
+    QCOMPARE(policy.pick(candidates, monitor), 3);
+
+    // the next heartbeat resets the placed count
+    report(monitor, 2, 1);
+    QCOMPARE(policy.pick(candidates, monitor), 2);
+}
+
+void PlacementPolicyTest::powerOfTwoAvoidsBusiest() {
+    ChunkServerMonitor monitor;
+    report(monitor, 1, 0);
+    report(monitor, 2, 1);
+    report(monitor, 3, 9);
+    PowerOfTwoPlacement policy;
+    QCOMPARE(policy.pick({3}, monitor), 3);
+    for (int i = 0; i < 200; ++i)
+        QVERIFY(policy.pick({1, 2, 3}, monitor) != 3);
+}
+
+void PlacementPolicyTest::capacityWeightedSkipsFullServers() {
+    ChunkServerMonitor monitor;
+    report(monitor, 1, 0, 0);
+    report(monitor, 2, 0, 1 << 20);
+    CapacityWeightedPlacement policy;
+    // 4 has not reported yet and is weighted like an average server
+    QSet<int> picked;
+    for (int i = 0; i < 200; ++i)
+        picked.insert(policy.pick({1, 2, 4}, monitor));
+    QVERIFY(!picked.contains(1));
+    QVERIFY(picked.contains(2));
+    QVERIFY(picked.contains(4));
+}
+
+void PlacementPolicyTest::consistentHashIsStable() {
+    QVector<HashRing::Member> members;
+    for (int n = 0; n < 5; ++n)
+        members.append({0x0a000201u + quint32(n), quint16(5000 + n)});
+    ConsistentHashPlacement policy;
+    ConsistentHashPlacement other;
+    for (int i = 0; i < 50; ++i) {
+        QString chunkId = "file.bin_" + QString::number(i);
+        QVector<int> replicas = policy.placeByKey(chunkId, 3, members);
+        QCOMPARE(replicas.size(), 3);
+        QCOMPARE(QSet<int>(replicas.begin(), replicas.end()).size(), 3);
+        for (int replica : replicas)
+            QVERIFY(replica >= 0 && replica < members.size());
+        QCOMPARE(other.placeByKey(chunkId, 3, members), replicas);
+    }
+    // asking for more replicas than members returns each member once
+    QCOMPARE(policy.placeByKey("small", 8, members.mid(0, 2)).size(), 2);
+}
+
+QTEST_GUILESS_MAIN(PlacementPolicyTest)
+#include "tst_placementpolicy.moc"
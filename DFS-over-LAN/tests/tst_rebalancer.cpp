@@ -0,0 +1,116 @@
+#include <QDir>
+#include <QSignalSpy>
+#include <QTemporaryDir>
+#include <QtTest>
+#include <memory>
+
+#include "chunkservermonitor.h"
+#include "metadatajournal.h"
+#include "metadatastore.h"
+#include "rebalancer.h"
+#include "topology.h"
+
+// The journal keeps its files in the working directory, so every test
+// runs in a fresh temporary one.
+class RebalancerTest : public QObject {
+    Q_OBJECT
+private slots:
+    void init();
+    void cleanup();
+    void repairsFewestReplicasFirst();
+
+private:
+    static quint16 report(ChunkServerMonitor& monitor, int serverId, qint64 freeBytes);
+    static FileMetadata file(const QString& name, const QVector<quint16>& replicas);
+
+    std::unique_ptr<QTemporaryDir> m_dir;
+    QString m_previous;
+};
+
+void RebalancerTest::init() {
+    m_dir = std::make_unique<QTemporaryDir>();
+    QVERIFY(m_dir->isValid());
+    m_previous = QDir::currentPath();
+    QVERIFY(QDir::setCurrent(m_dir->path()));
+}
+
+void RebalancerTest::cleanup() {
+    QDir::setCurrent(m_previous);
+    m_dir.reset();
+}
+
+quint16 RebalancerTest::report(ChunkServerMonitor& monitor, int serverId, qint64 freeBytes) {
+    ChunkServerStatus status;
+    status.serverId = serverId;
+    status.capacityBytes = 1 << 30;
+    status.freeBytes = freeBytes;
+    monitor.heartbeat(status, "10.0.3." + QString::number(serverId), quint16(5000 + serverId));
+    monitor.status(serverId, &status);
+    return status.server;
+}
+
+// one chunk of 1 KiB on the given servers
+FileMetadata RebalancerTest::file(const QString& name, const QVector<quint16>& replicas) {
+    FileMetadata metadata;
+    metadata.fileName = name;
+    metadata.chunkSize = 1024;
+    metadata.size = metadata.chunkSize;
+    metadata.resize(1, replicas.size());
+    for (quint16 server : replicas)
+        metadata.addLocation(0, server);
+    return metadata;
+}
+
+// the chunk left with one live replica is copied before the one with two,
+// whatever the scan order, and a chunk with none is skipped
+void RebalancerTest::repairsFewestReplicasFirst() {
+    MetadataStore store;
+    MetadataJournal journal(store);
+    journal.recover();
+    ChunkServerMonitor monitor;
+    Topology topology;
+    Rebalancer rebalancer(store, &journal, &monitor, topology);
+
+    quint16 a = report(monitor, 1, 1 << 28);
+    quint16 b = report(monitor, 2, 1 << 29);
+    quint16 spare = report(monitor, 3, 1 << 29);
+    quint16 fuller = report(monitor, 4, 1 << 20);
+    quint16 lost = ServerTable::instance().intern("10.0.3.9", 5009);
+    QVERIFY(a != ServerTable::NO_SERVER && spare != ServerTable::NO_SERVER && fuller != ServerTable::NO_SERVER);
+    QVERIFY(lost != ServerTable::NO_SERVER);
+
+    store.insert(file("r/1-two-left", {lost, a, b}));
+    store.insert(file("r/2-one-left", {lost, b}));
+    store.insert(file("r/3-none-left", {lost}));
+
+    QSignalSpy replicate(&rebalancer, &Rebalancer::replicate);
+    // one chunk's worth of budget per tick
+    rebalancer.setRepairBandwidth(1024);
+    rebalancer.m_lostServers.insert(lost, -Rebalancer::REPAIR_GRACE_MS);
+
+    rebalancer.tick();
+    QCOMPARE(replicate.size(), 1);
+    QCOMPARE(replicate[0][1].toString(), QString("r/2-one-left_chunk_0"));
+    QCOMPARE(replicate[0][0].toInt(), 2);
+    // the emptier of the servers not holding the chunk yet
+    QCOMPARE(replicate[0][2].value<quint16>(), spare);
+
+    rebalancer.tick();
+    QCOMPARE(replicate.size(), 2);
+    QCOMPARE(replicate[1][1].toString(), QString("r/1-two-left_chunk_0"));
+    QCOMPARE(replicate[1][2].value<quint16>(), spare);
+
+    rebalancer.tick();
+    QCOMPARE(replicate.size(), 2);
+
+    // an ACKed copy takes the lost replica's place
+    rebalancer.copyFinished("r/2-one-left_chunk_0", spare, true);
+    FileMetadata metadata;
+    QVERIFY(store.lookup("r/2-one-left", metadata));
+    QCOMPARE(metadata.locationCount(0), 2);
+    QCOMPARE(metadata.location(0, 0), spare);
+    QCOMPARE(metadata.location(0, 1), b);
+}
+
+QTEST_GUILESS_MAIN(RebalancerTest)
+#include "tst_rebalancer.moc"
@@ -0,0 +1,54 @@
+#include <QtTest>
+
+#include "rttEstimator.h"
+
+class RttEstimatorTest : public QObject {
+    Q_OBJECT
+private slots:
+    void initialTimeout();
+    void smoothsSamples();
+    void clampsToBounds();
+    void backoffDoublesUpToMax();
+};
+
+void RttEstimatorTest::initialTimeout() {
+    RttEstimator rtt;
+    QCOMPARE(rtt.rto(), RttEstimator::INITIAL_RTO_MS);
+}
+
+// RFC 6298: the first sample sets SRTT = R and RTTVAR = R/2, later ones
+// move them by 1/8 and 1/4
+void RttEstimatorTest::smoothsSamples() {
+    RttEstimator rtt;
+    rtt.addSample(100);
+    QCOMPARE(rtt.rto(), qint64(300)); // 100 + 4 * 50
+    rtt.addSample(100);
+    QCOMPARE(rtt.rto(), qint64(250)); // 100 + 4 * 37.5
+    rtt.addSample(180);
+    QCOMPARE(rtt.rto(), qint64(303)); // 110 + 4 * 48.125, rounded up
+}
+
+void RttEstimatorTest::clampsToBounds() {
+    RttEstimator fast;
+    fast.addSample(1);
+    QCOMPARE(fast.rto(), RttEstimator::MIN_RTO_MS);
+
+    RttEstimator slow;
+    slow.addSample(5000);
+    QCOMPARE(slow.rto(), RttEstimator::MAX_RTO_MS);
+}
+
+void RttEstimatorTest::backoffDoublesUpToMax() {
+    RttEstimator rtt;
+    const qint64 expected[] = {400, 800, 1600, 2000, 2000};
+    for (qint64 rto : expected) {
+        rtt.backoff();
+        QCOMPARE(rtt.rto(), rto);
+    }
+    // a new sample replaces the backed-off value
+    rtt.addSample(100);
+    QCOMPARE(rtt.rto(), qint64(300));
+}
+
+QTEST_APPLESS_MAIN(RttEstimatorTest)
+#include "tst_rttestimator.moc"